@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 
 int main(int argc, char *argv[]) {
@@ -5,3 +6,78 @@ int main(int argc, char *argv[]) {
     (void) argv;
     abort();
 }
+
+// Initialization export run by rlbox_wasm2c_preinit when building the
+// pre-initialized image of the test library
+int rlbox_preinit_value = 0;
+
+void rlbox_preinit(void) {
+    rlbox_preinit_value = 42;
+}
+
+// Allocate and free many objects with a single invocation into the sandbox,
+// used by malloc_in_sandbox_bulk and free_in_sandbox_bulk of the wasm2c plugin.
+// Failed allocations are reported as null pointers.
+void rlbox_malloc_bulk(const size_t* sizes, void** ptrs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        ptrs[i] = malloc(sizes[i]);
+    }
+}
+
+void rlbox_free_bulk(void* const* ptrs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(ptrs[i]);
+    }
+}
+
+// Runs a batch of calls recorded by rlbox_batch with a single invocation into
+// the sandbox. The layout of the commands and the maximum number of arguments
+// must match rlbox_batch.hpp and wasm2c_batch.hpp.
+typedef struct {
+    uint32_t func;
+    uint32_t arg_count;
+    uint32_t has_return;
+    int32_t args[4];
+} rlbox_batch_command;
+
+typedef int32_t (*rlbox_batch_func0)(void);
+typedef int32_t (*rlbox_batch_func1)(int32_t);
+typedef int32_t (*rlbox_batch_func2)(int32_t, int32_t);
+typedef int32_t (*rlbox_batch_func3)(int32_t, int32_t, int32_t);
+typedef int32_t (*rlbox_batch_func4)(int32_t, int32_t, int32_t, int32_t);
+typedef void (*rlbox_batch_void_func0)(void);
+typedef void (*rlbox_batch_void_func1)(int32_t);
+typedef void (*rlbox_batch_void_func2)(int32_t, int32_t);
+typedef void (*rlbox_batch_void_func3)(int32_t, int32_t, int32_t);
+typedef void (*rlbox_batch_void_func4)(int32_t, int32_t, int32_t, int32_t);
+
+void rlbox_batch_dispatch(const rlbox_batch_command* commands,
+                          uint32_t count,
+                          int32_t* results) {
+    for (uint32_t i = 0; i < count; i++) {
+        const rlbox_batch_command* c = &commands[i];
+        const int32_t* a = c->args;
+        uintptr_t f = c->func;
+        int32_t ret = 0;
+        if (c->has_return) {
+            switch (c->arg_count) {
+                case 0: ret = ((rlbox_batch_func0)f)(); break;
+                case 1: ret = ((rlbox_batch_func1)f)(a[0]); break;
+                case 2: ret = ((rlbox_batch_func2)f)(a[0], a[1]); break;
+                case 3: ret = ((rlbox_batch_func3)f)(a[0], a[1], a[2]); break;
+                case 4: ret = ((rlbox_batch_func4)f)(a[0], a[1], a[2], a[3]); break;
+                default: abort();
+            }
+        } else {
+            switch (c->arg_count) {
+                case 0: ((rlbox_batch_void_func0)f)(); break;
+                case 1: ((rlbox_batch_void_func1)f)(a[0]); break;
+                case 2: ((rlbox_batch_void_func2)f)(a[0], a[1]); break;
+                case 3: ((rlbox_batch_void_func3)f)(a[0], a[1], a[2]); break;
+                case 4: ((rlbox_batch_void_func4)f)(a[0], a[1], a[2], a[3]); break;
+                default: abort();
+            }
+        }
+        results[i] = ret;
+    }
+}
@@ -25,26 +25,20 @@ auto rlbox_mswasm_sandbox::serialize_to_sandbox(T_ActualRet arg)
   }
 }
 
-template<uint32_t N, typename T_Ret, typename... T_Args>
+template<typename T_Ret, typename... T_Args>
 // returns host representation of  the Wasm version of T_Ret
 // typename mswasm_detail::convert_type_to_wasm_type<T_Ret>::type
-inline rlbox_mswasm_sandbox::T_Guest<T_Ret>
-rlbox_mswasm_sandbox::callback_interceptor_inner(void* /* vmContext */,
+rlbox_mswasm_sandbox::T_Guest<T_Ret>
+rlbox_mswasm_sandbox::callback_interceptor_inner(uint32_t callback_num,
                                                  T_Guest<T_Args>... params)
 {
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   auto& thread_data = *get_rlbox_mswasm_sandbox_thread_data();
 #endif
-  thread_data.last_callback_invoked = N;
+  thread_data.last_callback_invoked = callback_num;
   using T_Func = T_Ret (*)(T_Args...); // Host type signature?
-  T_Func func;
-  {
-#ifndef RLBOX_SINGLE_THREADED_INVOCATIONS
-    RLBOX_ACQUIRE_SHARED_GUARD(lock, thread_data.sandbox->callback_mutex);
-#endif
-    // lookup callback
-    func = reinterpret_cast<T_Func>(thread_data.sandbox->callbacks[N]);
-  }
+  auto func = reinterpret_cast<T_Func>(
+    thread_data.sandbox->callbacks.read(callback_num).first);
   // Callbacks are invoked through function pointers, cannot use std::forward
   // as we don't have caller context for T_Args, which means they are all
   // effectively passed by value
@@ -64,7 +58,7 @@ rlbox_mswasm_sandbox::T_Guest<T_Ret> rlbox_mswasm_sandbox::callback_interceptor(
   void* /* vmContext */,
   T_Guest<T_Args>... params)
 {
-  return callback_interceptor_inner<N, T_Ret, T_Args...>(params...);
+  return callback_interceptor_inner<T_Ret, T_Args...>(N, params...);
 }
 
 // if  the callback returns a struct/class, then write it to the sandbox and
@@ -76,7 +70,7 @@ void rlbox_mswasm_sandbox::callback_interceptor_promoted(
   T_Guest<T_Ret> ret,
   T_Guest<T_Args>... params)
 {
-  auto ret_val = callback_interceptor_inner<N, T_Ret, T_Args...>(params...);
+  auto ret_val = callback_interceptor_inner<T_Ret, T_Args...>(N, params...);
 
   // Copy the return value back
   auto ret_ptr = reinterpret_cast<T_Ret*>(
@@ -129,7 +123,7 @@ rlbox_mswasm_sandbox::impl_register_callback(void* key, void* callback)
   // callback_unique_keys[found_loc] = key;
   // callbacks[found_loc] = callback;
   // callback_slot_assignment[found_loc] = slot_number;
-  // slot_assignments[slot_number] = callback;
+  // slot_assignments.insert(slot_number, callback);
 
   // return static_cast<T_PointerType>(slot_number);
 }
@@ -27,9 +27,16 @@ void* rlbox_mswasm_sandbox::symbol_lookup(std::string prefixed_name)
 
 #ifndef RLBOX_USE_STATIC_CALLS
 void* rlbox_mswasm_sandbox::impl_lookup_symbol(const char* func_name)
+{
+  return impl_lookup_symbol(rlbox_export_name_hash(func_name), func_name);
+}
+
+void* rlbox_mswasm_sandbox::impl_lookup_symbol(uint64_t hash,
+                                               const char* func_name)
 {
   // Can add a symbol name prefix here if need be
-  void* ret = symbol_lookup(func_name);
+  void* ret = loaded_module->export_cache.lookup(
+    hash, func_name, [&] { return symbol_lookup(func_name); });
   return ret;
 }
 #else
@@ -54,6 +61,31 @@ void* rlbox_mswasm_sandbox::impl_lookup_symbol(const char* func_name)
 }
 #endif
 
+inline rlbox_mswasm_sandbox_thread_data*
+rlbox_mswasm_sandbox::get_session_thread_data()
+{
+#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+  return get_rlbox_mswasm_sandbox_thread_data();
+#else
+  return &thread_data;
+#endif
+}
+
+/**
+ * @brief runs a batch of calls. mswasm functions are called directly on the
+ * host, so the batch only saves binding the sandbox to the thread per call.
+ */
+inline void rlbox_mswasm_sandbox::impl_invoke_batch(
+  const rlbox_batch_call* calls,
+  size_t count,
+  int32_t* results)
+{
+  rlbox_sandbox_session<rlbox_mswasm_sandbox> session(*this);
+  for (size_t i = 0; i < count; i++) {
+    results[i] = batch_detail::call_i32(calls[i], exec_env);
+  }
+}
+
 inline rlbox_mswasm_sandbox::T_PointerType
 rlbox_mswasm_sandbox::impl_malloc_in_sandbox(size_t size)
 {
@@ -70,6 +102,26 @@ inline void rlbox_mswasm_sandbox::impl_free_in_sandbox(T_PointerType p)
   free(p);
 }
 
+inline void rlbox_mswasm_sandbox::impl_malloc_in_sandbox_bulk(
+  const size_t* sizes,
+  size_t count,
+  T_PointerType* ptrs)
+{
+  // allocations don't enter the sandbox, so there is no transition to save
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = impl_malloc_in_sandbox(sizes[i]);
+  }
+}
+
+inline void rlbox_mswasm_sandbox::impl_free_in_sandbox_bulk(
+  const T_PointerType* ptrs,
+  size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    impl_free_in_sandbox(ptrs[i]);
+  }
+}
+
 // template<typename T_Ret, typename... T_Args>
 // uint32_t rlbox_mswasm_sandbox::get_mswasm_func_index(
 //   // dummy for template inference
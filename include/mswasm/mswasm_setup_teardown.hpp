@@ -27,6 +27,12 @@ namespace rlbox {
  * wasm heap allowed for this sandbox instance. When the value is zero, platform
  * defaults are used. Non-zero values are rounded to max(64k, next power of 2).
  * @param wasm_module_name optional module name used when compiling with mswasm
+ * @param eager_bind optional, load the module with RTLD_NOW so that its
+ * symbols are bound before any call. If an earlier sandbox of the module,
+ * which is still alive, loaded it lazily, the module stays lazily bound and
+ * creation still succeeds. Unlike the wasm2c sandbox, there are no callback
+ * signatures to prepare, as mswasm does not support callbacks yet, and no code
+ * pages to touch, as they cannot be walked on CHERI.
  * @return true when sandbox is successfully created
  * @return false when infallible if set to false and sandbox was not
  * successfully created. If infallible is set to true, this function will never
@@ -39,29 +45,43 @@ bool rlbox_mswasm_sandbox::impl_create_sandbox(
   bool infallible = true,
   uint32_t sbox_argc = 0,
   void* sbox_argv = nullptr,
-  const char* wasm_module_name = "")
+  const char* wasm_module_name = "",
+  bool eager_bind = false)
 {
   FALLIBLE_DYNAMIC_CHECK(
     infallible, sandbox == nullptr, "Sandbox already initialized");
 
-// 1) Open the dynamic library
+// 1) Get the dynamic library and its info func. Sandboxes of the same module
+// share the loaded library, so this only happens for the first sandbox.
 #ifndef RLBOX_USE_STATIC_CALLS
-  library = dlopen(mswasm_module_path, RTLD_LAZY);
-#endif
-  if (!library) {
-    std::string error_msg = "Could not load mswasm dynamic library: ";
-
-    error_msg += dlerror();
-    FALLIBLE_DYNAMIC_CHECK(infallible, false, error_msg.c_str());
-    return library;
-  }
-  // 2) Summon the info func
-#ifndef RLBOX_USE_STATIC_CALLS
-  std::string info_func_name = wasm_module_name;
-  info_func_name += "get_mswasm_sandbox_info";
-  auto get_info_func = reinterpret_cast<mswasm_sandbox_funcs_t (*)()>(
-    symbol_lookup(info_func_name));
+  std::string error_msg;
+  loaded_module = rlbox_module_registry<mswasm_sandbox_funcs_t>::acquire(
+    mswasm_module_path,
+    wasm_module_name,
+    eager_bind ? RTLD_NOW : RTLD_LAZY,
+    [&](auto& module, std::string& init_error_msg) {
+      // 2) Summon the info func
+      std::string info_func_name = wasm_module_name;
+      info_func_name += "get_mswasm_sandbox_info";
+      auto get_info_func = reinterpret_cast<mswasm_sandbox_funcs_t (*)()>(
+        rlbox_module_registry<mswasm_sandbox_funcs_t>::lookup_library_symbol(
+          module.library, info_func_name.c_str()));
+      if (get_info_func == nullptr) {
+        init_error_msg =
+          "mswasm could not find <MODULE_NAME>get_mswasm_sandbox_info";
+        return false;
+      }
+      module.info = get_info_func();
+      return true;
+    },
+    error_msg);
+  FALLIBLE_DYNAMIC_CHECK(
+    infallible, loaded_module != nullptr, error_msg.c_str());
+  library = loaded_module->library;
+  sandbox_info = loaded_module->info;
 #else
+  // Statically linked, so the linker binds the symbols
+  RLBOX_UNUSED(eager_bind);
   // only permitted if there is no custom module name
   std::string wasm_module_name_str = wasm_module_name;
   FALLIBLE_DYNAMIC_CHECK(
@@ -70,13 +90,12 @@ bool rlbox_mswasm_sandbox::impl_create_sandbox(
     "Static calls not supported with non empty module names");
   auto get_info_func =
     reinterpret_cast<mswasm_sandbox_funcs_t (*)()>(get_mswasm_sandbox_info);
-#endif
   FALLIBLE_DYNAMIC_CHECK(
     infallible,
     get_info_func != nullptr,
     "mswasm could not find <MODULE_NAME>get_mswasm_sandbox_info");
-  // return get_info_func();
   sandbox_info = get_info_func();
+#endif
 
   // TODO: can't implement max memory without partitioned allocator.
 
@@ -95,20 +114,19 @@ bool rlbox_mswasm_sandbox::impl_create_sandbox(
 
 inline void rlbox_mswasm_sandbox::impl_destroy_sandbox()
 {
-  // 1) free the return slot
-  if (return_slot_size) {
-    impl_free_in_sandbox(return_slot);
-  }
+  // 1) free the scratch arena, which holds the return slots
+  scratch_arena.release([&](T_PointerType p) { impl_free_in_sandbox(p); });
   // 2) invoke the VmCtx destructor within the sandbox
   if (sandbox != nullptr) {
     sandbox_info.destroy_mswasm_sandbox(sandbox);
     sandbox = nullptr;
   }
 
-// 3) dlclose the library
+// 3) drop our reference to the library
 #ifndef RLBOX_USE_STATIC_CALLS
-  if (library != nullptr) {
-    dlclose(library);
+  if (loaded_module != nullptr) {
+    rlbox_module_registry<mswasm_sandbox_funcs_t>::release(loaded_module);
+    loaded_module = nullptr;
     library = nullptr;
   }
 #endif
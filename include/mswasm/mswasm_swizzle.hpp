@@ -29,6 +29,22 @@ inline bool rlbox_mswasm_sandbox::impl_is_pointer_in_sandbox_memory(
   return true;
 }
 
+// Sandboxed pointers are capabilities, whose bounds are checked by the
+// hardware on every access, so the copies need no software bounds check
+inline void rlbox_mswasm_sandbox::impl_copy_to_sandbox(T_PointerType dst,
+                                                       const void* src,
+                                                       size_t len)
+{
+  rlbox_bulk_copy(dst, src, len);
+}
+
+inline void rlbox_mswasm_sandbox::impl_copy_from_sandbox(void* dst,
+                                                         T_PointerType src,
+                                                         size_t len)
+{
+  rlbox_bulk_copy(dst, src, len);
+}
+
 // Note: removed impl_is_pointer_in_app_memory
 // Note: removed impl_get_total_memory
 // Note: removed impl_get_memory_location
@@ -42,15 +58,8 @@ inline void* rlbox_mswasm_sandbox::impl_get_unsandboxed_pointer(
   T_PointerType p) const
 {
   if constexpr (std::is_function_v<std::remove_pointer_t<T>>) {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-
     auto found = slot_assignments.find(p);
-    if (found != slot_assignments.end()) {
-      auto ret = found->second;
-      return const_cast<void*>(ret);
-    } else {
-      return nullptr;
-    }
+    return found ? const_cast<void*>(*found) : nullptr;
   } else {
     return reinterpret_cast<void*>(p);
   }
@@ -65,21 +74,20 @@ inline rlbox_mswasm_sandbox::T_PointerType
 rlbox_mswasm_sandbox::impl_get_sandboxed_pointer(const void* p) const
 {
   if constexpr (std::is_function_v<std::remove_pointer_t<T>>) {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-
     T_PointerType slot_number = 0;
     auto found = internal_callbacks.find(p);
-    if (found != internal_callbacks.end()) {
-      slot_number = found->second;
+    if (found) {
+      slot_number = *found;
     } else {
       // TODO: finish this once we've implemented callbacks
+      // RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
       // auto func_type_idx = get_mswasm_func_index(static_cast<T>(nullptr));
       // slot_number = sandbox_info.add_mswasm_callback(sandbox,
       //                                                func_type_idx,
       //                                                const_cast<void*>(p),
       //                                                WASM_RT_INTERNAL_FUNCTION);
-      // internal_callbacks[p] = slot_number;
-      // slot_assignments[slot_number] = p;
+      // internal_callbacks.insert(p, slot_number);
+      // slot_assignments.insert(slot_number, p);
     }
     return static_cast<T_PointerType>(slot_number);
   } else {
@@ -2,13 +2,20 @@
 
 // Pull the helper header from the main repo for dynamic_check and scope_exit
 #include "mswasm_details.hpp"
+#include "rlbox_batch.hpp"
+#include "rlbox_bulk_copy.hpp"
+#include "rlbox_callback_slots.hpp"
+#include "rlbox_concurrent_map.hpp"
 #include "rlbox_helpers.hpp"
+#include "rlbox_module_registry.hpp"
+#include "rlbox_sandbox_session.hpp"
+#include "rlbox_scratch_arena.hpp"
 #include "rlbox_synchronize.hpp"
 
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <limits>
-#include <map>
 #include <memory>
 #include <mutex>
 // RLBox allows applications to provide a custom shared lock implementation
@@ -16,6 +23,7 @@
 #  include <shared_mutex>
 #endif
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -33,6 +41,17 @@
 
 #define RLBOX_mswasm_UNUSED(...) (void)__VA_ARGS__
 
+#if defined(_MSC_VER)
+#  define RLBOX_MSWASM_NOINLINE __declspec(noinline)
+#else
+#  define RLBOX_MSWASM_NOINLINE __attribute__((noinline))
+#endif
+
+// The number of callbacks that can be registered with a sandbox at once
+#ifndef RLBOX_MSWASM_MAX_CALLBACKS
+#  define RLBOX_MSWASM_MAX_CALLBACKS 128
+#endif
+
 #if defined(_WIN32)
 using path_buf = const LPCWSTR;
 #else
@@ -88,6 +107,7 @@ private:
 #endif
   static std::once_flag mswasm_runtime_initialized;
 #ifndef RLBOX_USE_STATIC_CALLS
+  rlbox_loaded_module<mswasm_sandbox_funcs_t>* loaded_module = nullptr;
   void* library = nullptr;
 #endif
   // uintptr_t heap_base;
@@ -95,26 +115,32 @@ private:
   void* exec_env = 0;
   // void* malloc_index = 0;
   // void* free_index = 0;
-  size_t return_slot_size = 0;
-  T_PointerType return_slot = 0;
+  // Per invocation storage for class arguments and return values
+  rlbox_scratch_arena<T_PointerType> scratch_arena;
 
   // callback state
-  static const size_t MAX_CALLBACKS = 128;
+  static const size_t MAX_CALLBACKS = RLBOX_MSWASM_MAX_CALLBACKS;
   mutable RLBOX_SHARED_LOCK(callback_mutex);
   // void* callback_unique_keys[MAX_CALLBACKS]{ 0 };
   // Wasm callback index -> host function pointer
-  void* callbacks[MAX_CALLBACKS]{ 0 };
+  // Read by the callback interceptors without locking
+  rlbox_callback_registrations<MAX_CALLBACKS> callbacks;
   // uint32_t callback_slot_assignment[MAX_CALLBACKS]{ 0 };
   // TODO: may be able to remove both of these entirely since we have same
   // pointer representation in guest and host?
-  mutable std::map<const void*, T_PointerType> internal_callbacks;
-  mutable std::map<T_PointerType, const void*> slot_assignments;
+  mutable rlbox_concurrent_map<const void*, T_PointerType> internal_callbacks;
+  mutable rlbox_concurrent_map<T_PointerType, const void*> slot_assignments;
 
 #ifndef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   thread_local static inline rlbox_mswasm_sandbox_thread_data thread_data{ 0,
                                                                            0 };
 #endif
 
+  // Thread that has bound this sandbox with an rlbox_sandbox_session
+  std::atomic<std::thread::id> session_thread{};
+  friend class rlbox_sandbox_session<rlbox_mswasm_sandbox>;
+  static inline rlbox_mswasm_sandbox_thread_data* get_session_thread_data();
+
   //////////////// Internal backend-specific helpers  ////////////////
 
   // if arg is a struct/class, return pointer to that struct, else return arg
@@ -122,10 +148,11 @@ private:
   template<typename T_FormalRet, typename T_ActualRet>
   inline auto serialize_to_sandbox(T_ActualRet arg);
 
-  // Trampoline invoked by sandbox when it wants to invoke a sandbox
-  template<uint32_t N, typename T_Ret, typename... T_Args>
-  inline static T_Guest<T_Ret> callback_interceptor_inner(
-    void* /* vmContext */,
+  // Dispatches callbacks of one signature. The interceptor of each slot only
+  // passes its slot number on, so the slots of a signature add little code.
+  template<typename T_Ret, typename... T_Args>
+  RLBOX_MSWASM_NOINLINE static T_Guest<T_Ret> callback_interceptor_inner(
+    uint32_t callback_num,
     T_Guest<T_Args>... params);
 
   // Trampoline invoked by sandbox when it wants to invoke a sandbox
@@ -138,10 +165,6 @@ private:
                                             T_Guest<T_Ret> ret,
                                             T_Guest<T_Args>... params);
 
-  // Each sandbox has an allocated region to pass return values back to the host
-  // application this function checks that the return slot is at least `size`
-  // bytes, and if it doesn't it expands the allocation
-  void ensure_return_slot_size(size_t size);
   // mswasm_sandbox_funcs_t* get_inner_sandbox_funcs( const char*
   // wasm_module_name);
 
@@ -160,6 +183,8 @@ public:
 //===== symbols
 #ifndef RLBOX_USE_STATIC_CALLS
   void* impl_lookup_symbol(const char* func_name);
+  // Looks up an export whose rlbox_export_name_hash is already known
+  void* impl_lookup_symbol(uint64_t hash, const char* func_name);
 #else
   template<typename T = void>
   void* impl_lookup_symbol(const char* func_name);
@@ -173,7 +198,8 @@ public:
     bool infallible,
     uint32_t sbox_argc,
     void* sbox_argv,
-    const char* wasm_module_name);
+    const char* wasm_module_name,
+    bool eager_bind);
   inline void impl_destroy_sandbox();
 
   //===== swizzling
@@ -186,12 +212,25 @@ public:
   static inline bool impl_is_in_same_sandbox(const void* p1, const void* p2);
   inline bool impl_is_pointer_in_sandbox_memory(const void* p);
 
+  inline void impl_copy_to_sandbox(T_PointerType dst,
+                                   const void* src,
+                                   size_t len);
+  inline void impl_copy_from_sandbox(void* dst, T_PointerType src, size_t len);
+
   //===== function invocation
   template<typename T, typename T_Converted, typename... T_Args>
   auto impl_invoke_with_func_ptr(T_Converted* func_ptr, T_Args&&... params);
+  inline void impl_invoke_batch(const rlbox_batch_call* calls,
+                                size_t count,
+                                int32_t* results);
 
   inline T_PointerType impl_malloc_in_sandbox(size_t size);
   inline void impl_free_in_sandbox(T_PointerType p);
+  inline void impl_malloc_in_sandbox_bulk(const size_t* sizes,
+                                          size_t count,
+                                          T_PointerType* ptrs);
+  inline void impl_free_in_sandbox_bulk(const T_PointerType* ptrs,
+                                        size_t count);
 
   //===== callbacks
   template<typename T_Ret, typename... T_Args>
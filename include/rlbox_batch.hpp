@@ -0,0 +1,362 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "rlbox_helpers.hpp"
+#include "rlbox_plugin_cast.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+namespace rlbox {
+
+// Declared in rlbox.hpp, which is included after the plugins that include this
+// header
+template<typename T, typename T_Sbx>
+class tainted;
+
+// The maximum number of arguments of a function called in a batch. This must
+// match the dispatcher in c_src/wasm2c_sandbox_wrapper.c
+#define RLBOX_BATCH_MAX_ARGS 4
+
+/**
+ * @brief A call recorded in an rlbox_batch. Arguments and return values are
+ * 32-bit integers, which covers the ints, longs and pointers of the 32-bit
+ * sandboxes. Pointers are recorded in their sandboxed representation.
+ */
+struct rlbox_batch_call
+{
+  // Address of the sandboxed function
+  void* func;
+  // Plugin specific handle for the function, e.g. the wasm2c table index
+  uintptr_t handle;
+  // Calls the function with its declared argument types, used by plugins that
+  // run batches as plain function calls
+  int32_t (*host_thunk)(void* func, const int32_t* args);
+  uint32_t arg_count;
+  uint32_t has_return;
+  int32_t args[RLBOX_BATCH_MAX_ARGS];
+};
+
+namespace batch_detail {
+  // The type a host type has in the sandbox, e.g. long is 32-bit in wasm2c
+  // but 64-bit in the cheri sandboxes
+  template<typename T, typename T_Sbx, typename = void>
+  struct sandbox_type
+  {
+    using type = T;
+  };
+
+  template<typename T, typename T_Sbx>
+  struct sandbox_type<T, T_Sbx, std::enable_if_t<std::is_pointer_v<T>>>
+  {
+    using type = typename T_Sbx::T_PointerType;
+  };
+
+  template<typename T_Sbx>
+  struct sandbox_type<long, T_Sbx>
+  {
+    using type = typename T_Sbx::T_LongType;
+  };
+
+  template<typename T_Sbx>
+  struct sandbox_type<unsigned long, T_Sbx>
+  {
+    using type = std::make_unsigned_t<typename T_Sbx::T_LongType>;
+  };
+
+  template<typename T_Sbx>
+  struct sandbox_type<long long, T_Sbx>
+  {
+    using type = typename T_Sbx::T_LongLongType;
+  };
+
+  template<typename T_Sbx>
+  struct sandbox_type<unsigned long long, T_Sbx>
+  {
+    using type = std::make_unsigned_t<typename T_Sbx::T_LongLongType>;
+  };
+
+  template<typename T, typename T_Sbx>
+  using sandbox_type_t =
+    typename sandbox_type<std::remove_cv_t<T>, T_Sbx>::type;
+
+  // Integers and pointers that are at most 32 bits wide in the sandbox
+  template<typename T, typename T_Sbx>
+  constexpr bool is_batch_value()
+  {
+    if constexpr (std::is_integral_v<T> || std::is_enum_v<T> ||
+                  std::is_pointer_v<T>) {
+      return sizeof(sandbox_type_t<T, T_Sbx>) <= sizeof(int32_t);
+    } else {
+      return false;
+    }
+  }
+
+  template<typename T, typename T_Sbx>
+  constexpr bool is_batch_value_v = is_batch_value<T, T_Sbx>();
+
+  template<typename T>
+  struct is_tainted_pointer : std::false_type
+  {};
+
+  template<typename T, typename T_Sbx>
+  struct is_tainted_pointer<tainted<T*, T_Sbx>> : std::true_type
+  {};
+
+  /**
+   * @brief converts an argument of a batched call to its 32-bit representation
+   * in the sandbox. Pointers are passed as tainted pointers and converted to
+   * their sandboxed representation.
+   */
+  template<typename T_Formal, typename T_Sbx, typename T_Arg>
+  inline int32_t to_batch_arg(T_Sbx* plugin, const T_Arg& arg)
+  {
+    if constexpr (std::is_pointer_v<T_Formal>) {
+      if constexpr (std::is_null_pointer_v<T_Arg>) {
+        RLBOX_UNUSED(plugin);
+        return 0;
+      } else {
+        static_assert(is_tainted_pointer<T_Arg>::value,
+                      "Pass pointer arguments of batched calls as tainted "
+                      "pointers");
+        return static_cast<int32_t>(
+          plugin->template impl_get_sandboxed_pointer<T_Formal>(
+            arg.UNSAFE_unverified()));
+      }
+    } else {
+      RLBOX_UNUSED(plugin);
+      using T_Sandboxed = sandbox_type_t<T_Formal, T_Sbx>;
+      const auto value = static_cast<T_Formal>(arg);
+      if constexpr (sizeof(T_Formal) > sizeof(T_Sandboxed)) {
+        detail::dynamic_check(
+          static_cast<T_Formal>(static_cast<T_Sandboxed>(value)) == value,
+          "Argument of a batched call does not fit in the sandbox's type");
+      }
+      return static_cast<int32_t>(static_cast<T_Sandboxed>(value));
+    }
+  }
+
+  template<typename T>
+  using to_i32 = int32_t;
+
+  template<typename T_Ret>
+  using to_i32_ret = std::conditional_t<std::is_void_v<T_Ret>, void, int32_t>;
+
+  template<typename T_Ret, typename... T_Args, size_t... I>
+  inline int32_t call_host(void* func,
+                           const int32_t* args,
+                           std::index_sequence<I...>)
+  {
+    auto func_ptr = reinterpret_cast<T_Ret (*)(T_Args...)>(func);
+    RLBOX_UNUSED(args);
+    if constexpr (std::is_void_v<T_Ret>) {
+      func_ptr(static_cast<T_Args>(args[I])...);
+      return 0;
+    } else {
+      return static_cast<int32_t>(func_ptr(static_cast<T_Args>(args[I])...));
+    }
+  }
+
+  template<typename T_Ret, typename... T_Args>
+  inline int32_t host_thunk(void* func, const int32_t* args)
+  {
+    return call_host<T_Ret, T_Args...>(
+      func, args, std::index_sequence_for<T_Args...>());
+  }
+
+  /**
+   * @brief calls a function whose arguments and return value are all i32,
+   * optionally preceded by extra leading arguments such as the wasm2c instance.
+   */
+  template<typename... T_Prefix>
+  inline int32_t call_i32(const rlbox_batch_call& call, T_Prefix... prefix)
+  {
+    const int32_t* a = call.args;
+    void* f = call.func;
+    using i = int32_t;
+    // clang-format off
+    if (call.has_return) {
+      switch (call.arg_count) {
+        case 0: return reinterpret_cast<i (*)(T_Prefix...)>(f)(prefix...);
+        case 1: return reinterpret_cast<i (*)(T_Prefix..., i)>(f)(prefix..., a[0]);
+        case 2: return reinterpret_cast<i (*)(T_Prefix..., i, i)>(f)(prefix..., a[0], a[1]);
+        case 3: return reinterpret_cast<i (*)(T_Prefix..., i, i, i)>(f)(prefix..., a[0], a[1], a[2]);
+        case 4: return reinterpret_cast<i (*)(T_Prefix..., i, i, i, i)>(f)(prefix..., a[0], a[1], a[2], a[3]);
+      }
+    } else {
+      switch (call.arg_count) {
+        case 0: reinterpret_cast<void (*)(T_Prefix...)>(f)(prefix...); break;
+        case 1: reinterpret_cast<void (*)(T_Prefix..., i)>(f)(prefix..., a[0]); break;
+        case 2: reinterpret_cast<void (*)(T_Prefix..., i, i)>(f)(prefix..., a[0], a[1]); break;
+        case 3: reinterpret_cast<void (*)(T_Prefix..., i, i, i)>(f)(prefix..., a[0], a[1], a[2]); break;
+        case 4: reinterpret_cast<void (*)(T_Prefix..., i, i, i, i)>(f)(prefix..., a[0], a[1], a[2], a[3]); break;
+      }
+    }
+    // clang-format on
+    return 0;
+  }
+
+  template<typename T_Sbx, typename = void>
+  struct has_invoke_batch : std::false_type
+  {};
+
+  template<typename T_Sbx>
+  struct has_invoke_batch<
+    T_Sbx,
+    std::void_t<decltype(std::declval<T_Sbx&>().impl_invoke_batch(
+      std::declval<const rlbox_batch_call*>(),
+      size_t(0),
+      std::declval<int32_t*>()))>> : std::true_type
+  {};
+
+  template<typename T_Sbx, typename = void>
+  struct has_prepare_batch_call : std::false_type
+  {};
+
+  template<typename T_Sbx>
+  struct has_prepare_batch_call<
+    T_Sbx,
+    std::void_t<decltype(std::declval<T_Sbx&>()
+                           .template impl_prepare_batch_call<int32_t>(
+                             std::declval<void*>()))>> : std::true_type
+  {};
+} // namespace batch_detail
+
+/**
+ * @brief Records a sequence of calls into a sandbox and runs them with a single
+ * transition into the sandbox. For wasm2c the calls are written to a command
+ * buffer in sandbox memory and run by the rlbox_batch_dispatch export of the
+ * sandboxed library. Plugins without a batch implementation, such as
+ * cheri_noop, run the calls directly on the host one after the other.
+ *
+ * Arguments and return values must be integers of at most 32 bits in the
+ * sandbox, e.g. long is accepted for wasm2c but not for the cheri sandboxes.
+ * Pointer arguments are passed as tainted pointers, for sandboxes with 32-bit
+ * pointers.
+ *
+ * Usage:
+ *   rlbox_batch<rlbox_wasm2c_sandbox> batch(sandbox);
+ *   rlbox_batch_add(batch, decode_row, row_ptr, 0);
+ *   rlbox_batch_add(batch, decode_row, row_ptr, 1);
+ *   std::vector<tainted<int32_t, rlbox_wasm2c_sandbox>> results = batch.run();
+ */
+template<typename T_Sbx>
+class rlbox_batch
+{
+private:
+  T_Sbx* plugin;
+  std::vector<rlbox_batch_call> calls;
+
+public:
+  template<typename T_Frontend>
+  explicit rlbox_batch(T_Frontend& sandbox)
+    : plugin(rlbox_get_plugin<T_Sbx>(sandbox))
+  {}
+
+  /**
+   * @brief records a call to the sandboxed function at func_ptr
+   *
+   * @tparam T_Func the signature of the function, e.g. decltype(func)
+   * @return the index of the call's result in the results of run
+   */
+  template<typename T_Func, typename... T_Args>
+  inline size_t add_func_ptr(void* func_ptr, T_Args... args)
+  {
+    return add_call(static_cast<T_Func*>(nullptr), func_ptr, args...);
+  }
+
+  /**
+   * @brief records a call to the sandboxed function with the given name. Not
+   * available with RLBOX_USE_STATIC_CALLS, use add_func_ptr instead.
+   */
+  template<typename T_Func, typename... T_Args>
+  inline size_t add(const char* func_name, T_Args... args)
+  {
+    void* func_ptr = plugin->impl_lookup_symbol(func_name);
+    detail::dynamic_check(func_ptr != nullptr,
+                          "Could not find function to add to batch");
+    return add_call(static_cast<T_Func*>(nullptr), func_ptr, args...);
+  }
+
+  /**
+   * @brief runs all recorded calls in order and clears the batch.
+   *
+   * @return the tainted return value of each call, 0 for calls returning void
+   */
+  inline std::vector<tainted<int32_t, T_Sbx>> run()
+  {
+    std::vector<int32_t> results(calls.size(), 0);
+    if constexpr (batch_detail::has_invoke_batch<T_Sbx>::value) {
+      plugin->impl_invoke_batch(calls.data(), calls.size(), results.data());
+    } else {
+      // Bind the sandbox once for all calls, as a batch has a single
+      // transition
+      rlbox_sandbox_session<T_Sbx> session(*plugin);
+      for (size_t i = 0; i < calls.size(); i++) {
+        results[i] = calls[i].host_thunk(calls[i].func, calls[i].args);
+      }
+    }
+    calls.clear();
+    return std::vector<tainted<int32_t, T_Sbx>>(results.begin(),
+                                                results.end());
+  }
+
+  inline size_t size() const { return calls.size(); }
+  inline void clear() { calls.clear(); }
+
+private:
+  template<typename T_Ret, typename... T_FormalArgs, typename... T_Args>
+  inline size_t add_call(T_Ret (*)(T_FormalArgs...),
+                         void* func_ptr,
+                         T_Args... args)
+  {
+    static_assert(sizeof...(T_FormalArgs) <= RLBOX_BATCH_MAX_ARGS,
+                  "Too many arguments for a batched call");
+    static_assert(sizeof...(T_FormalArgs) == sizeof...(T_Args),
+                  "Wrong number of arguments for a batched call");
+    static_assert(std::is_void_v<T_Ret> ||
+                    (batch_detail::is_batch_value_v<T_Ret, T_Sbx> &&
+                     !std::is_pointer_v<T_Ret>),
+                  "Batched calls must return void or an integer of at most "
+                  "32 bits in the sandbox");
+    static_assert(
+      (batch_detail::is_batch_value_v<T_FormalArgs, T_Sbx> && ...),
+      "Batched calls only take integers and pointers of at most 32 bits in "
+      "the sandbox");
+
+    rlbox_batch_call call{};
+    call.func = func_ptr;
+    if constexpr (!batch_detail::has_invoke_batch<T_Sbx>::value) {
+      call.host_thunk = batch_detail::host_thunk<T_Ret, T_FormalArgs...>;
+    }
+    call.arg_count = sizeof...(T_FormalArgs);
+    call.has_return = std::is_void_v<T_Ret> ? 0 : 1;
+    int32_t converted_args[] = {
+      batch_detail::to_batch_arg<T_FormalArgs>(plugin, args)..., 0
+    };
+    for (size_t i = 0; i < sizeof...(T_Args); i++) {
+      call.args[i] = converted_args[i];
+    }
+    if constexpr (batch_detail::has_prepare_batch_call<T_Sbx>::value) {
+      call.handle = plugin->template impl_prepare_batch_call<
+        batch_detail::to_i32_ret<T_Ret>,
+        batch_detail::to_i32<T_FormalArgs>...>(func_ptr);
+    }
+    calls.push_back(call);
+    return calls.size() - 1;
+  }
+};
+
+#if defined(RLBOX_USE_STATIC_CALLS)
+#  define rlbox_batch_add(batch, func_name, ...)                               \
+    (batch).template add_func_ptr<decltype(func_name)>(                        \
+      RLBOX_USE_STATIC_CALLS()(func_name), ##__VA_ARGS__)
+#else
+#  define rlbox_batch_add(batch, func_name, ...)                               \
+    (batch).template add<decltype(func_name)>(#func_name, ##__VA_ARGS__)
+#endif
+
+} // namespace rlbox
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define RLBOX_BULK_COPY_USE_SSE2
+#endif
+
+// Copies of at least this many bytes bypass the cache with non-temporal
+// stores. Buffers this large would evict most of the cache, and are rarely
+// read again right after the copy.
+#ifndef RLBOX_NONTEMPORAL_COPY_THRESHOLD
+#  define RLBOX_NONTEMPORAL_COPY_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+namespace rlbox {
+
+namespace bulk_copy_detail {
+#ifdef RLBOX_BULK_COPY_USE_SSE2
+  inline void copy_nontemporal(char* dst, const char* src, size_t len)
+  {
+    // Streaming stores need an aligned destination
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+    if (head > len) {
+      head = len;
+    }
+    std::memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+
+    const size_t blocks = len / 64;
+    for (size_t i = 0; i < blocks; i++) {
+      auto s = reinterpret_cast<const __m128i*>(src);
+      auto d = reinterpret_cast<__m128i*>(dst);
+      __m128i v0 = _mm_loadu_si128(s);
+      __m128i v1 = _mm_loadu_si128(s + 1);
+      __m128i v2 = _mm_loadu_si128(s + 2);
+      __m128i v3 = _mm_loadu_si128(s + 3);
+      _mm_stream_si128(d, v0);
+      _mm_stream_si128(d + 1, v1);
+      _mm_stream_si128(d + 2, v2);
+      _mm_stream_si128(d + 3, v3);
+      src += 64;
+      dst += 64;
+    }
+    // Order the streaming stores before any later stores, e.g. the write that
+    // hands the buffer to another thread
+    _mm_sfence();
+    std::memcpy(dst, src, len % 64);
+  }
+#endif
+} // namespace bulk_copy_detail
+
+/**
+ * @brief copies len bytes between non overlapping buffers. Small and medium
+ * copies use memcpy, which is vectorized by the C library, while copies of at
+ * least RLBOX_NONTEMPORAL_COPY_THRESHOLD bytes use non-temporal stores where
+ * SSE2 is available, so that they do not evict the working set of the caller.
+ */
+inline void rlbox_bulk_copy(void* dst, const void* src, size_t len)
+{
+#ifdef RLBOX_BULK_COPY_USE_SSE2
+  if (len >= RLBOX_NONTEMPORAL_COPY_THRESHOLD) {
+    bulk_copy_detail::copy_nontemporal(
+      static_cast<char*>(dst), static_cast<const char*>(src), len);
+    return;
+  }
+#endif
+  std::memcpy(dst, src, len);
+}
+
+} // namespace rlbox
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rlbox {
+
+namespace callback_slots_detail {
+  template<typename T_Fn, std::size_t... Is>
+  constexpr auto make_callback_table(T_Fn fn, std::index_sequence<Is...>)
+  {
+    using T_Entry = decltype(fn(std::integral_constant<std::size_t, 0>{}));
+    return std::array<T_Entry, sizeof...(Is)>{ { fn(
+      std::integral_constant<std::size_t, Is>{})... } };
+  }
+} // namespace callback_slots_detail
+
+/**
+ * @brief Builds a table of N entries, where entry I is fn(I) with I a compile
+ * time constant. Used to look up the callback interceptor of a slot by its
+ * index, instead of scanning the slots with compile_time_for.
+ */
+template<std::size_t N, typename T_Fn>
+constexpr auto make_callback_table(T_Fn fn)
+{
+  return callback_slots_detail::make_callback_table(
+    fn, std::make_index_sequence<N>());
+}
+
+/**
+ * @brief Tracks which of a plugin's N callback slots are in use, and which
+ * slot holds each registered key. Allocating and releasing a slot are
+ * constant time: freed slots are kept on a free list, and slots never used
+ * are handed out in order after it is empty. A key registered more than once
+ * gets a slot for each registration, and each release frees one of them.
+ *
+ * Not thread safe, plugins hold their callback lock around these calls.
+ *
+ * @tparam N the number of callback slots
+ */
+template<std::size_t N>
+class rlbox_callback_slots
+{
+private:
+  // Slots below this index have been handed out at least once
+  uint32_t used = 0;
+  std::vector<uint32_t> free_slots;
+  std::unordered_multimap<void*, uint32_t> slot_of_key;
+
+public:
+  static constexpr std::size_t capacity = N;
+
+  /**
+   * @brief assigns a free slot to key
+   *
+   * @return false if all slots are in use
+   */
+  inline bool allocate(void* key, uint32_t& slot)
+  {
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else if (used < N) {
+      slot = used++;
+    } else {
+      return false;
+    }
+    slot_of_key.emplace(key, slot);
+    return true;
+  }
+
+  /**
+   * @brief frees a slot assigned to key
+   *
+   * @return false if key has no slot
+   */
+  inline bool release(void* key, uint32_t& slot)
+  {
+    auto found = slot_of_key.find(key);
+    if (found == slot_of_key.end()) {
+      return false;
+    }
+    slot = found->second;
+    slot_of_key.erase(found);
+    free_slots.push_back(slot);
+    return true;
+  }
+
+  /**
+   * @brief calls fn(key, slot) for each slot in use
+   */
+  template<typename T_Fn>
+  inline void for_each(T_Fn&& fn) const
+  {
+    for (auto& entry : slot_of_key) {
+      fn(entry.first, entry.second);
+    }
+  }
+
+  inline void clear()
+  {
+    used = 0;
+    free_slots.clear();
+    slot_of_key.clear();
+  }
+
+  inline std::size_t size() const { return slot_of_key.size(); }
+};
+
+/**
+ * @brief The callback and key registered in each of a plugin's N callback
+ * slots. The callback interceptors read a slot without locking, while
+ * registration and unregistration change it under the plugin's callback lock.
+ *
+ * Each slot has a version, which is odd while a writer changes the slot, so a
+ * reader always gets the callback and key of a single registration, even when
+ * the slot is being released and reused at the same time. No reclamation
+ * scheme is needed beyond that, as the callbacks are static interceptor
+ * functions that are never freed: a call racing with unregistration still
+ * calls valid code, with the key of the registration it started with.
+ *
+ * @tparam N the number of callback slots
+ */
+template<std::size_t N>
+class rlbox_callback_registrations
+{
+private:
+  struct registration
+  {
+    std::atomic<uint32_t> version{ 0 };
+    std::atomic<void*> callback{ nullptr };
+    std::atomic<void*> key{ nullptr };
+  };
+  registration slots[N];
+
+  inline void write(uint32_t slot, void* key, void* callback)
+  {
+    auto& entry = slots[slot];
+    const uint32_t version = entry.version.load(std::memory_order_relaxed);
+    entry.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.key.store(key, std::memory_order_relaxed);
+    entry.callback.store(callback, std::memory_order_relaxed);
+    entry.version.store(version + 2, std::memory_order_release);
+  }
+
+public:
+  /**
+   * @brief registers callback with key in slot. Callers hold the plugin's
+   * callback lock.
+   */
+  inline void publish(uint32_t slot, void* key, void* callback)
+  {
+    write(slot, key, callback);
+  }
+
+  /**
+   * @brief empties slot. Callers hold the plugin's callback lock.
+   */
+  inline void clear(uint32_t slot) { write(slot, nullptr, nullptr); }
+
+  /**
+   * @brief get the callback and key of the registration in slot
+   */
+  inline std::pair<void*, void*> read(uint32_t slot) const
+  {
+    const auto& entry = slots[slot];
+    while (true) {
+      const uint32_t before = entry.version.load(std::memory_order_acquire);
+      void* callback = entry.callback.load(std::memory_order_relaxed);
+      void* key = entry.key.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      const uint32_t after = entry.version.load(std::memory_order_relaxed);
+      if (before == after && before % 2 == 0) {
+        return std::make_pair(callback, key);
+      }
+    }
+  }
+};
+
+} // namespace rlbox
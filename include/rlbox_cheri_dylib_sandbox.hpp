@@ -1,11 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <mutex>
 #ifndef RLBOX_USE_CUSTOM_SHARED_LOCK
 #  include <shared_mutex>
 #endif
+#include <thread>
 #include <utility>
 
 #if defined(_WIN32)
@@ -19,7 +21,16 @@
 #  include <dlfcn.h>
 #endif
 
+#include "rlbox_bulk_copy.hpp"
+#include "rlbox_callback_slots.hpp"
 #include "rlbox_helpers.hpp"
+#include "rlbox_module_registry.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+// The number of callbacks that can be registered with a sandbox at once
+#ifndef RLBOX_CHERI_DYLIB_MAX_CALLBACKS
+#  define RLBOX_CHERI_DYLIB_MAX_CALLBACKS 64
+#endif
 
 namespace rlbox {
 
@@ -29,6 +40,8 @@ struct rlbox_cheri_dylib_sandbox_thread_data
 {
   rlbox_cheri_dylib_sandbox* sandbox;
   uint32_t last_callback_invoked;
+  // Key of the last invoked callback, read together with the callback
+  void* last_callback_key;
 };
 
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
@@ -36,7 +49,7 @@ struct rlbox_cheri_dylib_sandbox_thread_data
 rlbox_cheri_dylib_sandbox_thread_data* get_rlbox_cheri_dylib_sandbox_thread_data();
 #  define RLBOX_cheri_dylib_SANDBOX_STATIC_VARIABLES()                               \
     thread_local rlbox::rlbox_cheri_dylib_sandbox_thread_data                        \
-      rlbox_cheri_dylib_sandbox_thread_info{ 0, 0 };                                 \
+      rlbox_cheri_dylib_sandbox_thread_info{ 0, 0, 0 };                              \
     namespace rlbox {                                                          \
       rlbox_cheri_dylib_sandbox_thread_data* get_rlbox_cheri_dylib_sandbox_thread_data()   \
       {                                                                        \
@@ -68,33 +81,47 @@ public:
   using needs_internal_lookup_symbol = void;
 
 private:
+  // The cheri_dylib sandbox has no function table, so the module info is unused
+  rlbox_loaded_module<void*>* loaded_module = nullptr;
   void* sandbox = nullptr;
 
   RLBOX_SHARED_LOCK(callback_mutex);
-  static inline const uint32_t MAX_CALLBACKS = 64;
-  void* callback_unique_keys[MAX_CALLBACKS]{ 0 };
-  void* callbacks[MAX_CALLBACKS]{ 0 };
+  static inline const uint32_t MAX_CALLBACKS = RLBOX_CHERI_DYLIB_MAX_CALLBACKS;
+  // Which slots are free, and the slot of each key
+  rlbox_callback_slots<MAX_CALLBACKS> callback_slots;
+  // Callback and key of each slot, read by the callback trampolines without
+  // locking. Writes hold callback_mutex.
+  rlbox_callback_registrations<MAX_CALLBACKS> callbacks;
 
 #ifndef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   thread_local static inline rlbox_cheri_dylib_sandbox_thread_data thread_data{ 0,
+                                                                          0,
                                                                           0 };
 #endif
 
+  // Thread that has bound this sandbox with an rlbox_sandbox_session
+  std::atomic<std::thread::id> session_thread{};
+  friend class rlbox_sandbox_session<rlbox_cheri_dylib_sandbox>;
+  static inline rlbox_cheri_dylib_sandbox_thread_data* get_session_thread_data()
+  {
+#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+    return get_rlbox_cheri_dylib_sandbox_thread_data();
+#else
+    return &thread_data;
+#endif
+  }
+
   template<uint32_t N, typename T_Ret, typename... T_Args>
   static T_Ret callback_trampoline(T_Args... params)
   {
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
     auto& thread_data = *get_rlbox_cheri_dylib_sandbox_thread_data();
 #endif
+    auto registration = thread_data.sandbox->callbacks.read(N);
     thread_data.last_callback_invoked = N;
+    thread_data.last_callback_key = registration.second;
     using T_Func = T_Ret (*)(T_Args...);
-    T_Func func;
-    {
-#ifndef RLBOX_SINGLE_THREADED_INVOCATIONS
-      RLBOX_ACQUIRE_SHARED_GUARD(lock, thread_data.sandbox->callback_mutex);
-#endif
-      func = reinterpret_cast<T_Func>(thread_data.sandbox->callbacks[N]);
-    }
+    auto func = reinterpret_cast<T_Func>(registration.first);
     // Callbacks are invoked through function pointers, cannot use std::forward
     // as we don't have caller context for T_Args, which means they are all
     // effectively passed by value
@@ -104,53 +131,67 @@ private:
 protected:
 #if defined(_WIN32)
   using path_buf = const LPCWSTR;
+  static inline const int dl_flags = 0;
 #else
   using path_buf = const char*;
+  static inline const int dl_flags = RTLD_LAZY | RTLD_LOCAL;
 #endif
 
-  inline void impl_create_sandbox(path_buf path)
+  /**
+   * @param eager_bind optional, load the library with RTLD_NOW so that its
+   * symbols are bound before any call. If an earlier sandbox of the library,
+   * which is still alive, loaded it lazily, the library stays lazily bound,
+   * see impl_is_bound_eagerly. There are no signatures to prepare, and the
+   * code pages cannot be walked on CHERI, so this is all the eager binding this
+   * sandbox does.
+   * @param require_eager_binding optional, fail instead if eager_bind is set
+   * and the library is already loaded lazily.
+   */
+  inline void impl_create_sandbox(path_buf path,
+                                  bool eager_bind = false,
+                                  bool require_eager_binding = false)
   {
-#if defined(_WIN32)
-    sandbox = (void*)LoadLibraryW(path);
-#else
-    sandbox = dlopen(path, RTLD_LAZY | RTLD_LOCAL);
-#endif
-
-    if (!sandbox) {
-      std::string error_msg = "Could not load dynamic library: ";
-#if defined(_WIN32)
-      DWORD errorMessageID = GetLastError();
-      if (errorMessageID != 0) {
-        LPSTR messageBuffer = nullptr;
-        // The api creates the buffer that holds the message
-        size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                                       FORMAT_MESSAGE_FROM_SYSTEM |
-                                       FORMAT_MESSAGE_IGNORE_INSERTS,
-                                     NULL,
-                                     errorMessageID,
-                                     MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                                     (LPSTR)&messageBuffer,
-                                     0,
-                                     NULL);
-        // Copy the error message into a std::string.
-        std::string message(messageBuffer, size);
-        error_msg += message;
-        LocalFree(messageBuffer);
-      }
+    int flags = dl_flags;
+#if !defined(_WIN32)
+    // Windows always binds eagerly
+    if (eager_bind) {
+      flags = (flags & ~RTLD_LAZY) | RTLD_NOW;
+    }
 #else
-      error_msg += dlerror();
+    RLBOX_UNUSED(eager_bind);
 #endif
-      detail::dynamic_check(false, error_msg.c_str());
+    // Sandboxes of the same library share the loaded library
+    std::string error_msg;
+    loaded_module = rlbox_module_registry<void*>::acquire(
+      path,
+      "",
+      flags,
+      [](auto&, std::string&) { return true; },
+      error_msg);
+    detail::dynamic_check(loaded_module != nullptr, error_msg.c_str());
+    if (eager_bind && require_eager_binding &&
+        !loaded_module->is_bound_eagerly()) {
+      rlbox_module_registry<void*>::release(loaded_module);
+      loaded_module = nullptr;
+      detail::dynamic_check(false,
+                            "Could not bind the library eagerly, as it is "
+                            "already loaded with lazy binding");
     }
+    sandbox = loaded_module->library;
+  }
+
+  /**
+   * @brief whether the library's symbols were bound when it was loaded
+   */
+  inline bool impl_is_bound_eagerly() const
+  {
+    return loaded_module->is_bound_eagerly();
   }
 
   inline void impl_destroy_sandbox()
   {
-#if defined(_WIN32)
-    FreeLibrary((HMODULE)sandbox);
-#else
-    dlclose(sandbox);
-#endif
+    rlbox_module_registry<void*>::release(loaded_module);
+    loaded_module = nullptr;
     sandbox = nullptr;
   }
 
@@ -204,6 +245,20 @@ protected:
   inline bool impl_is_pointer_in_sandbox_memory(const void*) { return true; }
   inline bool impl_is_pointer_in_app_memory(const void*) { return true; }
 
+  // The hardware checks the bounds of the capability on every access, so the
+  // copies need no software bounds check
+  inline void impl_copy_to_sandbox(T_PointerType dst,
+                                   const void* src,
+                                   size_t len)
+  {
+    rlbox_bulk_copy(dst, src, len);
+  }
+
+  inline void impl_copy_from_sandbox(void* dst, T_PointerType src, size_t len)
+  {
+    rlbox_bulk_copy(dst, src, len);
+  }
+
   inline size_t impl_get_total_memory()
   {
     return std::numeric_limits<size_t>::max();
@@ -220,11 +275,17 @@ protected:
 
   void* impl_lookup_symbol(const char* func_name)
   {
-#if defined(_WIN32)
-    void* ret = GetProcAddress((HMODULE)sandbox, func_name);
-#else
-    void* ret = dlsym(sandbox, func_name);
-#endif
+    return impl_lookup_symbol(rlbox_export_name_hash(func_name), func_name);
+  }
+
+  // Looks up an export whose rlbox_export_name_hash is already known
+  void* impl_lookup_symbol(uint64_t hash, const char* func_name)
+  {
+    // Cached in the module, as all sandboxes of the library share it
+    void* ret = loaded_module->export_cache.lookup(hash, func_name, [&] {
+      return rlbox_module_registry<void*>::lookup_library_symbol(sandbox,
+                                                                 func_name);
+    });
     // if (ret != nullptr) {
     //   printf("Symbol not found %p\n", func_name);
     //   abort();
@@ -241,13 +302,19 @@ protected:
   template<typename T, typename T_Converted, typename... T_Args>
   auto impl_invoke_with_func_ptr(T_Converted* func_ptr, T_Args&&... params)
   {
-#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
-    auto& thread_data = *get_rlbox_cheri_dylib_sandbox_thread_data();
-#endif
-    auto old_sandbox = thread_data.sandbox;
-    thread_data.sandbox = this;
+    // Within a session, the sandbox is already bound to this thread
+    rlbox_cheri_dylib_sandbox_thread_data* bound_thread_data = nullptr;
+    rlbox_cheri_dylib_sandbox* old_sandbox = nullptr;
+    if (!rlbox_sandbox_session<rlbox_cheri_dylib_sandbox>::is_bound_to_thread(
+          this)) {
+      bound_thread_data = get_session_thread_data();
+      old_sandbox = bound_thread_data->sandbox;
+      bound_thread_data->sandbox = this;
+    }
     auto on_exit = detail::make_scope_exit([&] {
-      thread_data.sandbox = old_sandbox;
+      if (bound_thread_data != nullptr) {
+        bound_thread_data->sandbox = old_sandbox;
+      }
     });
     return (*func_ptr)(params...);
   }
@@ -255,22 +322,19 @@ protected:
   template<typename T_Ret, typename... T_Args>
   inline T_PointerType impl_register_callback(void* key, void* callback)
   {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
+    // The trampoline of each slot, as the slot number must be a compile time
+    // value
+    static constexpr auto trampolines = make_callback_table<MAX_CALLBACKS>(
+      [](auto I) { return &callback_trampoline<I.value, T_Ret, T_Args...>; });
 
-    void* chosen_trampoline = nullptr;
-
-    // need a compile time for loop as we we need I to be a compile time value
-    // this is because we are returning the I'th callback trampoline
-    detail::compile_time_for<MAX_CALLBACKS>([&](auto I) {
-      if (!chosen_trampoline && callback_unique_keys[I.value] == nullptr) {
-        callback_unique_keys[I.value] = key;
-        callbacks[I.value] = callback;
-        chosen_trampoline = reinterpret_cast<void*>(
-          callback_trampoline<I.value, T_Ret, T_Args...>);
-      }
-    });
+    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
 
-    return reinterpret_cast<T_PointerType>(chosen_trampoline);
+    uint32_t slot = 0;
+    if (!callback_slots.allocate(key, slot)) {
+      return nullptr;
+    }
+    callbacks.publish(slot, key, callback);
+    return reinterpret_cast<T_PointerType>(trampolines[slot]);
   }
 
   static inline std::pair<rlbox_cheri_dylib_sandbox*, void*>
@@ -279,22 +343,16 @@ protected:
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
     auto& thread_data = *get_rlbox_cheri_dylib_sandbox_thread_data();
 #endif
-    auto sandbox = thread_data.sandbox;
-    auto callback_num = thread_data.last_callback_invoked;
-    void* key = sandbox->callback_unique_keys[callback_num];
-    return std::make_pair(sandbox, key);
+    return std::make_pair(thread_data.sandbox, thread_data.last_callback_key);
   }
 
   template<typename T_Ret, typename... T_Args>
   inline void impl_unregister_callback(void* key)
   {
     RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-    for (uint32_t i = 0; i < MAX_CALLBACKS; i++) {
-      if (callback_unique_keys[i] == key) {
-        callback_unique_keys[i] = nullptr;
-        callbacks[i] = nullptr;
-        break;
-      }
+    uint32_t slot = 0;
+    if (callback_slots.release(key, slot)) {
+      callbacks.clear(slot);
     }
   }
 
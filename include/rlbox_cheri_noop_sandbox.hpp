@@ -1,14 +1,24 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <mutex>
 #ifndef RLBOX_USE_CUSTOM_SHARED_LOCK
 #  include <shared_mutex>
 #endif
+#include <thread>
 #include <utility>
 
+#include "rlbox_bulk_copy.hpp"
+#include "rlbox_callback_slots.hpp"
 #include "rlbox_helpers.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+// The number of callbacks that can be registered with a sandbox at once
+#ifndef RLBOX_CHERI_NOOP_MAX_CALLBACKS
+#  define RLBOX_CHERI_NOOP_MAX_CALLBACKS 64
+#endif
 
 namespace rlbox {
 
@@ -18,6 +28,8 @@ struct rlbox_cheri_noop_sandbox_thread_data
 {
   rlbox_cheri_noop_sandbox* sandbox;
   uint32_t last_callback_invoked;
+  // Key of the last invoked callback, read together with the callback
+  void* last_callback_key;
 };
 
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
@@ -25,7 +37,7 @@ struct rlbox_cheri_noop_sandbox_thread_data
 rlbox_cheri_noop_sandbox_thread_data* get_rlbox_cheri_noop_sandbox_thread_data();
 #  define RLBOX_cheri_noop_SANDBOX_STATIC_VARIABLES()                                \
     thread_local rlbox::rlbox_cheri_noop_sandbox_thread_data                         \
-      rlbox_cheri_noop_sandbox_thread_info{ 0, 0 };                                  \
+      rlbox_cheri_noop_sandbox_thread_info{ 0, 0, 0 };                               \
     namespace rlbox {                                                          \
       rlbox_cheri_noop_sandbox_thread_data* get_rlbox_cheri_noop_sandbox_thread_data()     \
       {                                                                        \
@@ -56,29 +68,40 @@ public:
 
 private:
   RLBOX_SHARED_LOCK(callback_mutex);
-  static inline const uint32_t MAX_CALLBACKS = 64;
-  void* callback_unique_keys[MAX_CALLBACKS]{ 0 };
-  void* callbacks[MAX_CALLBACKS]{ 0 };
+  static inline const uint32_t MAX_CALLBACKS = RLBOX_CHERI_NOOP_MAX_CALLBACKS;
+  // Which slots are free, and the slot of each key
+  rlbox_callback_slots<MAX_CALLBACKS> callback_slots;
+  // Callback and key of each slot, read by the callback trampolines without
+  // locking. Writes hold callback_mutex.
+  rlbox_callback_registrations<MAX_CALLBACKS> callbacks;
 
 #ifndef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
-  thread_local static inline rlbox_cheri_noop_sandbox_thread_data thread_data{ 0, 0 };
+  thread_local static inline rlbox_cheri_noop_sandbox_thread_data thread_data{ 0, 0, 0 };
 #endif
 
+  // Thread that has bound this sandbox with an rlbox_sandbox_session
+  std::atomic<std::thread::id> session_thread{};
+  friend class rlbox_sandbox_session<rlbox_cheri_noop_sandbox>;
+  static inline rlbox_cheri_noop_sandbox_thread_data* get_session_thread_data()
+  {
+#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+    return get_rlbox_cheri_noop_sandbox_thread_data();
+#else
+    return &thread_data;
+#endif
+  }
+
   template<uint32_t N, typename T_Ret, typename... T_Args>
   static T_Ret callback_trampoline(T_Args... params)
   {
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
     auto& thread_data = *get_rlbox_cheri_noop_sandbox_thread_data();
 #endif
+    auto registration = thread_data.sandbox->callbacks.read(N);
     thread_data.last_callback_invoked = N;
+    thread_data.last_callback_key = registration.second;
     using T_Func = T_Ret (*)(T_Args...);
-    T_Func func;
-    {
-#ifndef RLBOX_SINGLE_THREADED_INVOCATIONS
-      RLBOX_ACQUIRE_SHARED_GUARD(lock, thread_data.sandbox->callback_mutex);
-#endif
-      func = reinterpret_cast<T_Func>(thread_data.sandbox->callbacks[N]);
-    }
+    auto func = reinterpret_cast<T_Func>(registration.first);
     // Callbacks are invoked through function pointers, cannot use std::forward
     // as we don't have caller context for T_Args, which means they are all
     // effectively passed by value
@@ -140,6 +163,19 @@ protected:
   inline bool impl_is_pointer_in_sandbox_memory(const void*) { return true; }
   inline bool impl_is_pointer_in_app_memory(const void*) { return true; }
 
+  // The sandbox shares the app's memory, so these are plain copies
+  inline void impl_copy_to_sandbox(T_PointerType dst,
+                                   const void* src,
+                                   size_t len)
+  {
+    rlbox_bulk_copy(dst, src, len);
+  }
+
+  inline void impl_copy_from_sandbox(void* dst, T_PointerType src, size_t len)
+  {
+    rlbox_bulk_copy(dst, src, len);
+  }
+
   inline size_t impl_get_total_memory()
   {
     return std::numeric_limits<size_t>::max();
@@ -177,13 +213,19 @@ protected:
   template<typename T, typename T_Converted, typename... T_Args>
   auto impl_invoke_with_func_ptr(T_Converted* func_ptr, T_Args&&... params)
   {
-#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
-    auto& thread_data = *get_rlbox_cheri_noop_sandbox_thread_data();
-#endif
-    auto old_sandbox = thread_data.sandbox;
-    thread_data.sandbox = this;
+    // Within a session, the sandbox is already bound to this thread
+    rlbox_cheri_noop_sandbox_thread_data* bound_thread_data = nullptr;
+    rlbox_cheri_noop_sandbox* old_sandbox = nullptr;
+    if (!rlbox_sandbox_session<rlbox_cheri_noop_sandbox>::is_bound_to_thread(
+          this)) {
+      bound_thread_data = get_session_thread_data();
+      old_sandbox = bound_thread_data->sandbox;
+      bound_thread_data->sandbox = this;
+    }
     auto on_exit = detail::make_scope_exit([&] {
-      thread_data.sandbox = old_sandbox;
+      if (bound_thread_data != nullptr) {
+        bound_thread_data->sandbox = old_sandbox;
+      }
     });
     return (*func_ptr)(params...);
   }
@@ -191,22 +233,19 @@ protected:
   template<typename T_Ret, typename... T_Args>
   inline T_PointerType impl_register_callback(void* key, void* callback)
   {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
+    // The trampoline of each slot, as the slot number must be a compile time
+    // value
+    static constexpr auto trampolines = make_callback_table<MAX_CALLBACKS>(
+      [](auto I) { return &callback_trampoline<I.value, T_Ret, T_Args...>; });
 
-    void* chosen_trampoline = nullptr;
-
-    // need a compile time for loop as we we need I to be a compile time value
-    // this is because we are returning the I'th callback trampoline
-    detail::compile_time_for<MAX_CALLBACKS>([&](auto I) {
-      if (!chosen_trampoline && callback_unique_keys[I.value] == nullptr) {
-        callback_unique_keys[I.value] = key;
-        callbacks[I.value] = callback;
-        chosen_trampoline = reinterpret_cast<void*>(
-          callback_trampoline<I.value, T_Ret, T_Args...>);
-      }
-    });
+    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
 
-    return reinterpret_cast<T_PointerType>(chosen_trampoline);
+    uint32_t slot = 0;
+    if (!callback_slots.allocate(key, slot)) {
+      return nullptr;
+    }
+    callbacks.publish(slot, key, callback);
+    return reinterpret_cast<T_PointerType>(trampolines[slot]);
   }
 
   static inline std::pair<rlbox_cheri_noop_sandbox*, void*>
@@ -215,22 +254,16 @@ protected:
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
     auto& thread_data = *get_rlbox_cheri_noop_sandbox_thread_data();
 #endif
-    auto sandbox = thread_data.sandbox;
-    auto callback_num = thread_data.last_callback_invoked;
-    void* key = sandbox->callback_unique_keys[callback_num];
-    return std::make_pair(sandbox, key);
+    return std::make_pair(thread_data.sandbox, thread_data.last_callback_key);
   }
 
   template<typename T_Ret, typename... T_Args>
   inline void impl_unregister_callback(void* key)
   {
     RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-    for (uint32_t i = 0; i < MAX_CALLBACKS; i++) {
-      if (callback_unique_keys[i] == key) {
-        callback_unique_keys[i] = nullptr;
-        callbacks[i] = nullptr;
-        break;
-      }
+    uint32_t slot = 0;
+    if (callback_slots.release(key, slot)) {
+      callbacks.clear(slot);
     }
   }
 
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Runs in find between probing for an entry and reading it. Tests define this
+// to interleave writes with a lookup deterministically.
+#ifndef RLBOX_CONCURRENT_MAP_FIND_HOOK
+#  define RLBOX_CONCURRENT_MAP_FIND_HOOK()
+#endif
+
+namespace rlbox {
+
+/**
+ * @brief A flat, open addressed hash map for read mostly data, such as the
+ * tables used to swizzle function pointers. Lookups take no lock and write no
+ * shared memory, so readers on different threads do not contend.
+ *
+ * Writes must be serialized by the caller. A write that needs more room copies
+ * the live entries to a new table and publishes it, RCU style. Readers may
+ * still be using the old table, so retired tables are kept until the owner
+ * calls reclaim at a point where no reader can hold them, or until the map is
+ * destroyed.
+ *
+ * Erased entries leave a tombstone, which only later inserts of the same key
+ * reuse, and which are dropped when the table is copied. The table doubles
+ * when more than a quarter of it is live, and is otherwise copied at the same
+ * capacity to drop the tombstones. So the current table is at most eight
+ * times the live entries (or the minimum capacity), while each retired table
+ * takes at most as many bytes as the inserts of new keys since the previous
+ * copy. Without reclaim, insert and erase churn therefore grows the memory
+ * linearly with the number of inserts.
+ *
+ * @tparam T_Key a pointer or integer type
+ * @tparam T_Value a trivially copyable type that fits in a lock free atomic
+ */
+template<typename T_Key, typename T_Value>
+class rlbox_concurrent_map
+{
+private:
+  static_assert(std::is_pointer_v<T_Key> || std::is_integral_v<T_Key>,
+                "Keys must be pointers or integers");
+
+  static constexpr size_t min_capacity = 64;
+
+  enum entry_state : uint8_t
+  {
+    empty = 0,
+    live,
+    erased
+  };
+
+  struct entry
+  {
+    std::atomic<uint8_t> state{ empty };
+    // Written before the state is first published and never changed after.
+    // Atomic as readers probing past an empty entry can race with the write.
+    std::atomic<T_Key> key{};
+    std::atomic<T_Value> value{};
+  };
+
+  struct table
+  {
+    size_t mask;
+    std::unique_ptr<entry[]> entries;
+
+    explicit table(size_t capacity)
+      : mask(capacity - 1)
+      , entries(new entry[capacity])
+    {}
+  };
+
+  std::atomic<table*> current{ nullptr };
+  // Owns the current table and the retired ones
+  std::vector<std::unique_ptr<table>> tables;
+  // Entries that are not empty in the current table, including tombstones
+  size_t used = 0;
+  size_t live_count = 0;
+
+public:
+  /**
+   * @brief the hash of key. Its low bits select the first entry probed for
+   * key.
+   */
+  static inline size_t hash(T_Key key)
+  {
+    uint64_t bits;
+    if constexpr (std::is_pointer_v<T_Key>) {
+      bits = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+    } else {
+      bits = static_cast<uint64_t>(key);
+    }
+    // Fibonacci hashing, keeping the well mixed high bits
+    return static_cast<size_t>((bits * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+
+private:
+  // Returns the entry holding key, or the empty entry where it would go, along
+  // with the state seen. An entry seen empty may be filled with another key
+  // right after, so callers must go by the returned state.
+  static inline std::pair<entry*, uint8_t> probe(const table* t, T_Key key)
+  {
+    for (size_t i = hash(key);; i++) {
+      entry* e = &t->entries[i & t->mask];
+      const uint8_t state = e->state.load(std::memory_order_acquire);
+      if (state == empty || e->key.load(std::memory_order_relaxed) == key) {
+        return std::make_pair(e, state);
+      }
+    }
+  }
+
+  // Replaces the current table with one of the given capacity holding only
+  // the live entries
+  inline void rehash(size_t capacity)
+  {
+    auto next = std::make_unique<table>(capacity);
+    table* t = current.load(std::memory_order_relaxed);
+    if (t) {
+      for (size_t i = 0; i <= t->mask; i++) {
+        entry& e = t->entries[i];
+        if (e.state.load(std::memory_order_relaxed) == live) {
+          const T_Key key = e.key.load(std::memory_order_relaxed);
+          entry* dest = probe(next.get(), key).first;
+          dest->key.store(key, std::memory_order_relaxed);
+          dest->value.store(e.value.load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+          dest->state.store(live, std::memory_order_relaxed);
+        }
+      }
+    }
+    used = live_count;
+    // Release publishes the copied entries along with the table
+    current.store(next.get(), std::memory_order_release);
+    tables.emplace_back(std::move(next));
+  }
+
+public:
+  rlbox_concurrent_map() = default;
+  rlbox_concurrent_map(const rlbox_concurrent_map&) = delete;
+  rlbox_concurrent_map& operator=(const rlbox_concurrent_map&) = delete;
+
+  /**
+   * @brief looks up key without locking. Safe to call concurrently with
+   * writers.
+   */
+  inline std::optional<T_Value> find(T_Key key) const
+  {
+    const table* t = current.load(std::memory_order_acquire);
+    if (!t) {
+      return std::nullopt;
+    }
+    auto found = probe(t, key);
+    entry* e = found.first;
+    RLBOX_CONCURRENT_MAP_FIND_HOOK();
+    if (found.second == empty) {
+      return std::nullopt;
+    }
+    // The entry may have been erased since, but never holds another key
+    if (e->state.load(std::memory_order_acquire) != live ||
+        e->key.load(std::memory_order_relaxed) != key) {
+      return std::nullopt;
+    }
+    return e->value.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @brief inserts or updates the value of key. Writers must be serialized.
+   */
+  inline void insert(T_Key key, T_Value value)
+  {
+    table* t = current.load(std::memory_order_relaxed);
+    // Keep the load factor at most a half, so probe sequences stay short
+    if (!t) {
+      rehash(min_capacity);
+      t = current.load(std::memory_order_relaxed);
+    } else if ((used + 1) * 2 > t->mask + 1) {
+      const size_t capacity = t->mask + 1;
+      // Mostly tombstones, copying the live entries is enough
+      rehash((live_count + 1) * 4 > capacity ? capacity * 2 : capacity);
+      t = current.load(std::memory_order_relaxed);
+    }
+
+    auto found = probe(t, key);
+    entry* e = found.first;
+    const uint8_t state = found.second;
+    e->value.store(value, std::memory_order_release);
+    if (state == live) {
+      return;
+    }
+    if (state == empty) {
+      e->key.store(key, std::memory_order_relaxed);
+      used++;
+    }
+    live_count++;
+    // Release publishes the key and value along with the state
+    e->state.store(live, std::memory_order_release);
+  }
+
+  /**
+   * @brief removes key if present. Writers must be serialized.
+   *
+   * @return true if key was present
+   */
+  inline bool erase(T_Key key)
+  {
+    table* t = current.load(std::memory_order_relaxed);
+    if (!t) {
+      return false;
+    }
+    auto found = probe(t, key);
+    entry* e = found.first;
+    if (found.second != live) {
+      return false;
+    }
+    e->state.store(erased, std::memory_order_release);
+    live_count--;
+    return true;
+  }
+
+  /**
+   * @brief removes all entries, keeping the capacity. Writers must be
+   * serialized.
+   */
+  inline void clear()
+  {
+    table* t = current.load(std::memory_order_relaxed);
+    if (!t) {
+      return;
+    }
+    for (size_t i = 0; i <= t->mask; i++) {
+      entry& e = t->entries[i];
+      if (e.state.load(std::memory_order_relaxed) == live) {
+        e.state.store(erased, std::memory_order_release);
+      }
+    }
+    live_count = 0;
+  }
+
+  /**
+   * @brief calls fn(key, value) for each entry. Must not run concurrently with
+   * writers.
+   */
+  template<typename T_Fn>
+  inline void for_each(T_Fn&& fn) const
+  {
+    const table* t = current.load(std::memory_order_acquire);
+    if (!t) {
+      return;
+    }
+    for (size_t i = 0; i <= t->mask; i++) {
+      const entry& e = t->entries[i];
+      if (e.state.load(std::memory_order_acquire) == live) {
+        fn(e.key.load(std::memory_order_relaxed),
+           e.value.load(std::memory_order_relaxed));
+      }
+    }
+  }
+
+  /**
+   * @brief frees the tables retired by earlier writes. Writers must be
+   * serialized, and no reader may be running or hold a value of an earlier
+   * find, e.g. because the sandbox owning the map is being destroyed.
+   */
+  inline void reclaim()
+  {
+    const table* t = current.load(std::memory_order_relaxed);
+    auto retired = tables.begin();
+    while (retired != tables.end()) {
+      retired = retired->get() == t ? retired + 1 : tables.erase(retired);
+    }
+  }
+
+  inline size_t size() const { return live_count; }
+};
+
+} // namespace rlbox
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "rlbox_concurrent_map.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace rlbox {
+
+/**
+ * @brief FNV-1a hash of an export name. constexpr, so names known at compile
+ * time can be hashed then.
+ */
+constexpr uint64_t rlbox_export_name_hash(const char* name)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *name != 0; name++) {
+    hash ^= static_cast<uint8_t>(*name);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+/**
+ * @brief Caches the addresses of exports looked up by name, so that repeated
+ * lookups of a name cost a hash and a table load, instead of building the
+ * symbol name and calling dlsym. Lookups take no lock. Misses are resolved
+ * by the caller and added under a lock.
+ *
+ * Names are interned, and a hit is confirmed by comparing the name, so hash
+ * collisions only make the colliding name uncached.
+ */
+class rlbox_export_cache
+{
+private:
+  struct entry
+  {
+    std::string name;
+    void* address;
+  };
+
+  rlbox_concurrent_map<uint64_t, const entry*> entries;
+  std::mutex write_lock;
+  // Entries are never moved or freed while the cache is in use, as readers
+  // may hold them
+  std::deque<entry> storage;
+
+public:
+  rlbox_export_cache() = default;
+  rlbox_export_cache(const rlbox_export_cache&) = delete;
+  rlbox_export_cache& operator=(const rlbox_export_cache&) = delete;
+
+  /**
+   * @brief get the cached address of name
+   *
+   * @param hash rlbox_export_name_hash(name), which callers can compute ahead
+   * of time
+   * @return the address, or nullptr if name is not cached
+   */
+  inline void* find(uint64_t hash, const char* name) const
+  {
+    auto found = entries.find(hash);
+    if (!found || std::strcmp((*found)->name.c_str(), name) != 0) {
+      return nullptr;
+    }
+    return (*found)->address;
+  }
+
+  inline void* find(const char* name) const
+  {
+    return find(rlbox_export_name_hash(name), name);
+  }
+
+  /**
+   * @brief get the address of name, calling resolve() to look it up and
+   * caching the result if it is not cached. nullptr results are not cached.
+   *
+   * @param hash rlbox_export_name_hash(name)
+   */
+  template<typename T_Resolve>
+  inline void* lookup(uint64_t hash, const char* name, T_Resolve&& resolve)
+  {
+    void* ret = find(hash, name);
+    if (ret != nullptr) {
+      return ret;
+    }
+    ret = resolve();
+    if (ret != nullptr) {
+      insert(hash, name, ret);
+    }
+    return ret;
+  }
+
+  template<typename T_Resolve>
+  inline void* lookup(const char* name, T_Resolve&& resolve)
+  {
+    return lookup(rlbox_export_name_hash(name),
+                  name,
+                  std::forward<T_Resolve>(resolve));
+  }
+
+  /**
+   * @brief caches the address of name
+   */
+  inline void insert(uint64_t hash, const char* name, void* address)
+  {
+    std::lock_guard<std::mutex> lock(write_lock);
+    auto found = entries.find(hash);
+    if (found) {
+      // Already cached, or a colliding name that stays uncached
+      return;
+    }
+    storage.push_back(entry{ name, address });
+    entries.insert(hash, &storage.back());
+  }
+
+  /**
+   * @brief drops all cached addresses. Must not run concurrently with lookups.
+   */
+  inline void clear()
+  {
+    std::lock_guard<std::mutex> lock(write_lock);
+    entries.clear();
+    storage.clear();
+  }
+};
+
+} // namespace rlbox
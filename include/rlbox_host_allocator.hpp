@@ -0,0 +1,246 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "rlbox_helpers.hpp"
+
+// Size of the region of sandbox memory managed by rlbox_host_allocator
+#ifndef RLBOX_HOST_ALLOCATOR_REGION_SIZE
+#  define RLBOX_HOST_ALLOCATOR_REGION_SIZE (1024 * 1024)
+#endif
+
+namespace rlbox {
+
+/**
+ * @brief An allocator for small objects in sandbox memory that runs entirely
+ * on the host. It reserves one region of sandbox memory from the sandbox's own
+ * malloc on first use, and then serves allocations from that region without
+ * calling into the sandbox. The sandboxed code keeps using its malloc for
+ * everything else, to which the region is just one allocated block.
+ *
+ * The region is split into spans, each of which holds blocks of a single size
+ * class. Free blocks are tracked on the host, so sandboxed code cannot corrupt
+ * the allocator's metadata, and allocating or freeing a block is a pop or push
+ * on the free list of its size class. Allocations larger than the largest size
+ * class, or that do not fit in the region, return a null pointer and should
+ * fall back to the sandbox's malloc.
+ *
+ * Blocks from the region must only ever be freed through the allocator. The
+ * sandboxed code must never free or realloc them with its own allocator, which
+ * sees the whole region as a single block.
+ *
+ * @tparam T_PointerType the sandboxed pointer representation of the plugin
+ */
+template<typename T_PointerType>
+class rlbox_host_allocator
+{
+private:
+  static constexpr size_t min_block_size = 16;
+  static constexpr size_t size_class_count = 8;
+  static constexpr size_t span_size = 4096;
+  static constexpr size_t span_count =
+    RLBOX_HOST_ALLOCATOR_REGION_SIZE / span_size;
+  static constexpr uint8_t unassigned_span = 0xFF;
+
+  static_assert(span_count > 0, "RLBOX_HOST_ALLOCATOR_REGION_SIZE too small");
+
+  std::mutex lock;
+  T_PointerType base{};
+  size_t capacity = 0;
+  bool region_failed = false;
+  size_t next_span = 0;
+  // Size class of each span of the region
+  uint8_t span_classes[span_count];
+  std::vector<T_PointerType> free_blocks[size_class_count];
+  // One bit per min_block_size unit of the region, set for the first unit of
+  // each allocated block, to catch double frees
+  std::vector<uint64_t> allocated_bits;
+
+public:
+  // The largest allocation served by the allocator
+  static constexpr size_t max_block_size = min_block_size
+                                           << (size_class_count - 1);
+
+private:
+  static inline size_t get_size_class(size_t size)
+  {
+    size_t size_class = 0;
+    size_t block_size = min_block_size;
+    while (block_size < size) {
+      block_size <<= 1;
+      size_class++;
+    }
+    return size_class;
+  }
+
+  static inline T_PointerType offset_pointer(T_PointerType p, size_t offset)
+  {
+    if constexpr (std::is_pointer_v<T_PointerType>) {
+      return reinterpret_cast<T_PointerType>(reinterpret_cast<char*>(p) +
+                                             offset);
+    } else {
+      return static_cast<T_PointerType>(p + offset);
+    }
+  }
+
+  static inline uintptr_t pointer_value(T_PointerType p)
+  {
+    if constexpr (std::is_pointer_v<T_PointerType>) {
+      return reinterpret_cast<uintptr_t>(p);
+    } else {
+      return static_cast<uintptr_t>(p);
+    }
+  }
+
+  // Sets the allocated bit of the block at offset and returns its old value.
+  // Expects the lock to be held.
+  inline bool exchange_allocated(uintptr_t offset, bool allocated)
+  {
+    const size_t unit = offset / min_block_size;
+    const uint64_t mask = uint64_t(1) << (unit % 64);
+    uint64_t& word = allocated_bits[unit / 64];
+    const bool was_allocated = (word & mask) != 0;
+    word = allocated ? (word | mask) : (word & ~mask);
+    return was_allocated;
+  }
+
+  // Carves a new span into free blocks of the given size class. Expects the
+  // lock to be held.
+  inline bool add_span(size_t size_class)
+  {
+    if (next_span == span_count) {
+      return false;
+    }
+    const size_t span = next_span++;
+    span_classes[span] = static_cast<uint8_t>(size_class);
+
+    const size_t block_size = min_block_size << size_class;
+    const size_t block_count = span_size / block_size;
+    T_PointerType span_base = offset_pointer(base, span * span_size);
+    auto& blocks = free_blocks[size_class];
+    // Push in reverse so that blocks are handed out in address order
+    for (size_t i = block_count; i > 0; i--) {
+      blocks.push_back(offset_pointer(span_base, (i - 1) * block_size));
+    }
+    return true;
+  }
+
+  inline void reset_state()
+  {
+    base = T_PointerType{};
+    capacity = 0;
+    region_failed = false;
+    next_span = 0;
+    for (auto& blocks : free_blocks) {
+      blocks.clear();
+    }
+    allocated_bits.clear();
+  }
+
+public:
+  rlbox_host_allocator() { reset_state(); }
+  rlbox_host_allocator(const rlbox_host_allocator&) = delete;
+  rlbox_host_allocator& operator=(const rlbox_host_allocator&) = delete;
+
+  /**
+   * @brief allocate size bytes from the region
+   *
+   * @param allocate_region allocates the region in the sandbox on first use,
+   * e.g. with the sandbox's malloc. Returns a null pointer on failure.
+   * @return the sandboxed pointer, or a null pointer if the allocation should
+   * be served by the sandbox's malloc instead
+   */
+  template<typename T_Alloc>
+  inline T_PointerType allocate(size_t size, T_Alloc&& allocate_region)
+  {
+    if (size > max_block_size) {
+      return T_PointerType{};
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0) {
+      if (region_failed) {
+        return T_PointerType{};
+      }
+      T_PointerType region = allocate_region(RLBOX_HOST_ALLOCATOR_REGION_SIZE);
+      if (!region) {
+        // Don't ask the sandbox again on every allocation
+        region_failed = true;
+        return T_PointerType{};
+      }
+      base = region;
+      capacity = RLBOX_HOST_ALLOCATOR_REGION_SIZE;
+      for (auto& span_class : span_classes) {
+        span_class = unassigned_span;
+      }
+      allocated_bits.assign(capacity / min_block_size / 64 + 1, 0);
+    }
+
+    const size_t size_class = get_size_class(size);
+    auto& blocks = free_blocks[size_class];
+    if (blocks.empty() && !add_span(size_class)) {
+      return T_PointerType{};
+    }
+    T_PointerType ret = blocks.back();
+    blocks.pop_back();
+    exchange_allocated(pointer_value(ret) - pointer_value(base), true);
+    return ret;
+  }
+
+  /**
+   * @brief return a block to the allocator
+   *
+   * @return false if p was not allocated from the region, in which case it
+   * should be freed with the sandbox's free
+   */
+  inline bool deallocate(T_PointerType p)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0) {
+      return false;
+    }
+    const uintptr_t offset = pointer_value(p) - pointer_value(base);
+    if (pointer_value(p) < pointer_value(base) || offset >= capacity) {
+      return false;
+    }
+
+    const uint8_t size_class = span_classes[offset / span_size];
+    detail::dynamic_check(size_class != unassigned_span &&
+                            offset % (min_block_size << size_class) == 0,
+                          "Freeing a pointer that was not allocated");
+    detail::dynamic_check(exchange_allocated(offset, false),
+                          "Freeing a pointer that was already freed");
+    free_blocks[size_class].push_back(p);
+    return true;
+  }
+
+  /**
+   * @brief free the region using the given free function. Must not be called
+   * while allocations from the region are in use.
+   */
+  template<typename T_Free>
+  inline void release(T_Free&& free_region)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity != 0) {
+      free_region(base);
+    }
+    reset_state();
+  }
+
+  /**
+   * @brief drop the region without freeing it, for when the sandbox memory it
+   * was allocated from has been reset.
+   */
+  inline void forget()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    reset_state();
+  }
+};
+
+} // namespace rlbox
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "rlbox_export_cache.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+// Ensure the min/max macro in the header doesn't collide with functions in
+// std::
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <dlfcn.h>
+#endif
+
+#if (defined(__linux__) || defined(__FreeBSD__)) &&                            \
+  !defined(__CHERI_PURE_CAPABILITY__)
+#  define RLBOX_CAN_TOUCH_CODE_PAGES
+#  include <link.h>
+#  include <unistd.h>
+#endif
+
+namespace rlbox {
+
+template<typename T_Info>
+class rlbox_module_registry;
+
+/**
+ * @brief reads a byte of every page of code in the loaded library containing
+ * address, so that the pages are faulted in before the first call to them
+ * instead of during it. Does nothing where the program headers of loaded
+ * libraries cannot be walked.
+ */
+inline void rlbox_touch_code_pages(const void* address)
+{
+#ifdef RLBOX_CAN_TOUCH_CODE_PAGES
+  uintptr_t target = reinterpret_cast<uintptr_t>(address);
+  dl_iterate_phdr(
+    [](struct dl_phdr_info* info, size_t, void* data) -> int {
+      const uintptr_t target = *static_cast<uintptr_t*>(data);
+      bool found = false;
+      for (size_t i = 0; i < info->dlpi_phnum && !found; i++) {
+        const auto& header = info->dlpi_phdr[i];
+        const uintptr_t start = info->dlpi_addr + header.p_vaddr;
+        found = header.p_type == PT_LOAD && target >= start &&
+                target - start < header.p_memsz;
+      }
+      if (!found) {
+        return 0;
+      }
+
+      const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+      for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const auto& header = info->dlpi_phdr[i];
+        if (header.p_type != PT_LOAD || (header.p_flags & PF_X) == 0) {
+          continue;
+        }
+        const uintptr_t start = info->dlpi_addr + header.p_vaddr;
+        const uintptr_t end = start + header.p_memsz;
+        for (uintptr_t page = start & ~(page_size - 1); page < end;
+             page += page_size) {
+          (void)*reinterpret_cast<const volatile char*>(page);
+        }
+      }
+      // Stop iterating
+      return 1;
+    },
+    &target);
+#else
+  (void)address;
+#endif
+}
+
+/**
+ * @brief A dynamically loaded sandbox library, shared by all sandboxes created
+ * from the same library and module name.
+ *
+ * @tparam T_Info the table of sandbox functions the plugin reads from the
+ * library, e.g. wasm2c_sandbox_funcs_t.
+ */
+template<typename T_Info>
+struct rlbox_loaded_module
+{
+  void* library = nullptr;
+  T_Info info{};
+  // Exports resolved when the module was loaded. This is not modified after
+  // loading, so it can be read without holding any lock.
+  std::map<std::string, void*> exports;
+  // Exports looked up by name after loading, so that each is only resolved
+  // once for all sandboxes of the module
+  rlbox_export_cache export_cache;
+  // Lets plugins touch the module's code pages only once, see
+  // rlbox_touch_code_pages
+  std::once_flag code_touched;
+  // Lets plugins compute an identity of the module's build only once, e.g. to
+  // check that saved memory images were written from the same build
+  std::once_flag identity_computed;
+  uint64_t identity = 0;
+  // Optional hook the plugin can set to release any per module state it holds,
+  // such as cached instances. Called right before the library is unloaded.
+  void (*on_unload)(rlbox_loaded_module* module) = nullptr;
+
+  inline void* get_export(const std::string& name) const
+  {
+    auto found = exports.find(name);
+    return found != exports.end() ? found->second : nullptr;
+  }
+
+  /**
+   * @brief whether the library's symbols were bound when it was loaded. A
+   * library keeps the binding it was first loaded with, so this is false even
+   * for later sandboxes that asked for RTLD_NOW if the first one did not.
+   */
+  inline bool is_bound_eagerly() const
+  {
+#if defined(_WIN32)
+    // Windows always binds eagerly
+    return true;
+#else
+    return (dl_flags & RTLD_NOW) != 0;
+#endif
+  }
+
+private:
+  template<typename T>
+  friend class rlbox_module_registry;
+  std::string key;
+  size_t ref_count = 0;
+  int dl_flags = 0;
+};
+
+/**
+ * @brief Process wide registry of dynamically loaded sandbox libraries, keyed
+ * by library path and module name. The first sandbox of a module loads the
+ * library and resolves its exports, later sandboxes of the same module reuse
+ * them and the library is unloaded when the last sandbox releases it.
+ */
+template<typename T_Info>
+class rlbox_module_registry
+{
+public:
+  using T_Module = rlbox_loaded_module<T_Info>;
+
+private:
+  struct registry_state
+  {
+    std::mutex lock;
+    std::map<std::string, std::unique_ptr<T_Module>> modules;
+  };
+
+  // Function local static to keep this header only
+  static inline registry_state& get_state()
+  {
+    static registry_state state;
+    return state;
+  }
+
+  template<typename T_Char>
+  static inline std::string get_key(const T_Char* path,
+                                    const char* module_name)
+  {
+    size_t path_len = 0;
+    while (path[path_len] != 0) {
+      path_len++;
+    }
+    // Wide paths are keyed by their raw bytes
+    std::string key(reinterpret_cast<const char*>(path),
+                    path_len * sizeof(T_Char));
+    key += '\0';
+    key += module_name;
+    return key;
+  }
+
+#if defined(_WIN32)
+  static inline void* load_library(LPCWSTR path, int, std::string& error_msg)
+  {
+    void* library = (void*)LoadLibraryW(path);
+    if (!library) {
+      error_msg = "Could not load dynamic library: ";
+      DWORD errorMessageID = GetLastError();
+      if (errorMessageID != 0) {
+        LPSTR messageBuffer = nullptr;
+        // The api creates the buffer that holds the message
+        size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                                       FORMAT_MESSAGE_FROM_SYSTEM |
+                                       FORMAT_MESSAGE_IGNORE_INSERTS,
+                                     NULL,
+                                     errorMessageID,
+                                     MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+                                     (LPSTR)&messageBuffer,
+                                     0,
+                                     NULL);
+        // Copy the error message into a std::string.
+        std::string message(messageBuffer, size);
+        error_msg += message;
+        LocalFree(messageBuffer);
+      }
+    }
+    return library;
+  }
+#else
+  static inline void* load_library(const char* path,
+                                   int dl_flags,
+                                   std::string& error_msg)
+  {
+    void* library = dlopen(path, dl_flags);
+    if (!library) {
+      error_msg = "Could not load dynamic library: ";
+      error_msg += dlerror();
+    }
+    return library;
+  }
+#endif
+
+  static inline void close_library(void* library)
+  {
+#if defined(_WIN32)
+    FreeLibrary((HMODULE)library);
+#else
+    dlclose(library);
+#endif
+  }
+
+public:
+  static inline void* lookup_library_symbol(void* library, const char* name)
+  {
+#if defined(_WIN32)
+    return (void*)GetProcAddress((HMODULE)library, name);
+#else
+    return dlsym(library, name);
+#endif
+  }
+
+  /**
+   * @brief get the module for the given library and module name, loading it if
+   * this is the first use.
+   *
+   * @param path path of the library
+   * @param module_name name of the module in the library
+   * @param dl_flags flags passed to dlopen, ignored on Windows. If the module
+   * is already loaded, it keeps the flags it was loaded with, as dlopen does
+   * not bind a library that is already loaded again. Callers that need RTLD_NOW
+   * check is_bound_eagerly on the result.
+   * @param init_module called once when the library is first loaded, to read
+   * the module's function table and exports. Returns false and sets the error
+   * message if the library is not a valid module.
+   * @param error_msg set to the reason for the failure on failure
+   * @return the module, or nullptr on failure
+   */
+  template<typename T_Char, typename T_Init>
+  static inline T_Module* acquire(const T_Char* path,
+                                  const char* module_name,
+                                  int dl_flags,
+                                  T_Init init_module,
+                                  std::string& error_msg)
+  {
+    auto& state = get_state();
+    std::string key = get_key(path, module_name);
+
+    std::lock_guard<std::mutex> lock(state.lock);
+    auto found = state.modules.find(key);
+    if (found != state.modules.end()) {
+      found->second->ref_count++;
+      return found->second.get();
+    }
+
+    auto module = std::make_unique<T_Module>();
+    module->library = load_library(path, dl_flags, error_msg);
+    if (!module->library) {
+      return nullptr;
+    }
+    if (!init_module(*module, error_msg)) {
+      close_library(module->library);
+      return nullptr;
+    }
+
+    module->key = key;
+    module->ref_count = 1;
+    module->dl_flags = dl_flags;
+    T_Module* ret = module.get();
+    state.modules[key] = std::move(module);
+    return ret;
+  }
+
+  /**
+   * @brief drop a reference to a module returned by acquire. The library is
+   * unloaded once the last reference is dropped.
+   */
+  static inline void release(T_Module* module)
+  {
+    auto& state = get_state();
+    std::lock_guard<std::mutex> lock(state.lock);
+    module->ref_count--;
+    if (module->ref_count == 0) {
+      if (module->on_unload != nullptr) {
+        module->on_unload(module);
+      }
+      close_library(module->library);
+      // Copy the key as erasing destroys the module
+      std::string key = module->key;
+      state.modules.erase(key);
+    }
+  }
+
+  /**
+   * @brief get the module for the given library and module name if it is
+   * loaded, without taking a reference to it.
+   *
+   * @return the module, or nullptr if it is not loaded
+   */
+  template<typename T_Char>
+  static inline T_Module* find(const T_Char* path, const char* module_name)
+  {
+    auto& state = get_state();
+    std::string key = get_key(path, module_name);
+
+    std::lock_guard<std::mutex> lock(state.lock);
+    auto found = state.modules.find(key);
+    return found != state.modules.end() ? found->second.get() : nullptr;
+  }
+
+  /**
+   * @brief get the number of references held to a loaded module.
+   */
+  static inline size_t use_count(const T_Module* module)
+  {
+    auto& state = get_state();
+    std::lock_guard<std::mutex> lock(state.lock);
+    return module->ref_count;
+  }
+};
+
+} // namespace rlbox
@@ -0,0 +1,163 @@
+#pragma once
+
+// Chunks are processed by an rlbox_sandbox_executor, which needs the rlbox
+// frontend. As with rlbox.hpp, include the sandbox plugin before this header.
+#include "rlbox.hpp"
+#include "rlbox_bulk_copy.hpp"
+#include "rlbox_helpers.hpp"
+#include "rlbox_sandbox_executor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rlbox {
+
+struct rlbox_parallel_map_options
+{
+  // Number of input elements per chunk
+  size_t chunk_size = 64 * 1024;
+  // Number of chunks processed at once, 0 to use every sandbox of the executor
+  size_t parallelism = 0;
+};
+
+namespace parallel_map_detail {
+  template<typename T_Sbx, typename T_In, typename T_Fn>
+  using map_result_t = std::invoke_result_t<T_Fn&,
+                                            rlbox_sandbox<T_Sbx>&,
+                                            tainted<T_In*, T_Sbx>,
+                                            size_t>;
+} // namespace parallel_map_detail
+
+/**
+ * @brief Splits count elements of input into chunks, runs fn on every chunk in
+ * the sandboxes of an executor in parallel, and returns the results of the
+ * chunks in order.
+ *
+ * Each parallel task allocates one buffer of chunk_size elements in the
+ * sandbox it runs on and reuses it for all the chunks it processes, so a chunk
+ * costs a copy into sandbox memory and the invocations made by fn, and no
+ * allocations.
+ *
+ * @param fn called as fn(sandbox, chunk, chunk_count), where chunk is the
+ * chunk copied into sandbox memory. fn may run concurrently for different
+ * chunks, on different sandboxes, so it must be thread safe.
+ * @return the result of fn for each chunk
+ */
+template<typename T_Sbx, typename T_In, typename T_Fn>
+inline std::vector<parallel_map_detail::map_result_t<T_Sbx, T_In, T_Fn>>
+rlbox_parallel_map(rlbox_sandbox_executor<T_Sbx>& executor,
+                   const T_In* input,
+                   size_t count,
+                   T_Fn&& fn,
+                   const rlbox_parallel_map_options& options = {})
+{
+  using T_Ret = parallel_map_detail::map_result_t<T_Sbx, T_In, T_Fn>;
+  static_assert(std::is_trivially_copyable_v<T_In>,
+                "Chunks are copied into the sandbox with memcpy");
+  static_assert(!std::is_void_v<T_Ret> &&
+                  std::is_default_constructible_v<T_Ret>,
+                "The function must return a default constructible result");
+  detail::dynamic_check(options.chunk_size != 0, "Chunk size must not be 0");
+  detail::dynamic_check(
+    options.chunk_size <= std::numeric_limits<uint32_t>::max() / sizeof(T_In),
+    "Chunk size too large for the sandbox");
+
+  const size_t chunk_count = (count + options.chunk_size - 1) /
+                             options.chunk_size;
+  if (chunk_count == 0) {
+    return {};
+  }
+  // Tasks write the results of different chunks concurrently, which a
+  // std::vector<bool> would pack into shared words
+  std::unique_ptr<T_Ret[]> chunk_results(new T_Ret[chunk_count]);
+
+  size_t parallelism =
+    options.parallelism != 0 ? options.parallelism : executor.size();
+  parallelism = std::min(parallelism, chunk_count);
+
+  // Tasks claim chunks from next_chunk until all chunks are processed
+  std::atomic<size_t> next_chunk{ 0 };
+  auto process = [&](rlbox_sandbox<T_Sbx>& sandbox) {
+    // Sized to the chunk, which is checked above to fit in the sandbox
+    const size_t buffer_count = std::min(options.chunk_size, count);
+    tainted<T_In*, T_Sbx> buffer =
+      sandbox.template malloc_in_sandbox<T_In>(
+        static_cast<uint32_t>(buffer_count));
+    detail::dynamic_check(
+      buffer != nullptr,
+      "Could not allocate chunk buffer. Sandbox may be out of memory!");
+    auto on_exit =
+      detail::make_scope_exit([&] { sandbox.free_in_sandbox(buffer); });
+
+    while (true) {
+      const size_t chunk = next_chunk.fetch_add(1, std::memory_order_relaxed);
+      if (chunk >= chunk_count) {
+        return;
+      }
+      const size_t start = chunk * options.chunk_size;
+      const size_t elements = std::min(options.chunk_size, count - start);
+      const size_t bytes = elements * sizeof(T_In);
+      rlbox_bulk_copy(
+        buffer.unverified_safe_pointer_because(elements, "copying chunk"),
+        input + start,
+        bytes);
+      chunk_results[chunk] = fn(sandbox, buffer, elements);
+    }
+  };
+
+  std::vector<std::future<void>> tasks;
+  tasks.reserve(parallelism);
+  for (size_t i = 0; i < parallelism; i++) {
+    tasks.push_back(executor.submit(process));
+  }
+  // Wait for all tasks before rethrowing, as they use this frame
+  for (auto& task : tasks) {
+    task.wait();
+  }
+  for (auto& task : tasks) {
+    task.get();
+  }
+
+  std::vector<T_Ret> results;
+  results.reserve(chunk_count);
+  for (size_t i = 0; i < chunk_count; i++) {
+    results.push_back(std::move(chunk_results[i]));
+  }
+  return results;
+}
+
+/**
+ * @brief rlbox_parallel_map on replicas created for this call. The number of
+ * replicas is options.parallelism, or the number of cores if that is 0.
+ *
+ * @param create_args the arguments passed to create_sandbox for each replica
+ */
+template<typename T_Sbx, typename T_In, typename T_Fn, typename... T_Args>
+inline std::vector<parallel_map_detail::map_result_t<T_Sbx, T_In, T_Fn>>
+rlbox_parallel_map_new_replicas(const T_In* input,
+                                size_t count,
+                                T_Fn&& fn,
+                                const rlbox_parallel_map_options& options,
+                                T_Args... create_args)
+{
+  size_t replicas = options.parallelism;
+  if (replicas == 0) {
+    replicas = std::max(1u, std::thread::hardware_concurrency());
+  }
+  rlbox_sandbox_executor<T_Sbx> executor;
+  detail::dynamic_check(executor.start(replicas, create_args...),
+                        "Could not create sandbox replicas");
+  return rlbox_parallel_map(
+    executor, input, count, std::forward<T_Fn>(fn), options);
+}
+
+} // namespace rlbox
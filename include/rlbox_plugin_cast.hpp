@@ -0,0 +1,24 @@
+#pragma once
+
+#include <type_traits>
+
+namespace rlbox {
+
+/**
+ * @brief get the plugin of an rlbox_sandbox. The rlbox frontend does not
+ * expose its plugin, so helpers that need plugin specific APIs, such as
+ * sessions and batches, use this to reach the plugin of a sandbox.
+ *
+ * @tparam T_Plugin the sandbox plugin, e.g. rlbox_wasm2c_sandbox
+ */
+template<typename T_Plugin, typename T_Frontend>
+inline T_Plugin* rlbox_get_plugin(T_Frontend& sandbox)
+{
+  static_assert(std::is_base_of_v<T_Plugin, T_Frontend>,
+                "Expected an rlbox_sandbox of the given plugin");
+  // The frontend may inherit from the plugin non publicly, and a c-style cast
+  // is the only cast that can convert to an inaccessible base class
+  return (T_Plugin*)(&sandbox); // NOLINT
+}
+
+} // namespace rlbox
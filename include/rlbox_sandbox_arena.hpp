@@ -0,0 +1,115 @@
+#pragma once
+
+// The arena hands out tainted pointers, so it needs the rlbox frontend. As with
+// rlbox.hpp, include the sandbox plugin before this header.
+#include "rlbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rlbox {
+
+// Default size of the sandbox allocation backing an rlbox_sandbox_arena
+#ifndef RLBOX_SANDBOX_ARENA_DEFAULT_SIZE
+#  define RLBOX_SANDBOX_ARENA_DEFAULT_SIZE (64 * 1024)
+#endif
+
+/**
+ * @brief Allocates tainted buffers whose lifetime is a single operation. The
+ * arena makes one allocation in the sandbox when it is first used, hands out
+ * pieces of it, and frees it with a single call when the arena goes out of
+ * scope. This replaces a malloc_in_sandbox and free_in_sandbox per buffer,
+ * which for wasm2c are invocations into the sandbox and for the cheri plugins
+ * are calls to the shared host allocator.
+ *
+ * Allocations that do not fit in the remaining space fall back to
+ * malloc_in_sandbox and are also freed when the arena goes out of scope.
+ * Pointers handed out by the arena must not be used or freed after that.
+ *
+ * Usage:
+ *   rlbox_sandbox_arena<rlbox_wasm2c_sandbox> arena(sandbox);
+ *   auto name = arena.allocate<char>(name_len + 1);
+ *   auto opts = arena.allocate<options_t>();
+ *   sandbox.invoke_sandbox_function(open_file, name, opts);
+ *
+ * @tparam T_Sbx the sandbox plugin, e.g. rlbox_wasm2c_sandbox
+ */
+template<typename T_Sbx>
+class rlbox_sandbox_arena
+{
+private:
+  // Keep allocations aligned for any type, including 128-bit capabilities
+  static constexpr size_t alignment = 16;
+
+  rlbox_sandbox<T_Sbx>& sandbox;
+  const size_t capacity;
+  tainted<char*, T_Sbx> base = nullptr;
+  size_t top = 0;
+  std::vector<tainted<char*, T_Sbx>> overflow;
+
+public:
+  explicit rlbox_sandbox_arena(
+    rlbox_sandbox<T_Sbx>& p_sandbox,
+    size_t p_capacity = RLBOX_SANDBOX_ARENA_DEFAULT_SIZE)
+    : sandbox(p_sandbox)
+    , capacity(p_capacity)
+  {}
+
+  rlbox_sandbox_arena(const rlbox_sandbox_arena&) = delete;
+  rlbox_sandbox_arena& operator=(const rlbox_sandbox_arena&) = delete;
+
+  ~rlbox_sandbox_arena() { release(); }
+
+  /**
+   * @brief allocate an array of count objects of type T
+   *
+   * @return the tainted pointer, or nullptr if the sandbox is out of memory
+   */
+  template<typename T>
+  inline tainted<T*, T_Sbx> allocate(uint32_t count = 1)
+  {
+    const size_t size = sizeof(T) * static_cast<size_t>(count);
+    const size_t aligned_size = (size + alignment - 1) & ~(alignment - 1);
+
+    if (base == nullptr && top == 0 && aligned_size <= capacity) {
+      base = sandbox.template malloc_in_sandbox<char>(
+        static_cast<uint32_t>(capacity));
+      if (base == nullptr) {
+        // Don't ask the sandbox again for the full arena
+        top = capacity;
+      }
+    }
+
+    if (base != nullptr && aligned_size <= capacity - top) {
+      tainted<char*, T_Sbx> ret = base + top;
+      top += aligned_size;
+      return sandbox_reinterpret_cast<T*>(ret);
+    }
+
+    tainted<T*, T_Sbx> ret = sandbox.template malloc_in_sandbox<T>(count);
+    if (ret != nullptr) {
+      overflow.push_back(sandbox_reinterpret_cast<char*>(ret));
+    }
+    return ret;
+  }
+
+  /**
+   * @brief free everything allocated from the arena. The arena can be used
+   * again afterwards.
+   */
+  inline void release()
+  {
+    if (base != nullptr) {
+      sandbox.free_in_sandbox(base);
+      base = nullptr;
+    }
+    top = 0;
+    for (auto& p : overflow) {
+      sandbox.free_in_sandbox(p);
+    }
+    overflow.clear();
+  }
+};
+
+} // namespace rlbox
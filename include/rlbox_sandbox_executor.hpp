@@ -0,0 +1,217 @@
+#pragma once
+
+// The executor creates rlbox_sandbox objects, so it needs the rlbox frontend.
+// As with rlbox.hpp, include the sandbox plugin before this header.
+#include "rlbox.hpp"
+#include "rlbox_helpers.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rlbox {
+
+/**
+ * @brief Runs calls on a set of identical sandboxes, one worker thread per
+ * sandbox. Each worker holds an rlbox_sandbox_session for its sandbox, so each
+ * sandbox is only ever entered from its own thread, one call at a time, and
+ * the thread state used by callbacks always belongs to that sandbox.
+ *
+ * Submitted calls are spread over the workers' queues. A worker that runs out
+ * of calls steals from the back of the other queues, so uneven calls do not
+ * leave workers idle. A call may therefore run on any of the sandboxes, and is
+ * passed the sandbox it runs on.
+ *
+ * Usage:
+ *   rlbox_sandbox_executor<rlbox_wasm2c_sandbox> executor;
+ *   executor.start(std::thread::hardware_concurrency(), "lib.so");
+ *   auto result = executor.submit([](auto& sandbox) {
+ *     return sandbox.invoke_sandbox_function(parse, ...).copy_and_verify(...);
+ *   });
+ *
+ * @tparam T_Sbx the sandbox plugin, e.g. rlbox_wasm2c_sandbox
+ */
+template<typename T_Sbx>
+class rlbox_sandbox_executor
+{
+public:
+  using T_Sandbox = rlbox_sandbox<T_Sbx>;
+  using T_Task = std::function<void(T_Sandbox&)>;
+
+private:
+  struct worker
+  {
+    std::unique_ptr<T_Sandbox> sandbox;
+    std::mutex queue_mutex;
+    std::deque<T_Task> queue;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<worker>> workers;
+  std::atomic<size_t> next_worker{ 0 };
+
+  // Workers sleep on this while no calls are pending
+  std::mutex idle_mutex;
+  std::condition_variable idle_cv;
+  std::atomic<size_t> pending{ 0 };
+  bool stopping = false;
+
+  inline bool pop_own(worker& w, T_Task& task)
+  {
+    std::lock_guard<std::mutex> lock(w.queue_mutex);
+    if (w.queue.empty()) {
+      return false;
+    }
+    task = std::move(w.queue.front());
+    w.queue.pop_front();
+    return true;
+  }
+
+  inline bool steal(size_t thief, T_Task& task)
+  {
+    for (size_t i = 1; i < workers.size(); i++) {
+      worker& victim = *workers[(thief + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(victim.queue_mutex);
+      if (!victim.queue.empty()) {
+        task = std::move(victim.queue.back());
+        victim.queue.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline void run(size_t index)
+  {
+    worker& self = *workers[index];
+    rlbox_sandbox_session<T_Sbx> session(*self.sandbox);
+    while (true) {
+      T_Task task;
+      if (pop_own(self, task) || steal(index, task)) {
+        pending.fetch_sub(1, std::memory_order_relaxed);
+        task(*self.sandbox);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      idle_cv.wait(lock, [&] {
+        return stopping || pending.load(std::memory_order_relaxed) != 0;
+      });
+      if (stopping && pending.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+    }
+  }
+
+public:
+  rlbox_sandbox_executor() = default;
+  rlbox_sandbox_executor(const rlbox_sandbox_executor&) = delete;
+  rlbox_sandbox_executor& operator=(const rlbox_sandbox_executor&) = delete;
+
+  ~rlbox_sandbox_executor() { stop(); }
+
+  /**
+   * @brief creates the sandboxes and starts their workers
+   *
+   * @param count the number of sandboxes
+   * @param create_args the arguments passed to create_sandbox for each sandbox.
+   * If these make creation fallible, a failure to create any of the sandboxes
+   * destroys the ones already created.
+   * @return true when all sandboxes were created
+   */
+  template<typename... T_Args>
+  inline bool start(size_t count, T_Args... create_args)
+  {
+    detail::dynamic_check(workers.empty(), "Sandbox executor already started");
+    detail::dynamic_check(count != 0, "Sandbox executor needs a sandbox");
+
+    for (size_t i = 0; i < count; i++) {
+      auto w = std::make_unique<worker>();
+      w->sandbox = std::make_unique<T_Sandbox>();
+      if (!w->sandbox->create_sandbox(create_args...)) {
+        for (auto& created : workers) {
+          created->sandbox->destroy_sandbox();
+        }
+        workers.clear();
+        return false;
+      }
+      workers.emplace_back(std::move(w));
+    }
+
+    stopping = false;
+    for (size_t i = 0; i < count; i++) {
+      workers[i]->thread = std::thread([this, i] { run(i); });
+    }
+    return true;
+  }
+
+  /**
+   * @brief runs the calls already submitted, then stops the workers and
+   * destroys the sandboxes
+   */
+  inline void stop()
+  {
+    if (workers.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      stopping = true;
+    }
+    idle_cv.notify_all();
+    for (auto& w : workers) {
+      w->thread.join();
+      w->sandbox->destroy_sandbox();
+    }
+    workers.clear();
+  }
+
+  /**
+   * @brief queues fn to run on one of the sandboxes
+   *
+   * @param fn called with the rlbox_sandbox it runs on
+   * @return a future for the result of fn
+   */
+  template<typename T_Fn>
+  inline std::future<std::invoke_result_t<T_Fn, T_Sandbox&>> submit(T_Fn&& fn)
+  {
+    using T_Ret = std::invoke_result_t<T_Fn, T_Sandbox&>;
+    detail::dynamic_check(!workers.empty(), "Sandbox executor not started");
+
+    // std::function requires copyable functions, so share the task
+    auto task = std::make_shared<std::packaged_task<T_Ret(T_Sandbox&)>>(
+      std::forward<T_Fn>(fn));
+    auto ret = task->get_future();
+
+    {
+      // Count the call before queuing it, so that workers never take more
+      // calls than are counted. Taking the lock orders the increment with a
+      // worker about to sleep.
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    const size_t index =
+      next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+      std::lock_guard<std::mutex> lock(workers[index]->queue_mutex);
+      workers[index]->queue.emplace_back(
+        [task](T_Sandbox& sandbox) { (*task)(sandbox); });
+    }
+    idle_cv.notify_one();
+    return ret;
+  }
+
+  inline size_t size() const { return workers.size(); }
+};
+
+} // namespace rlbox
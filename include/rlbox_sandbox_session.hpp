@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+
+#include "rlbox_plugin_cast.hpp"
+
+namespace rlbox {
+
+/**
+ * @brief Binds a sandbox to the calling thread for the lifetime of the
+ * session. Each invocation into a sandbox normally records the sandbox in the
+ * thread's sandbox state and restores the previous value afterwards, which
+ * goes through an out of line getter when the embedder provides the thread
+ * locals. Invocations made by the thread that owns the session skip the write
+ * and restore, as the session already did it once, as long as the sandbox is
+ * still the one bound to the thread. It is not while the thread runs in
+ * another sandbox, e.g. when a callback from another sandbox invokes this one,
+ * or while the thread has a session open on another sandbox.
+ *
+ * Only one thread owns the session of a sandbox at a time. Sessions opened on
+ * other threads, or nested sessions, still bind the sandbox to their thread but
+ * leave ownership with the first session, so invocations from those threads
+ * keep doing the per call save and restore.
+ *
+ * Usage:
+ *   rlbox_sandbox_session<rlbox_wasm2c_sandbox> session(sandbox);
+ *   for (...) { sandbox.invoke_sandbox_function(...); }
+ *
+ * @tparam T_Plugin the sandbox plugin, e.g. rlbox_wasm2c_sandbox
+ */
+template<typename T_Plugin>
+class rlbox_sandbox_session
+{
+private:
+  using T_ThreadData =
+    std::remove_pointer_t<decltype(T_Plugin::get_session_thread_data())>;
+
+  T_Plugin* plugin;
+  T_ThreadData* thread_data;
+  T_Plugin* old_sandbox;
+  bool owns_session = false;
+
+public:
+  template<typename T_Frontend>
+  explicit rlbox_sandbox_session(T_Frontend& sandbox)
+    : plugin(rlbox_get_plugin<T_Plugin>(sandbox))
+  {
+    thread_data = T_Plugin::get_session_thread_data();
+    old_sandbox = thread_data->sandbox;
+    thread_data->sandbox = plugin;
+
+    std::thread::id no_owner;
+    owns_session = plugin->session_thread.compare_exchange_strong(
+      no_owner, std::this_thread::get_id());
+  }
+
+  rlbox_sandbox_session(const rlbox_sandbox_session&) = delete;
+  rlbox_sandbox_session& operator=(const rlbox_sandbox_session&) = delete;
+
+  ~rlbox_sandbox_session()
+  {
+    if (owns_session) {
+      plugin->session_thread.store(std::thread::id());
+    }
+    thread_data->sandbox = old_sandbox;
+  }
+
+  /**
+   * @brief checks if invocations into the sandbox from the calling thread can
+   * skip binding the sandbox to the thread.
+   */
+  static inline bool is_bound_to_thread(const T_Plugin* plugin)
+  {
+    return plugin->session_thread.load(std::memory_order_relaxed) ==
+             std::this_thread::get_id() &&
+           T_Plugin::get_session_thread_data()->sandbox == plugin;
+  }
+};
+
+} // namespace rlbox
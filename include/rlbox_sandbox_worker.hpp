@@ -0,0 +1,233 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#  include <coroutine>
+#  define RLBOX_SANDBOX_WORKER_COROUTINES
+#endif
+
+#include "rlbox_plugin_cast.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+namespace rlbox {
+
+/**
+ * @brief Runs calls into a sandbox on a dedicated thread, so that long running
+ * sandboxed code does not block the calling thread, e.g. an event loop. The
+ * worker thread holds an rlbox_sandbox_session for its lifetime, so the
+ * sandbox is bound to it and the thread state that callbacks rely on is set up
+ * there. Callbacks invoked by the sandbox run on the worker thread, and can use
+ * marshal to run code on the owner thread instead.
+ *
+ * Calls are queued and run one at a time, in order. With C++20 coroutines the
+ * result can be awaited:
+ *
+ *   rlbox_sandbox_worker<rlbox_wasm2c_sandbox> worker(sandbox, post_to_loop);
+ *   auto len = co_await worker.async([&] {
+ *     return sandbox.invoke_sandbox_function(parse, buf, size)
+ *       .copy_and_verify([](size_t val) { return val; });
+ *   });
+ *
+ * Without coroutines, submit returns a std::future.
+ *
+ * @tparam T_Sbx the sandbox plugin, e.g. rlbox_wasm2c_sandbox
+ */
+template<typename T_Sbx>
+class rlbox_sandbox_worker
+{
+public:
+  // Runs a task on the owner thread, e.g. by posting it to an event loop
+  using T_Executor = std::function<void(std::function<void()>)>;
+
+private:
+  T_Sbx* plugin;
+  T_Executor owner_executor;
+
+  std::mutex lock;
+  std::condition_variable cond_var;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+  std::thread worker_thread;
+
+  inline void run()
+  {
+    rlbox_sandbox_session<T_Sbx> session(*plugin);
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        cond_var.wait(guard, [&] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  inline void post(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      tasks.push_back(std::move(task));
+    }
+    cond_var.notify_one();
+  }
+
+  inline void run_on_owner(std::function<void()> task)
+  {
+    if (owner_executor) {
+      owner_executor(std::move(task));
+    } else {
+      task();
+    }
+  }
+
+public:
+  /**
+   * @param p_owner_executor runs tasks on the owner thread. Coroutines awaiting
+   * a call are resumed through it, and marshal uses it. If empty, coroutines
+   * resume on the worker thread and marshal runs its function directly.
+   */
+  template<typename T_Frontend>
+  explicit rlbox_sandbox_worker(T_Frontend& sandbox,
+                                T_Executor p_owner_executor = nullptr)
+    : plugin(rlbox_get_plugin<T_Sbx>(sandbox))
+    , owner_executor(std::move(p_owner_executor))
+  {
+    worker_thread = std::thread([this] { run(); });
+  }
+
+  rlbox_sandbox_worker(const rlbox_sandbox_worker&) = delete;
+  rlbox_sandbox_worker& operator=(const rlbox_sandbox_worker&) = delete;
+
+  /**
+   * @brief runs the calls already queued and stops the worker thread
+   */
+  ~rlbox_sandbox_worker()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    cond_var.notify_one();
+    worker_thread.join();
+  }
+
+  inline bool is_worker_thread() const
+  {
+    return std::this_thread::get_id() == worker_thread.get_id();
+  }
+
+  /**
+   * @brief queues fn, which calls into the sandbox, to run on the worker
+   * thread
+   *
+   * @return a future for the result of fn
+   */
+  template<typename T_Fn>
+  inline std::future<std::invoke_result_t<T_Fn>> submit(T_Fn&& fn)
+  {
+    using T_Ret = std::invoke_result_t<T_Fn>;
+    // std::function requires copyable functions, so share the task
+    auto task =
+      std::make_shared<std::packaged_task<T_Ret()>>(std::forward<T_Fn>(fn));
+    auto ret = task->get_future();
+    post([task] { (*task)(); });
+    return ret;
+  }
+
+  /**
+   * @brief runs fn on the owner thread and waits for its result. Meant to be
+   * used by callbacks, which the sandbox invokes on the worker thread, for work
+   * that must happen on the owner thread. fn must not call into the sandbox.
+   */
+  template<typename T_Fn>
+  inline std::invoke_result_t<T_Fn> marshal(T_Fn&& fn)
+  {
+    using T_Ret = std::invoke_result_t<T_Fn>;
+    if (!owner_executor || !is_worker_thread()) {
+      return std::forward<T_Fn>(fn)();
+    }
+    std::packaged_task<T_Ret()> task(std::forward<T_Fn>(fn));
+    auto ret = task.get_future();
+    owner_executor([&task] { task(); });
+    return ret.get();
+  }
+
+#ifdef RLBOX_SANDBOX_WORKER_COROUTINES
+  template<typename T_Fn>
+  class invoke_awaitable
+  {
+  private:
+    using T_Ret = std::invoke_result_t<T_Fn>;
+    using T_Result =
+      std::conditional_t<std::is_void_v<T_Ret>, bool, std::optional<T_Ret>>;
+
+    rlbox_sandbox_worker* worker;
+    T_Fn fn;
+    T_Result result{};
+    std::exception_ptr error;
+
+  public:
+    invoke_awaitable(rlbox_sandbox_worker* p_worker, T_Fn p_fn)
+      : worker(p_worker)
+      , fn(std::move(p_fn))
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      worker->post([this, handle] {
+        try {
+          if constexpr (std::is_void_v<T_Ret>) {
+            fn();
+          } else {
+            result.emplace(fn());
+          }
+        } catch (...) {
+          error = std::current_exception();
+        }
+        worker->run_on_owner([handle] { handle.resume(); });
+      });
+    }
+
+    T_Ret await_resume()
+    {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      if constexpr (!std::is_void_v<T_Ret>) {
+        return std::move(*result);
+      }
+    }
+  };
+
+  /**
+   * @brief returns an awaitable that runs fn, which calls into the sandbox, on
+   * the worker thread and resumes the awaiting coroutine with its result on
+   * the owner thread.
+   */
+  template<typename T_Fn>
+  inline invoke_awaitable<std::decay_t<T_Fn>> async(T_Fn&& fn)
+  {
+    return invoke_awaitable<std::decay_t<T_Fn>>(this, std::forward<T_Fn>(fn));
+  }
+#endif
+};
+
+} // namespace rlbox
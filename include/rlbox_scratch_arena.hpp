@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+
+// Size of the scratch region each sandbox reserves in its memory for
+// marshaling arguments, see rlbox_scratch_arena
+#ifndef RLBOX_SCRATCH_ARENA_SIZE
+#  define RLBOX_SCRATCH_ARENA_SIZE 4096
+#endif
+
+namespace rlbox {
+
+/**
+ * @brief A region of sandbox memory used as a bump allocator for data that
+ * only lives for the duration of one invocation, such as class arguments
+ * passed by value. The region is allocated in the sandbox once, on first use,
+ * after which these allocations need no calls to the sandbox's malloc and free.
+ *
+ * One thread at a time owns the arena, for the duration of an invocation.
+ * Nested invocations on the owning thread, e.g. from callbacks, allocate above
+ * the outer invocation's data and release their allocations when they return.
+ * Invocations on other threads, and allocations that do not fit, get no arena
+ * memory and should fall back to malloc_in_sandbox.
+ *
+ * @tparam T_PointerType the sandboxed pointer representation of the plugin
+ */
+template<typename T_PointerType>
+class rlbox_scratch_arena
+{
+private:
+  // Keep allocations aligned for any type, including 128-bit capabilities
+  static constexpr size_t alignment = 16;
+
+  T_PointerType base{};
+  size_t capacity = 0;
+  size_t top = 0;
+  std::atomic<std::thread::id> owner{};
+
+  static inline T_PointerType offset_pointer(T_PointerType p, size_t offset)
+  {
+    if constexpr (std::is_pointer_v<T_PointerType>) {
+      return reinterpret_cast<T_PointerType>(reinterpret_cast<char*>(p) +
+                                             offset);
+    } else {
+      return static_cast<T_PointerType>(p + offset);
+    }
+  }
+
+public:
+  /**
+   * @brief Gives access to the arena for the duration of an invocation.
+   * Allocations made through the scope are released when it ends.
+   */
+  class scope
+  {
+  private:
+    rlbox_scratch_arena* arena = nullptr;
+    bool claimed = false;
+    size_t saved_top = 0;
+
+  public:
+    /**
+     * @param enabled whether the invocation needs the arena at all. Callers
+     * pass a compile time constant, so invocations without arena data pay
+     * nothing.
+     * @param allocate_backing allocates the arena in the sandbox on first use,
+     * e.g. with impl_malloc_in_sandbox. Returns a null pointer on failure.
+     */
+    template<typename T_Alloc>
+    inline scope(rlbox_scratch_arena& p_arena,
+                 bool enabled,
+                 T_Alloc&& allocate_backing)
+    {
+      if (!enabled) {
+        return;
+      }
+      const std::thread::id self = std::this_thread::get_id();
+      std::thread::id expected;
+      if (p_arena.owner.compare_exchange_strong(
+            expected, self, std::memory_order_acquire)) {
+        claimed = true;
+      } else if (expected != self) {
+        // Another thread is using the arena
+        return;
+      }
+
+      arena = &p_arena;
+      saved_top = arena->top;
+      if (arena->capacity == 0) {
+        T_PointerType backing = allocate_backing(RLBOX_SCRATCH_ARENA_SIZE);
+        if (backing) {
+          arena->base = backing;
+          arena->capacity = RLBOX_SCRATCH_ARENA_SIZE;
+        }
+      }
+    }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+
+    inline ~scope()
+    {
+      if (arena == nullptr) {
+        return;
+      }
+      arena->top = saved_top;
+      if (claimed) {
+        arena->owner.store(std::thread::id(), std::memory_order_release);
+      }
+    }
+
+    /**
+     * @brief allocate size bytes from the arena
+     * @return the sandboxed pointer, or a null pointer if the arena is not
+     * available or full
+     */
+    inline T_PointerType allocate(size_t size)
+    {
+      if (arena == nullptr) {
+        return T_PointerType{};
+      }
+      const size_t aligned_size = (size + alignment - 1) & ~(alignment - 1);
+      if (aligned_size > arena->capacity - arena->top) {
+        return T_PointerType{};
+      }
+      T_PointerType ret = offset_pointer(arena->base, arena->top);
+      arena->top += aligned_size;
+      return ret;
+    }
+  };
+
+  /**
+   * @brief free the arena's region using the given free function. Must not be
+   * called while an invocation is using the arena.
+   */
+  template<typename T_Free>
+  inline void release(T_Free&& free_backing)
+  {
+    if (capacity != 0) {
+      free_backing(base);
+    }
+    forget();
+  }
+
+  /**
+   * @brief drop the arena's region without freeing it, for when the sandbox
+   * memory it was allocated from has been reset.
+   */
+  inline void forget()
+  {
+    base = T_PointerType{};
+    capacity = 0;
+    top = 0;
+  }
+};
+
+} // namespace rlbox
@@ -7,10 +7,15 @@
 #include "rlbox_wasm2c_sandbox.hpp"
 #include "wasm2c_callback.hpp"
 #include "wasm2c_details.hpp"
+#include "wasm2c_grant_access.hpp"
+#include "wasm2c_instance_cache.hpp"
 #include "wasm2c_invoke_func_ptr.hpp"
 #include "wasm2c_misc.hpp"
 #include "wasm2c_setup_teardown.hpp"
+#include "wasm2c_snapshot.hpp"
 #include "wasm2c_swizzle.hpp"
+// Uses impl_invoke_with_func_ptr, whose return type must be deduced first
+#include "wasm2c_batch.hpp"
 
 using rlbox::rlbox_wasm2c_sandbox;
 
@@ -25,7 +25,7 @@ namespace rlbox {
 rlbox_wasm2c_sandbox_thread_data* get_rlbox_wasm2c_sandbox_thread_data();
 #  define RLBOX_WASM2C_SANDBOX_STATIC_VARIABLES()                              \
     thread_local rlbox::rlbox_wasm2c_sandbox_thread_data                       \
-      rlbox_wasm2c_sandbox_thread_info{ 0, 0 };                                \
+      rlbox_wasm2c_sandbox_thread_info{ 0, 0, 0 };                             \
     namespace rlbox {                                                          \
       rlbox_wasm2c_sandbox_thread_data* get_rlbox_wasm2c_sandbox_thread_data() \
       {                                                                        \
@@ -0,0 +1,83 @@
+#pragma once
+
+// The allocations are handed out as tainted pointers, so this needs the rlbox
+// frontend in addition to the wasm2c plugin
+#include "impl.hpp"
+#include "rlbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rlbox {
+
+/**
+ * @brief allocate arrays of objects of type T in a wasm2c sandbox, with a
+ * single invocation into the sandbox for all of them rather than one per
+ * malloc_in_sandbox. Free the allocations with
+ * rlbox_wasm2c_free_in_sandbox_bulk, or one at a time with free_in_sandbox.
+ *
+ * Usage:
+ *   const uint32_t counts[] = { name_len + 1, value_len + 1 };
+ *   auto bufs = rlbox_wasm2c_malloc_in_sandbox_bulk<char>(sandbox, counts, 2);
+ *
+ * @param counts the number of objects in each allocation
+ * @param count the number of allocations
+ * @return a tainted pointer for each allocation, nullptr for each allocation
+ * that failed
+ */
+template<typename T>
+inline std::vector<tainted<T*, rlbox_wasm2c_sandbox>>
+rlbox_wasm2c_malloc_in_sandbox_bulk(
+  rlbox_sandbox<rlbox_wasm2c_sandbox>& sandbox,
+  const uint32_t* counts,
+  size_t count)
+{
+  using T_PointerType = rlbox_wasm2c_sandbox::T_PointerType;
+  auto plugin = rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  std::vector<size_t> sizes(count);
+  for (size_t i = 0; i < count; i++) {
+    detail::dynamic_check(counts[i] != 0, "Malloc tried to allocate 0 bytes");
+    sizes[i] = sizeof(T) * static_cast<size_t>(counts[i]);
+  }
+  std::vector<T_PointerType> ptrs(count);
+  plugin->impl_malloc_in_sandbox_bulk(sizes.data(), count, ptrs.data());
+
+  std::vector<tainted<T*, rlbox_wasm2c_sandbox>> ret;
+  ret.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    T* ptr = nullptr;
+    if (ptrs[i]) {
+      ptr = static_cast<T*>(plugin->impl_get_unsandboxed_pointer<T*>(ptrs[i]));
+    }
+    ret.push_back(tainted<T*, rlbox_wasm2c_sandbox>::internal_factory(ptr));
+  }
+  return ret;
+}
+
+/**
+ * @brief free allocations of a wasm2c sandbox with a single invocation into
+ * the sandbox. Null pointers are skipped.
+ */
+template<typename T>
+inline void rlbox_wasm2c_free_in_sandbox_bulk(
+  rlbox_sandbox<rlbox_wasm2c_sandbox>& sandbox,
+  const std::vector<tainted<T*, rlbox_wasm2c_sandbox>>& allocations)
+{
+  using T_PointerType = rlbox_wasm2c_sandbox::T_PointerType;
+  auto plugin = rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  std::vector<T_PointerType> ptrs(allocations.size());
+  for (size_t i = 0; i < allocations.size(); i++) {
+    T* ptr = allocations[i].UNSAFE_unverified();
+    if (ptr != nullptr) {
+      detail::dynamic_check(sandbox.is_pointer_in_sandbox_memory(ptr),
+                            "Freeing a pointer outside the sandbox memory");
+      ptrs[i] = plugin->impl_get_sandboxed_pointer<T*>(ptr);
+    }
+  }
+  plugin->impl_free_in_sandbox_bulk(ptrs.data(), ptrs.size());
+}
+
+} // namespace rlbox
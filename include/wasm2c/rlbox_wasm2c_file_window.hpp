@@ -0,0 +1,201 @@
+#pragma once
+
+// The window hands out tainted pointers, so this needs the rlbox frontend in
+// addition to the wasm2c plugin
+#include "impl.hpp"
+#include "rlbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(_WIN32)
+#  include <sys/stat.h>
+#endif
+
+// Default size of the window of a file that is mapped into the sandbox at once
+#ifndef RLBOX_WASM2C_FILE_WINDOW_SIZE
+#  define RLBOX_WASM2C_FILE_WINDOW_SIZE (16 * 1024 * 1024)
+#endif
+
+namespace rlbox {
+
+/**
+ * @brief Maps a file into the memory of a wasm2c sandbox, so that sandboxed
+ * code can read it without the file being read into host memory and copied.
+ * The file is mapped through a window of fixed size in the sandbox heap, which
+ * slides forward as the sandboxed code consumes the file, so files larger than
+ * the sandbox heap or than RAM stream through the window.
+ *
+ * The window must be destroyed before its sandbox. Moving the window, or
+ * restoring a snapshot of the sandbox, makes earlier pointers into the window
+ * invalid.
+ *
+ * Usage:
+ *   rlbox_wasm2c_file_window window(sandbox, fd);
+ *   while (window.size() != 0) {
+ *     auto consumed = sandbox.invoke_sandbox_function(
+ *       decode, window.data(), window.size()).copy_and_verify(...);
+ *     window.advance(consumed);
+ *   }
+ */
+class rlbox_wasm2c_file_window
+{
+public:
+  using T_Sandbox = rlbox_sandbox<rlbox_wasm2c_sandbox>;
+
+private:
+  T_Sandbox& sandbox;
+  rlbox_wasm2c_sandbox* plugin;
+  int fd;
+  bool copy_on_write;
+  uint64_t file_size = 0;
+  size_t window_size = 0;
+  size_t page_size = 1;
+
+  // The allocation in the sandbox that holds the window, and the page aligned
+  // start of the window in it
+  tainted<char*, rlbox_wasm2c_sandbox> allocation = nullptr;
+  tainted<char*, rlbox_wasm2c_sandbox> window = nullptr;
+  rlbox_wasm2c_sandbox::T_PointerType window_location = 0;
+  bool mapped = false;
+  // File offset of the start of the window, and of the current position
+  uint64_t window_offset = 0;
+  uint64_t position = 0;
+
+  inline void unmap()
+  {
+    if (mapped) {
+      plugin->impl_unmap_file(window_location);
+      mapped = false;
+    }
+  }
+
+public:
+  /**
+   * @param fd the file to map, which must stay open while the window exists
+   * @param p_window_size the size of the window, rounded up to whole pages
+   * @param p_copy_on_write let the sandbox write to its view of the file, which
+   * does not change the file. By default the view is read only.
+   */
+  rlbox_wasm2c_file_window(T_Sandbox& p_sandbox,
+                           int p_fd,
+                           size_t p_window_size = RLBOX_WASM2C_FILE_WINDOW_SIZE,
+                           bool p_copy_on_write = false)
+    : sandbox(p_sandbox)
+    , plugin(rlbox_wasm2c_sandbox::get_plugin(p_sandbox))
+    , fd(p_fd)
+    , copy_on_write(p_copy_on_write)
+  {
+#if !defined(_WIN32)
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0 || p_window_size == 0) {
+      return;
+    }
+    file_size = static_cast<uint64_t>(file_info.st_size);
+    page_size = wasm2c_snapshot_detail::get_os_page_size();
+    window_size = (p_window_size + page_size - 1) & ~(page_size - 1);
+
+    allocation = sandbox.malloc_in_sandbox<char>(
+      static_cast<uint32_t>(window_size + page_size));
+    if (allocation == nullptr) {
+      return;
+    }
+    // The heap is page aligned, so aligning the host address aligns the
+    // sandboxed one
+    char* allocation_ptr =
+      allocation.unverified_safe_pointer_because(1, "computing alignment");
+    const size_t padding =
+      (page_size - reinterpret_cast<uintptr_t>(allocation_ptr) % page_size) %
+      page_size;
+    window = allocation + padding;
+    window_location =
+      plugin->impl_get_sandboxed_pointer<char*>(allocation_ptr + padding);
+    seek(0);
+#else
+    RLBOX_WASM2C_UNUSED(p_window_size);
+#endif
+  }
+
+  rlbox_wasm2c_file_window(const rlbox_wasm2c_file_window&) = delete;
+  rlbox_wasm2c_file_window& operator=(const rlbox_wasm2c_file_window&) =
+    delete;
+
+  ~rlbox_wasm2c_file_window()
+  {
+    unmap();
+    if (allocation != nullptr) {
+      sandbox.free_in_sandbox(allocation);
+    }
+  }
+
+  /**
+   * @brief moves the window so that it starts at the page containing the given
+   * file offset.
+   *
+   * @return false if the file could not be mapped, in which case size is 0
+   */
+  inline bool seek(uint64_t offset)
+  {
+    unmap();
+    position = offset < file_size ? offset : file_size;
+    window_offset = position & ~static_cast<uint64_t>(page_size - 1);
+    if (window == nullptr || position == file_size) {
+      return window != nullptr;
+    }
+
+    const uint64_t remaining = file_size - window_offset;
+    const size_t length =
+      remaining < window_size ? static_cast<size_t>(remaining) : window_size;
+    // The tail of the last page past the end of the file reads as zeros
+    const size_t mapped_length = (length + page_size - 1) & ~(page_size - 1);
+    mapped = plugin->impl_map_file(
+      window_location, mapped_length, fd, window_offset, copy_on_write);
+    return mapped;
+  }
+
+  /**
+   * @brief moves the current position forward by consumed bytes, sliding the
+   * window forward once the position leaves its first half so that the data
+   * after the position stays mapped.
+   */
+  inline bool advance(size_t consumed)
+  {
+    const uint64_t target = position + consumed;
+    if (mapped && target - window_offset < window_size / 2 &&
+        target < file_size) {
+      position = target;
+      return true;
+    }
+    return seek(target);
+  }
+
+  /**
+   * @brief the current position of the file in the sandbox, or nullptr if the
+   * file is not mapped
+   */
+  inline tainted<char*, rlbox_wasm2c_sandbox> data() const
+  {
+    if (!mapped) {
+      return nullptr;
+    }
+    return window + static_cast<size_t>(position - window_offset);
+  }
+
+  /**
+   * @brief the number of bytes of the file mapped from the current position
+   */
+  inline size_t size() const
+  {
+    if (!mapped) {
+      return 0;
+    }
+    const uint64_t window_end = window_offset + window_size;
+    const uint64_t end = window_end < file_size ? window_end : file_size;
+    return static_cast<size_t>(end - position);
+  }
+
+  inline uint64_t offset() const { return position; }
+  inline uint64_t total_size() const { return file_size; }
+};
+
+} // namespace rlbox
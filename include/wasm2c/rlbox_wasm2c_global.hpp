@@ -0,0 +1,55 @@
+#pragma once
+
+// The global is handed out as a tainted pointer, so this needs the rlbox
+// frontend in addition to the wasm2c plugin
+#include "impl.hpp"
+#include "rlbox.hpp"
+
+namespace rlbox {
+
+/**
+ * @brief A data export of a wasm2c sandbox, such as errno, resolved once when
+ * the handle is created. The module exports the address of the data in
+ * sandbox memory as a global, so the handle reads that global once and then
+ * reaches the data without any lookup.
+ *
+ * Usage:
+ *   rlbox_wasm2c_global<int> sandbox_errno(sandbox, "errno");
+ *   *sandbox_errno.get() = 0;
+ *
+ * The handle must not be used after the sandbox is destroyed.
+ *
+ * @tparam T the type of the data
+ */
+template<typename T>
+class rlbox_wasm2c_global
+{
+private:
+  T* address = nullptr;
+
+public:
+  rlbox_wasm2c_global(rlbox_sandbox<rlbox_wasm2c_sandbox>& sandbox,
+                      const char* name)
+  {
+    auto plugin = rlbox_wasm2c_sandbox::get_plugin(sandbox);
+    address = static_cast<T*>(plugin->impl_lookup_data_export(name));
+    detail::dynamic_check(
+      address == nullptr || sandbox.is_pointer_in_sandbox_memory(address),
+      "Data export is outside the sandbox memory");
+  }
+
+  /**
+   * @brief whether the sandbox exports the data
+   */
+  inline explicit operator bool() const { return address != nullptr; }
+
+  /**
+   * @brief get the data, or nullptr if the sandbox does not export it
+   */
+  inline tainted<T*, rlbox_wasm2c_sandbox> get() const
+  {
+    return tainted<T*, rlbox_wasm2c_sandbox>::internal_factory(address);
+  }
+};
+
+} // namespace rlbox
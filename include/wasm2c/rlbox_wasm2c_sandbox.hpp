@@ -2,10 +2,20 @@
 
 #include "wasm-rt.h"
 // Pull the helper header from the main repo for dynamic_check and scope_exit
+#include "rlbox_batch.hpp"
+#include "rlbox_bulk_copy.hpp"
+#include "rlbox_callback_slots.hpp"
+#include "rlbox_concurrent_map.hpp"
+#include "rlbox_export_cache.hpp"
 #include "rlbox_helpers.hpp"
+#include "rlbox_host_allocator.hpp"
+#include "rlbox_module_registry.hpp"
+#include "rlbox_sandbox_session.hpp"
+#include "rlbox_scratch_arena.hpp"
 #include "rlbox_synchronize.hpp"
 #include "wasm2c_details.hpp"
 
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <limits>
@@ -17,6 +27,7 @@
 #  include <shared_mutex>
 #endif
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -34,6 +45,42 @@
 
 #define RLBOX_WASM2C_UNUSED(...) (void)__VA_ARGS__
 
+#if defined(_MSC_VER)
+#  define RLBOX_WASM2C_NOINLINE __declspec(noinline)
+#else
+#  define RLBOX_WASM2C_NOINLINE __attribute__((noinline))
+#endif
+
+#if !defined(_WIN32) && !defined(RLBOX_WASM2C_DLOPEN_FLAGS)
+#  define RLBOX_WASM2C_DLOPEN_FLAGS RTLD_LAZY
+#elif !defined(RLBOX_WASM2C_DLOPEN_FLAGS)
+#  define RLBOX_WASM2C_DLOPEN_FLAGS 0
+#endif
+
+// The number of destroyed sandbox instances kept per module for reuse, see
+// wasm2c_instance_cache.hpp. Defaults to 0, which always destroys instances.
+// Reuse is not supported for modules built with WASM_CHECK_SHADOW_MEMORY.
+#ifndef RLBOX_WASM2C_MAX_CACHED_INSTANCES
+#  define RLBOX_WASM2C_MAX_CACHED_INSTANCES 0
+#endif
+
+// The mutable wasm globals reset to their initial values when an instance is
+// reused, as a comma separated list of export names. The module must export
+// them, else its instances are not reused. Only 32 bit globals are supported.
+#ifndef RLBOX_WASM2C_RESET_GLOBALS
+#  define RLBOX_WASM2C_RESET_GLOBALS "__stack_pointer"
+#endif
+
+// The number of callbacks that can be registered with a sandbox at once. Each
+// signature used for callbacks instantiates an interceptor per slot.
+#ifndef RLBOX_WASM2C_MAX_CALLBACKS
+#  define RLBOX_WASM2C_MAX_CALLBACKS 128
+#endif
+
+// Define RLBOX_WASM2C_USE_HOST_ALLOCATOR to serve small malloc_in_sandbox
+// allocations from a region of sandbox memory managed on the host, see
+// rlbox_host_allocator, instead of calling the sandbox's malloc and free.
+
 #if defined(_WIN32)
 using path_buf = const LPCWSTR;
 #else
@@ -46,8 +93,90 @@ struct rlbox_wasm2c_sandbox_thread_data
 {
   rlbox_wasm2c_sandbox* sandbox;
   uint32_t last_callback_invoked;
+  // Key of the last invoked callback, read together with the callback
+  void* last_callback_key;
+};
+
+/**
+ * @brief A snapshot of the linear memory of a wasm2c sandbox and of the globals
+ * named in RLBOX_WASM2C_RESET_GLOBALS. Where the platform allows it, the
+ * snapshot is kept in an unlinked file and the sandbox memory is mapped
+ * copy-on-write from it, so that restoring the snapshot only has to discard the
+ * pages written since.
+ */
+class rlbox_wasm2c_snapshot
+{
+private:
+  friend class rlbox_wasm2c_sandbox;
+#if !defined(_WIN32)
+  int backing_fd = -1;
+  // Offset of the memory contents in the backing file
+  uint64_t backing_offset = 0;
+#endif
+  // Used when the snapshot cannot be kept in a file
+  std::vector<uint8_t> image;
+  size_t size = 0;
+  uint32_t pages = 0;
+  // Values of the globals named in RLBOX_WASM2C_RESET_GLOBALS, empty if the
+  // module does not export them
+  std::vector<uint32_t> globals;
+
+public:
+  rlbox_wasm2c_snapshot() = default;
+  rlbox_wasm2c_snapshot(const rlbox_wasm2c_snapshot&) = delete;
+  rlbox_wasm2c_snapshot& operator=(const rlbox_wasm2c_snapshot&) = delete;
+  inline rlbox_wasm2c_snapshot(rlbox_wasm2c_snapshot&& other) noexcept;
+  inline rlbox_wasm2c_snapshot& operator=(
+    rlbox_wasm2c_snapshot&& other) noexcept;
+  inline ~rlbox_wasm2c_snapshot();
+
+  inline void clear();
+  inline bool empty() const { return pages == 0; }
+};
+
+/**
+ * @brief Prepares the function type index of a signature in a sandbox, see
+ * rlbox_wasm2c_sandbox::prepare_signature.
+ */
+using rlbox_wasm2c_signature = void (*)(rlbox_wasm2c_sandbox&);
+
+/**
+ * @brief Options to bind everything the calls into a sandbox need when the
+ * sandbox is created, so that the first calls are as fast as later ones. Pass
+ * a pointer to these as the last argument of create_sandbox.
+ */
+struct rlbox_wasm2c_eager_bind
+{
+  // Exports to resolve at creation, named as for invoke_sandbox_function.
+  // Creation fails if one is missing.
+  const char* const* exports = nullptr;
+  size_t export_count = 0;
+  // Signatures of the callbacks and function pointers that will be passed to
+  // the sandbox, e.g. &rlbox_wasm2c_sandbox::prepare_signature<int(int)>
+  const rlbox_wasm2c_signature* signatures = nullptr;
+  size_t signature_count = 0;
+  // Read every page of the module's code, so the first calls do not fault
+  // them in
+  bool touch_code = true;
+  // Fail creation if the module cannot be loaded with RTLD_NOW because a live
+  // sandbox already loaded it lazily. Otherwise such a sandbox still gets the
+  // rest of the eager binding, see impl_is_bound_eagerly.
+  bool require_eager_binding = false;
 };
 
+namespace wasm2c_grant_detail {
+  // Host memory mapped into a sandbox by impl_grant_access, or a file mapped by
+  // impl_map_file
+  struct grant
+  {
+    // Allocation in the sandbox heap that holds the mapping, 0 for files
+    uint32_t window;
+    size_t length;
+    // The granted host memory, nullptr for files
+    void* host_memory;
+  };
+} // namespace wasm2c_grant_detail
+
 class rlbox_wasm2c_sandbox
 {
 public:
@@ -56,6 +185,9 @@ public:
   using T_IntType = int32_t;
   using T_PointerType = uint32_t;
   using T_ShortType = int16_t;
+  // Host buffers backed by a memfd are mapped into the sandbox, see
+  // wasm2c_grant_access.hpp
+  using can_grant_deny_access = void;
 
 private:
   void* sandbox = nullptr;
@@ -66,31 +198,80 @@ private:
   static std::once_flag wasm2c_runtime_initialized;
   wasm_rt_memory_t* sandbox_memory_info = nullptr;
 #ifndef RLBOX_USE_STATIC_CALLS
+  rlbox_loaded_module<wasm2c_sandbox_funcs_t>* loaded_module = nullptr;
   void* library = nullptr;
+  // Addresses of the global exports looked up in this sandbox. Function
+  // exports are cached in loaded_module.
+  rlbox_export_cache global_exports;
 #endif
   uintptr_t heap_base;
   void* exec_env = 0;
   void* malloc_index = 0;
   void* free_index = 0;
-  size_t return_slot_size = 0;
-  T_PointerType return_slot = 0;
+  void* batch_dispatch_index = 0;
+  void* malloc_bulk_index = 0;
+  void* free_bulk_index = 0;
+  // Per invocation storage for class arguments and return values
+  rlbox_scratch_arena<T_PointerType> scratch_arena;
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+  rlbox_host_allocator<T_PointerType> host_allocator;
+#endif
+  // Granted host memory, by its location in the sandbox
+  std::mutex grant_mutex;
+  std::map<T_PointerType, wasm2c_grant_detail::grant> grants;
+  // Snapshot of the linear memory after initialization, used to reset
+  // sandboxes
+  rlbox_wasm2c_snapshot reset_snapshot;
+  // Identifies the build of the module, see record_module_identity
+  uint64_t module_identity = 0;
 
-  static const size_t MAX_CALLBACKS = 128;
+  static const size_t MAX_CALLBACKS = RLBOX_WASM2C_MAX_CALLBACKS;
   mutable RLBOX_SHARED_LOCK(callback_mutex);
-  void* callback_unique_keys[MAX_CALLBACKS]{ 0 };
-  void* callbacks[MAX_CALLBACKS]{ 0 };
+  // Which slots are free, and the slot of each key
+  rlbox_callback_slots<MAX_CALLBACKS> callback_slots;
+  // Callback and key of each slot, read by the callback interceptors without
+  // locking. Writes hold callback_mutex.
+  rlbox_callback_registrations<MAX_CALLBACKS> callbacks;
   uint32_t callback_slot_assignment[MAX_CALLBACKS]{ 0 };
-  mutable std::map<const void*, uint32_t> internal_callbacks;
-  mutable std::map<uint32_t, const void*> slot_assignments;
+  // Function pointer swizzling tables, read without locking. Writes hold
+  // callback_mutex.
+  mutable rlbox_concurrent_map<const void*, uint32_t> internal_callbacks;
+  mutable rlbox_concurrent_map<uint32_t, const void*> slot_assignments;
+  // Function type index of each signature, by its wasm2c_detail::signature_tag.
+  // Writes hold callback_mutex.
+  mutable rlbox_concurrent_map<const void*, uint32_t> func_type_indices;
 
 #ifndef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
-  thread_local static inline rlbox_wasm2c_sandbox_thread_data thread_data{ 0,
-                                                                           0 };
+  thread_local static inline rlbox_wasm2c_sandbox_thread_data thread_data{
+    0, 0, 0
+  };
 #endif
 
+  // Thread that has bound this sandbox with an rlbox_sandbox_session
+  std::atomic<std::thread::id> session_thread{};
+  friend class rlbox_sandbox_session<rlbox_wasm2c_sandbox>;
+  static inline rlbox_wasm2c_sandbox_thread_data* get_session_thread_data();
+
   template<typename T_FormalRet, typename T_ActualRet>
   inline auto serialize_to_sandbox(T_ActualRet arg);
 
+  // Callbacks are dispatched by one function per signature. The interceptor
+  // of each slot only passes its slot number on, so the slots of a signature
+  // add little code.
+  template<typename T_Ret, typename... T_Args>
+  RLBOX_WASM2C_NOINLINE static
+    typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type
+    callback_dispatch(
+      uint32_t callback_num,
+      typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type...
+        params);
+
+  template<typename T_Ret, typename... T_Args>
+  RLBOX_WASM2C_NOINLINE static void callback_dispatch_promoted(
+    uint32_t callback_num,
+    typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type ret,
+    typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params);
+
   template<uint32_t N, typename T_Ret, typename... T_Args>
   static typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type
   callback_interceptor(
@@ -103,17 +284,40 @@ private:
     typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type ret,
     typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params);
 
-  void ensure_return_slot_size(size_t size);
-
   template<typename T_Ret, typename... T_Args>
   inline uint32_t get_wasm2c_func_index(
     // dummy for template inference
     T_Ret (*)(T_Args...) = nullptr) const;
 
+  inline bool apply_eager_bind(const rlbox_wasm2c_eager_bind& options,
+                               std::string& error_msg);
+
+  inline void set_memory_accessible_size(size_t old_size, size_t new_size);
+  inline void record_module_identity();
+
+  inline void revoke_grant(T_PointerType location,
+                           const wasm2c_grant_detail::grant& granted);
+  inline void revoke_all_grants();
+
+  inline T_PointerType malloc_in_guest(size_t size);
+  inline void free_in_guest(T_PointerType p);
+
+  inline const void* get_instance_cache_key() const;
+  inline bool take_cached_instance(uint32_t max_wasm_pages);
+  inline void save_initial_state();
+  inline bool retire_instance();
+  static inline void drain_instance_cache(const void* cache_key,
+                                          const wasm2c_sandbox_funcs_t& info);
+
   static inline uint64_t next_power_of_two(uint32_t value);
   static uint64_t rlbox_wasm2c_get_adjusted_heap_size(uint64_t heap_size);
   static uint64_t rlbox_wasm2c_get_heap_page_count(uint64_t heap_size);
 
+#ifndef RLBOX_USE_STATIC_CALLS
+  inline void* function_export_lookup(const char* prefixed_name);
+  inline void* global_export_lookup(const char* prefixed_name);
+#endif
+
 protected:
 #ifndef RLBOX_USE_STATIC_CALLS
   inline void* symbol_lookup(std::string prefixed_name);
@@ -121,10 +325,25 @@ protected:
 public:
 #ifndef RLBOX_USE_STATIC_CALLS
   void* impl_lookup_symbol(const char* func_name);
+  /**
+   * @brief look up an export whose name hash is already known, e.g. computed
+   * at compile time with rlbox_export_name_hash
+   *
+   * @param hash rlbox_export_name_hash(func_name)
+   */
+  void* impl_lookup_symbol(uint64_t hash, const char* func_name);
 #else
   template<typename T = void>
   void* impl_lookup_symbol(const char* func_name);
 #endif
+  /**
+   * @brief get the address in sandbox memory of a data export, such as errno.
+   * The module exports the address as a global of the instance, which is read
+   * once here.
+   *
+   * @return the address, or nullptr if the module has no such export
+   */
+  inline void* impl_lookup_data_export(const char* name);
 
   inline bool impl_create_sandbox(
 #ifndef RLBOX_USE_STATIC_CALLS
@@ -132,9 +351,29 @@ public:
 #endif
     bool infallible,
     uint64_t override_max_heap_size,
-    const char* wasm_module_name);
+    const char* wasm_module_name,
+    const char* preinit_image_path,
+    const rlbox_wasm2c_eager_bind* eager_bind);
   inline void impl_destroy_sandbox();
 
+  inline void impl_take_snapshot(rlbox_wasm2c_snapshot& snapshot);
+  inline void impl_restore_snapshot(const rlbox_wasm2c_snapshot& snapshot);
+
+  inline bool impl_is_bound_eagerly() const;
+
+  inline bool impl_write_preinit_image(const char* image_path);
+  inline bool impl_load_preinit_image(const char* image_path,
+                                      std::string& error_msg);
+
+  inline void impl_save_reset_state();
+  inline void impl_reset_sandbox();
+
+  template<typename T_Frontend>
+  static inline rlbox_wasm2c_sandbox* get_plugin(T_Frontend& sandbox);
+
+  template<typename T>
+  static inline void prepare_signature(rlbox_wasm2c_sandbox& sandbox);
+
   template<typename T>
   inline void* impl_get_unsandboxed_pointer(T_PointerType p) const;
 
@@ -162,11 +401,38 @@ public:
   inline size_t impl_get_total_memory();
   inline void* impl_get_memory_location() const;
 
+  inline void impl_copy_to_sandbox(T_PointerType dst,
+                                   const void* src,
+                                   size_t len);
+  inline void impl_copy_from_sandbox(void* dst, T_PointerType src, size_t len);
+
   template<typename T, typename T_Converted, typename... T_Args>
   auto impl_invoke_with_func_ptr(T_Converted* func_ptr, T_Args&&... params);
 
+  template<typename T_Ret, typename... T_Args>
+  inline uintptr_t impl_prepare_batch_call(void* func);
+  inline void impl_invoke_batch(const rlbox_batch_call* calls,
+                                size_t count,
+                                int32_t* results);
+
+  template<typename T>
+  inline T* impl_grant_access(T* src, size_t num, bool& success);
+  template<typename T>
+  inline T* impl_deny_access(T* src, size_t num, bool& success);
+  inline bool impl_map_file(T_PointerType location,
+                            size_t length,
+                            int fd,
+                            uint64_t offset,
+                            bool copy_on_write);
+  inline void impl_unmap_file(T_PointerType location);
+
   inline T_PointerType impl_malloc_in_sandbox(size_t size);
   inline void impl_free_in_sandbox(T_PointerType p);
+  inline void impl_malloc_in_sandbox_bulk(const size_t* sizes,
+                                          size_t count,
+                                          T_PointerType* ptrs);
+  inline void impl_free_in_sandbox_bulk(const T_PointerType* ptrs,
+                                        size_t count);
 
   template<typename T_Ret, typename... T_Args>
   inline T_PointerType impl_register_callback(void* key, void* callback);
@@ -0,0 +1,270 @@
+#pragma once
+
+// Sandboxes are created through the rlbox frontend, so this needs the rlbox
+// frontend in addition to the wasm2c plugin
+#include "impl.hpp"
+#include "rlbox.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rlbox {
+
+using rlbox_wasm2c_sandbox_ptr =
+  std::unique_ptr<rlbox_sandbox<rlbox_wasm2c_sandbox>>;
+
+namespace wasm2c_async_detail {
+  using path_char_t = std::remove_const_t<
+    std::remove_pointer_t<std::remove_const_t<path_buf>>>;
+
+  // Parameters shared by the sandboxes of one bulk creation
+  struct create_request
+  {
+#ifndef RLBOX_USE_STATIC_CALLS
+    std::basic_string<path_char_t> wasm2c_module_path;
+#endif
+    uint64_t override_max_heap_size = 0;
+    std::string wasm_module_name;
+    std::optional<std::string> preinit_image_path;
+    // The caller's eager binding options point to arrays that need not outlive
+    // the call queuing the request, so the request holds copies of them
+    std::optional<rlbox_wasm2c_eager_bind> eager_bind;
+    std::vector<std::string> export_names;
+    std::vector<const char*> exports;
+    std::vector<rlbox_wasm2c_signature> signatures;
+
+    inline void set_eager_bind(const rlbox_wasm2c_eager_bind& options)
+    {
+      export_names.assign(options.exports,
+                          options.exports + options.export_count);
+      for (auto& name : export_names) {
+        exports.push_back(name.c_str());
+      }
+      signatures.assign(options.signatures,
+                        options.signatures + options.signature_count);
+
+      eager_bind = options;
+      eager_bind->exports = exports.data();
+      eager_bind->signatures = signatures.data();
+    }
+  };
+
+  struct create_job
+  {
+    std::shared_ptr<create_request> request;
+    std::promise<rlbox_wasm2c_sandbox_ptr> result;
+  };
+
+  inline void create_sandbox(create_job& job)
+  {
+    // Anything thrown while creating the sandbox, e.g. std::bad_alloc or a
+    // failed check with RLBOX_USE_EXCEPTIONS, is handed to the future instead
+    // of terminating the worker thread
+    try {
+      const create_request& request = *job.request;
+      auto sandbox = std::make_unique<rlbox_sandbox<rlbox_wasm2c_sandbox>>();
+      // Always use the fallible path, a failure is reported as a nullptr
+      // result rather than aborting the process from a worker thread
+      bool created = sandbox->create_sandbox(
+#ifndef RLBOX_USE_STATIC_CALLS
+        request.wasm2c_module_path.c_str(),
+#endif
+        false /* infallible */,
+        request.override_max_heap_size,
+        request.wasm_module_name.c_str(),
+        request.preinit_image_path ? request.preinit_image_path->c_str()
+                                   : nullptr,
+        request.eager_bind ? &*request.eager_bind : nullptr);
+      if (!created) {
+        sandbox = nullptr;
+      }
+      job.result.set_value(std::move(sandbox));
+    } catch (...) {
+      job.result.set_exception(std::current_exception());
+    }
+  }
+
+  /**
+   * @brief Process wide pool of threads that create sandboxes, at most one per
+   * core. Threads are started as jobs are queued and are joined when the pool
+   * is destroyed at exit. Jobs still queued then are dropped, so their futures
+   * report a broken promise.
+   */
+  class create_pool
+  {
+  private:
+    std::mutex lock;
+    std::condition_variable jobs_available;
+    std::deque<create_job> jobs;
+    std::vector<std::thread> workers;
+    size_t max_workers;
+    bool stopping = false;
+
+    void run()
+    {
+      while (true) {
+        create_job job;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          jobs_available.wait(guard,
+                              [&] { return stopping || !jobs.empty(); });
+          if (stopping) {
+            return;
+          }
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        create_sandbox(job);
+      }
+    }
+
+  public:
+    create_pool()
+    {
+      // Statics are destroyed in the reverse order of their construction.
+      // Constructing the module registry first means the workers are joined
+      // before the registry they load modules through is destroyed.
+      const path_char_t no_path[] = { 0 };
+      rlbox_module_registry<wasm2c_sandbox_funcs_t>::find(no_path, "");
+
+      // hardware_concurrency may return 0 if it is not known
+      max_workers =
+        std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+    create_pool(const create_pool&) = delete;
+    create_pool& operator=(const create_pool&) = delete;
+
+    ~create_pool()
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      jobs_available.notify_all();
+      for (auto& worker : workers) {
+        worker.join();
+      }
+    }
+
+    inline void submit(std::vector<create_job> new_jobs)
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& job : new_jobs) {
+          jobs.push_back(std::move(job));
+        }
+        // Only start as many threads as there is work for
+        while (workers.size() < std::min(max_workers, jobs.size())) {
+          workers.emplace_back([this] { run(); });
+        }
+      }
+      jobs_available.notify_all();
+    }
+  };
+
+  // Function local static to keep this header only
+  inline create_pool& get_create_pool()
+  {
+    static create_pool pool;
+    return pool;
+  }
+} // namespace wasm2c_async_detail
+
+/**
+ * @brief creates a number of wasm2c sandboxes in parallel on a process wide
+ * pool of worker threads, one per core at most. Loading the library and
+ * initializing the wasm2c runtime happens once, reserving the heaps and
+ * instantiating the sandboxes happens concurrently.
+ *
+ * @param count the number of sandboxes to create
+ * @param wasm2c_module_path path to shared library compiled with wasm2c. This
+ * param is not specified if you are creating a statically linked sandbox.
+ * @param override_max_heap_size optional override of the maximum size of the
+ * wasm heap, see impl_create_sandbox
+ * @param wasm_module_name optional module name used when compiling with wasm2c
+ * @param preinit_image_path optional pre-initialized image to start the
+ * sandboxes from, see impl_create_sandbox
+ * @param eager_bind optional eager binding options, see
+ * rlbox_wasm2c_eager_bind. They are copied, so they need not outlive this call.
+ * @return one future per sandbox. Sandboxes are created with infallible set to
+ * false, so the future holds a nullptr if its sandbox could not be created, or
+ * the exception thrown while creating it.
+ */
+inline std::vector<std::future<rlbox_wasm2c_sandbox_ptr>>
+rlbox_wasm2c_create_sandboxes_async(size_t count,
+#ifndef RLBOX_USE_STATIC_CALLS
+                                    path_buf wasm2c_module_path,
+#endif
+                                    uint64_t override_max_heap_size = 0,
+                                    const char* wasm_module_name = "",
+                                    const char* preinit_image_path = nullptr,
+                                    const rlbox_wasm2c_eager_bind* eager_bind =
+                                      nullptr)
+{
+  auto request = std::make_shared<wasm2c_async_detail::create_request>();
+#ifndef RLBOX_USE_STATIC_CALLS
+  request->wasm2c_module_path = wasm2c_module_path;
+#endif
+  request->override_max_heap_size = override_max_heap_size;
+  request->wasm_module_name = wasm_module_name;
+  if (preinit_image_path != nullptr) {
+    request->preinit_image_path = preinit_image_path;
+  }
+  if (eager_bind != nullptr) {
+    request->set_eager_bind(*eager_bind);
+  }
+
+  std::vector<wasm2c_async_detail::create_job> jobs(count);
+  std::vector<std::future<rlbox_wasm2c_sandbox_ptr>> futures;
+  futures.reserve(count);
+  for (auto& job : jobs) {
+    job.request = request;
+    futures.emplace_back(job.result.get_future());
+  }
+
+  // The jobs own the request, so the caller may drop any of the futures
+  wasm2c_async_detail::get_create_pool().submit(std::move(jobs));
+  return futures;
+}
+
+/**
+ * @brief creates a wasm2c sandbox on a worker thread. See
+ * rlbox_wasm2c_create_sandboxes_async for the parameters.
+ *
+ * @return a future that holds the sandbox, or a nullptr or exception if the
+ * sandbox could not be created.
+ */
+inline std::future<rlbox_wasm2c_sandbox_ptr> rlbox_wasm2c_create_sandbox_async(
+#ifndef RLBOX_USE_STATIC_CALLS
+  path_buf wasm2c_module_path,
+#endif
+  uint64_t override_max_heap_size = 0,
+  const char* wasm_module_name = "",
+  const char* preinit_image_path = nullptr,
+  const rlbox_wasm2c_eager_bind* eager_bind = nullptr)
+{
+  auto futures = rlbox_wasm2c_create_sandboxes_async(1,
+#ifndef RLBOX_USE_STATIC_CALLS
+                                                     wasm2c_module_path,
+#endif
+                                                     override_max_heap_size,
+                                                     wasm_module_name,
+                                                     preinit_image_path,
+                                                     eager_bind);
+  return std::move(futures[0]);
+}
+
+} // namespace rlbox
@@ -0,0 +1,192 @@
+#pragma once
+
+// The pool hands out rlbox_sandbox objects, so it needs the rlbox frontend in
+// addition to the wasm2c plugin
+#include "impl.hpp"
+#include "rlbox.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace rlbox {
+
+/**
+ * @brief A fixed size pool of wasm2c sandboxes. All sandboxes are created up
+ * front and handed out as leases. When a lease is released, the linear memory
+ * of its sandbox and the globals named in RLBOX_WASM2C_RESET_GLOBALS are reset
+ * to the state they had right after creation, so that the sandbox can be handed
+ * out again without loading the module or reserving a new heap. This includes
+ * the stack pointer an invocation aborted during the lease may have left
+ * behind.
+ *
+ * Users of a lease must unregister any callbacks they registered and must not
+ * keep tainted pointers into the sandbox once the lease is released.
+ */
+class rlbox_wasm2c_sandbox_pool
+{
+public:
+  using T_Sandbox = rlbox_sandbox<rlbox_wasm2c_sandbox>;
+
+  class lease
+  {
+  private:
+    rlbox_wasm2c_sandbox_pool* pool = nullptr;
+    T_Sandbox* sandbox = nullptr;
+
+    friend class rlbox_wasm2c_sandbox_pool;
+
+    lease(rlbox_wasm2c_sandbox_pool* p_pool, T_Sandbox* p_sandbox)
+      : pool(p_pool)
+      , sandbox(p_sandbox)
+    {}
+
+  public:
+    lease() = default;
+    lease(const lease&) = delete;
+    lease& operator=(const lease&) = delete;
+
+    lease(lease&& other) noexcept
+      : pool(std::exchange(other.pool, nullptr))
+      , sandbox(std::exchange(other.sandbox, nullptr))
+    {}
+
+    lease& operator=(lease&& other) noexcept
+    {
+      if (this != &other) {
+        release();
+        pool = std::exchange(other.pool, nullptr);
+        sandbox = std::exchange(other.sandbox, nullptr);
+      }
+      return *this;
+    }
+
+    ~lease() { release(); }
+
+    /**
+     * @brief return the sandbox to the pool. The lease is empty afterwards.
+     */
+    inline void release()
+    {
+      if (sandbox != nullptr) {
+        pool->release(sandbox);
+        sandbox = nullptr;
+        pool = nullptr;
+      }
+    }
+
+    inline explicit operator bool() const { return sandbox != nullptr; }
+    inline T_Sandbox* operator->() const { return sandbox; }
+    inline T_Sandbox& operator*() const { return *sandbox; }
+  };
+
+private:
+  std::vector<std::unique_ptr<T_Sandbox>> sandboxes;
+  std::vector<T_Sandbox*> free_sandboxes;
+  std::mutex pool_mutex;
+  std::condition_variable pool_cv;
+
+  inline void release(T_Sandbox* sandbox)
+  {
+    rlbox_wasm2c_sandbox::get_plugin(*sandbox)->impl_reset_sandbox();
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      free_sandboxes.push_back(sandbox);
+    }
+    pool_cv.notify_one();
+  }
+
+public:
+  rlbox_wasm2c_sandbox_pool() = default;
+  rlbox_wasm2c_sandbox_pool(const rlbox_wasm2c_sandbox_pool&) = delete;
+  rlbox_wasm2c_sandbox_pool& operator=(const rlbox_wasm2c_sandbox_pool&) =
+    delete;
+
+  /**
+   * @brief creates the sandboxes of the pool
+   *
+   * @param count the number of sandboxes in the pool
+   * @param create_args the arguments passed to create_sandbox for each sandbox
+   * in the pool. If these make creation fallible, a failure to create any of
+   * the sandboxes destroys the ones already created.
+   * @return true when all sandboxes were created
+   */
+  template<typename... T_Args>
+  inline bool create_pool(size_t count, T_Args... create_args)
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    detail::dynamic_check(sandboxes.empty(), "Sandbox pool already created");
+
+    for (size_t i = 0; i < count; i++) {
+      auto sandbox = std::make_unique<T_Sandbox>();
+      if (!sandbox->create_sandbox(create_args...)) {
+        for (auto& created : sandboxes) {
+          created->destroy_sandbox();
+        }
+        sandboxes.clear();
+        free_sandboxes.clear();
+        return false;
+      }
+      rlbox_wasm2c_sandbox::get_plugin(*sandbox)->impl_save_reset_state();
+      free_sandboxes.push_back(sandbox.get());
+      sandboxes.emplace_back(std::move(sandbox));
+    }
+    return true;
+  }
+
+  /**
+   * @brief destroys all sandboxes of the pool. All leases must have been
+   * released.
+   */
+  inline void destroy_pool()
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    detail::dynamic_check(free_sandboxes.size() == sandboxes.size(),
+                          "Destroying sandbox pool with outstanding leases");
+    for (auto& sandbox : sandboxes) {
+      sandbox->destroy_sandbox();
+    }
+    sandboxes.clear();
+    free_sandboxes.clear();
+  }
+
+  /**
+   * @brief get a sandbox from the pool, waiting for one to be released if all
+   * sandboxes are currently leased.
+   */
+  inline lease acquire()
+  {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    detail::dynamic_check(!sandboxes.empty(), "Sandbox pool not created");
+    pool_cv.wait(lock, [&] { return !free_sandboxes.empty(); });
+    T_Sandbox* sandbox = free_sandboxes.back();
+    free_sandboxes.pop_back();
+    return lease(this, sandbox);
+  }
+
+  /**
+   * @brief get a sandbox from the pool if one is available. Returns an empty
+   * lease otherwise.
+   */
+  inline lease try_acquire()
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (free_sandboxes.empty()) {
+      return lease();
+    }
+    T_Sandbox* sandbox = free_sandboxes.back();
+    free_sandboxes.pop_back();
+    return lease(this, sandbox);
+  }
+
+  inline size_t size()
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return sandboxes.size();
+  }
+};
+
+} // namespace rlbox
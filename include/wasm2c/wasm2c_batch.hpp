@@ -0,0 +1,114 @@
+#pragma once
+
+#include "wasm-rt.h"
+
+// Pull the helper header from the main repo for dynamic_check and scope_exit
+#include "rlbox_batch.hpp"
+#include "rlbox_helpers.hpp"
+#include "rlbox_wasm2c_sandbox.hpp"
+#include "wasm2c_details.hpp"
+
+#include <cstring>
+#include <limits>
+
+namespace rlbox {
+
+namespace wasm2c_batch_detail {
+  // Layout of a command read by rlbox_batch_dispatch in
+  // c_src/wasm2c_sandbox_wrapper.c
+  struct batch_command
+  {
+    uint32_t func;
+    uint32_t arg_count;
+    uint32_t has_return;
+    int32_t args[RLBOX_BATCH_MAX_ARGS];
+  };
+  static_assert(sizeof(batch_command) == 28,
+                "batch_command must match the layout in the sandbox");
+} // namespace wasm2c_batch_detail
+
+/**
+ * @brief get the handle of a function called in a batch, which is its index in
+ * the sandbox's function table.
+ */
+template<typename T_Ret, typename... T_Args>
+inline uintptr_t rlbox_wasm2c_sandbox::impl_prepare_batch_call(void* func)
+{
+  return impl_get_sandboxed_pointer<T_Ret (*)(T_Args...)>(func);
+}
+
+/**
+ * @brief runs a batch of calls with a single invocation of the
+ * rlbox_batch_dispatch export of the module. Modules without the export, and
+ * statically linked modules, run the calls one after the other instead.
+ */
+inline void rlbox_wasm2c_sandbox::impl_invoke_batch(
+  const rlbox_batch_call* calls,
+  size_t count,
+  int32_t* results)
+{
+  if (count == 0) {
+    return;
+  }
+
+  if (batch_dispatch_index == nullptr) {
+    // Bind the sandbox once for all the calls
+    rlbox_sandbox_session<rlbox_wasm2c_sandbox> session(*this);
+    for (size_t i = 0; i < count; i++) {
+      results[i] = batch_detail::call_i32(calls[i], exec_env);
+    }
+    return;
+  }
+
+  using wasm2c_batch_detail::batch_command;
+  const size_t commands_size = count * sizeof(batch_command);
+  const size_t buffer_size = commands_size + count * sizeof(int32_t);
+  detail::dynamic_check(count <= std::numeric_limits<uint32_t>::max() /
+                                   (sizeof(batch_command) + sizeof(int32_t)),
+                        "Batch too large for the sandbox");
+
+  // The command buffer is taken from the scratch arena, so small batches need
+  // no calls to the sandbox's malloc and free
+  typename rlbox_scratch_arena<T_PointerType>::scope scratch(
+    scratch_arena, true, [&](size_t size) {
+      return impl_malloc_in_sandbox(size);
+    });
+  T_PointerType buffer = scratch.allocate(buffer_size);
+  const bool buffer_malloced = !buffer;
+  if (buffer_malloced) {
+    buffer = impl_malloc_in_sandbox(buffer_size);
+    detail::dynamic_check(
+      buffer != 0,
+      "Could not allocate batch buffer. Sandbox may be out of memory!");
+  }
+  auto on_exit = detail::make_scope_exit([&] {
+    if (buffer_malloced) {
+      impl_free_in_sandbox(buffer);
+    }
+  });
+
+  auto commands = reinterpret_cast<batch_command*>(
+    impl_get_unsandboxed_pointer<char*>(buffer));
+  for (size_t i = 0; i < count; i++) {
+    commands[i].func = static_cast<uint32_t>(calls[i].handle);
+    commands[i].arg_count = calls[i].arg_count;
+    commands[i].has_return = calls[i].has_return;
+    std::memcpy(commands[i].args, calls[i].args, sizeof(commands[i].args));
+  }
+
+  const T_PointerType results_buffer =
+    buffer + static_cast<T_PointerType>(commands_size);
+  using T_Dispatch = void(T_PointerType, uint32_t, T_PointerType);
+  impl_invoke_with_func_ptr<T_Dispatch, T_Dispatch>(
+    reinterpret_cast<T_Dispatch*>(batch_dispatch_index),
+    buffer,
+    static_cast<uint32_t>(count),
+    results_buffer);
+
+  // The heap may have moved if the calls grew it, so get the pointer again
+  std::memcpy(results,
+              impl_get_unsandboxed_pointer<char*>(results_buffer),
+              count * sizeof(int32_t));
+}
+
+} // namespace rlbox
@@ -11,48 +11,40 @@ using rlbox::rlbox_wasm2c_sandbox;
 
 namespace rlbox {
 
-template<uint32_t N, typename T_Ret, typename... T_Args>
+template<typename T_Ret, typename... T_Args>
 typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type
-rlbox_wasm2c_sandbox::callback_interceptor(
-  void* /* vmContext */,
+rlbox_wasm2c_sandbox::callback_dispatch(
+  uint32_t callback_num,
   typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params)
 {
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   auto& thread_data = *get_rlbox_wasm2c_sandbox_thread_data();
 #endif
-  thread_data.last_callback_invoked = N;
+  auto registration = thread_data.sandbox->callbacks.read(callback_num);
+  thread_data.last_callback_invoked = callback_num;
+  thread_data.last_callback_key = registration.second;
   using T_Func = T_Ret (*)(T_Args...);
-  T_Func func;
-  {
-#ifndef RLBOX_SINGLE_THREADED_INVOCATIONS
-    RLBOX_ACQUIRE_SHARED_GUARD(lock, thread_data.sandbox->callback_mutex);
-#endif
-    func = reinterpret_cast<T_Func>(thread_data.sandbox->callbacks[N]);
-  }
+  auto func = reinterpret_cast<T_Func>(registration.first);
   // Callbacks are invoked through function pointers, cannot use std::forward
   // as we don't have caller context for T_Args, which means they are all
   // effectively passed by value
   return func(thread_data.sandbox->serialize_to_sandbox<T_Args>(params)...);
 }
 
-template<uint32_t N, typename T_Ret, typename... T_Args>
-void rlbox_wasm2c_sandbox::callback_interceptor_promoted(
-  void* /* vmContext */,
+template<typename T_Ret, typename... T_Args>
+void rlbox_wasm2c_sandbox::callback_dispatch_promoted(
+  uint32_t callback_num,
   typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type ret,
   typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params)
 {
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   auto& thread_data = *get_rlbox_wasm2c_sandbox_thread_data();
 #endif
-  thread_data.last_callback_invoked = N;
+  auto registration = thread_data.sandbox->callbacks.read(callback_num);
+  thread_data.last_callback_invoked = callback_num;
+  thread_data.last_callback_key = registration.second;
   using T_Func = T_Ret (*)(T_Args...);
-  T_Func func;
-  {
-#ifndef RLBOX_SINGLE_THREADED_INVOCATIONS
-    RLBOX_ACQUIRE_SHARED_GUARD(lock, thread_data.sandbox->callback_mutex);
-#endif
-    func = reinterpret_cast<T_Func>(thread_data.sandbox->callbacks[N]);
-  }
+  auto func = reinterpret_cast<T_Func>(registration.first);
   // Callbacks are invoked through function pointers, cannot use std::forward
   // as we don't have caller context for T_Args, which means they are all
   // effectively passed by value
@@ -64,50 +56,56 @@ void rlbox_wasm2c_sandbox::callback_interceptor_promoted(
   *ret_ptr = ret_val;
 }
 
+template<uint32_t N, typename T_Ret, typename... T_Args>
+typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type
+rlbox_wasm2c_sandbox::callback_interceptor(
+  void* /* vmContext */,
+  typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params)
+{
+  return callback_dispatch<T_Ret, T_Args...>(N, params...);
+}
+
+template<uint32_t N, typename T_Ret, typename... T_Args>
+void rlbox_wasm2c_sandbox::callback_interceptor_promoted(
+  void* /* vmContext */,
+  typename wasm2c_detail::convert_type_to_wasm_type<T_Ret>::type ret,
+  typename wasm2c_detail::convert_type_to_wasm_type<T_Args>::type... params)
+{
+  callback_dispatch_promoted<T_Ret, T_Args...>(N, ret, params...);
+}
+
 template<typename T_Ret, typename... T_Args>
 inline rlbox_wasm2c_sandbox::T_PointerType
 rlbox_wasm2c_sandbox::impl_register_callback(void* key, void* callback)
 {
-  bool found = false;
-  uint32_t found_loc = 0;
-  void* chosen_interceptor = nullptr;
-
-  RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-
-  // need a compile time for loop as we we need I to be a compile time value
-  // this is because we are setting the I'th callback ineterceptor
-  wasm2c_detail::compile_time_for<MAX_CALLBACKS>([&](auto I) {
-    constexpr auto i = I.value;
-    if (!found && callbacks[i] == nullptr) {
-      found = true;
-      found_loc = i;
-
+  // The interceptor of each slot, as the slot number must be a compile time
+  // value
+  static constexpr auto interceptors =
+    make_callback_table<MAX_CALLBACKS>([](auto I) {
       if constexpr (std::is_class_v<T_Ret>) {
-        chosen_interceptor = reinterpret_cast<void*>(
-          callback_interceptor_promoted<i, T_Ret, T_Args...>);
+        return &callback_interceptor_promoted<I.value, T_Ret, T_Args...>;
       } else {
-        chosen_interceptor =
-          reinterpret_cast<void*>(callback_interceptor<i, T_Ret, T_Args...>);
+        return &callback_interceptor<I.value, T_Ret, T_Args...>;
       }
-    }
-  });
+    });
+
+  RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
 
+  uint32_t found_loc = 0;
   detail::dynamic_check(
-    found,
+    callback_slots.allocate(key, found_loc),
     "Could not find an empty slot in sandbox function table. This would "
-    "happen if you have registered too many callbacks, or unsandboxed "
-    "too many function pointers. You can file a bug if you want to "
-    "increase the maximum allowed callbacks or unsadnboxed functions "
-    "pointers");
+    "happen if you have registered too many callbacks. Define "
+    "RLBOX_WASM2C_MAX_CALLBACKS to increase the maximum allowed callbacks");
+  void* chosen_interceptor = reinterpret_cast<void*>(interceptors[found_loc]);
 
   auto func_type_idx = get_wasm2c_func_index<T_Ret, T_Args...>();
   uint32_t slot_number = sandbox_info.add_wasm2c_callback(
     sandbox, func_type_idx, chosen_interceptor, WASM_RT_EXTERNAL_FUNCTION);
 
-  callback_unique_keys[found_loc] = key;
-  callbacks[found_loc] = callback;
   callback_slot_assignment[found_loc] = slot_number;
-  slot_assignments[slot_number] = callback;
+  callbacks.publish(found_loc, key, callback);
+  slot_assignments.insert(slot_number, callback);
 
   return static_cast<T_PointerType>(slot_number);
 }
@@ -118,29 +116,23 @@ rlbox_wasm2c_sandbox::impl_get_executed_callback_sandbox_and_key()
 #ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
   auto& thread_data = *get_rlbox_wasm2c_sandbox_thread_data();
 #endif
-  auto sandbox = thread_data.sandbox;
-  auto callback_num = thread_data.last_callback_invoked;
-  void* key = sandbox->callback_unique_keys[callback_num];
-  return std::make_pair(sandbox, key);
+  return std::make_pair(thread_data.sandbox, thread_data.last_callback_key);
 }
 
 template<typename T_Ret, typename... T_Args>
 inline void rlbox_wasm2c_sandbox::impl_unregister_callback(void* key)
 {
   bool found = false;
-  uint32_t i = 0;
   {
     RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-    for (; i < MAX_CALLBACKS; i++) {
-      if (callback_unique_keys[i] == key) {
-        sandbox_info.remove_wasm2c_callback(sandbox,
-                                            callback_slot_assignment[i]);
-        callback_unique_keys[i] = nullptr;
-        callbacks[i] = nullptr;
-        callback_slot_assignment[i] = 0;
-        found = true;
-        break;
-      }
+    uint32_t i = 0;
+    found = callback_slots.release(key, i);
+    if (found) {
+      sandbox_info.remove_wasm2c_callback(sandbox,
+                                          callback_slot_assignment[i]);
+      slot_assignments.erase(callback_slot_assignment[i]);
+      callbacks.clear(i);
+      callback_slot_assignment[i] = 0;
     }
   }
 
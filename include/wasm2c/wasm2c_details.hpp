@@ -165,6 +165,13 @@ namespace wasm2c_detail {
   using change_class_arg_types =
     typename change_class_arg_types_detail::helper<T_Func, T_ArgNew>::type;
 
+  // The address of value identifies a function signature at runtime
+  template<typename T_Ret, typename... T_Args>
+  struct signature_tag
+  {
+    static inline const char value = 0;
+  };
+
 } // namespace wasm2c_detail
 
 } // namespace rlbox
\ No newline at end of file
@@ -0,0 +1,405 @@
+#pragma once
+
+#include "wasm-rt.h"
+
+// Pull the helper header from the main repo for dynamic_check and scope_exit
+#include "rlbox_helpers.hpp"
+#include "rlbox_wasm2c_sandbox.hpp"
+#include "wasm2c_details.hpp"
+// For get_os_page_size
+#include "wasm2c_snapshot.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <mutex>
+
+#if !defined(_WIN32)
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+namespace rlbox {
+
+// Host buffers backed by a memfd can be shared with wasm2c sandboxes without a
+// copy. impl_grant_access maps the pages of such a buffer over a window of the
+// sandbox's linear memory, so the host and the sandbox see the same memory,
+// and impl_deny_access replaces them with fresh pages again. The window is
+// allocated with the sandbox's malloc so that the sandboxed code leaves it
+// alone. Other buffers are not granted, and the rlbox frontend falls back to
+// copying them.
+namespace wasm2c_grant_detail {
+  struct shared_buffer
+  {
+    size_t size;
+    int fd;
+    uint64_t offset;
+    // Whether the buffer was created by rlbox_wasm2c_alloc_shared_buffer
+    bool owned;
+  };
+
+  struct shared_buffer_registry
+  {
+    std::mutex lock;
+    // Keyed by the address of the buffer
+    std::map<uintptr_t, shared_buffer> buffers;
+  };
+
+  // Function local static to keep this header only
+  inline shared_buffer_registry& get_shared_buffer_registry()
+  {
+    static shared_buffer_registry registry;
+    return registry;
+  }
+
+  inline size_t round_up_to_page(size_t size)
+  {
+#if defined(__linux__)
+    const size_t page_size = wasm2c_snapshot_detail::get_os_page_size();
+    return (size + page_size - 1) & ~(page_size - 1);
+#else
+    return size;
+#endif
+  }
+} // namespace wasm2c_grant_detail
+
+/**
+ * @brief registers a host buffer that is a mapping of the given memfd, so that
+ * it can be granted to wasm2c sandboxes without a copy. The buffer and offset
+ * must be page aligned. The buffer must be unregistered before it is unmapped.
+ */
+inline bool rlbox_wasm2c_register_shared_buffer(void* buffer,
+                                                size_t size,
+                                                int fd,
+                                                uint64_t offset)
+{
+#if defined(__linux__)
+  const size_t page_size = wasm2c_snapshot_detail::get_os_page_size();
+  if (reinterpret_cast<uintptr_t>(buffer) % page_size != 0 ||
+      offset % page_size != 0 || size == 0) {
+    return false;
+  }
+  auto& registry = wasm2c_grant_detail::get_shared_buffer_registry();
+  std::lock_guard<std::mutex> lock(registry.lock);
+  registry.buffers[reinterpret_cast<uintptr_t>(buffer)] = { size,
+                                                            fd,
+                                                            offset,
+                                                            false };
+  return true;
+#else
+  RLBOX_WASM2C_UNUSED(buffer);
+  RLBOX_WASM2C_UNUSED(size);
+  RLBOX_WASM2C_UNUSED(fd);
+  RLBOX_WASM2C_UNUSED(offset);
+  return false;
+#endif
+}
+
+inline void rlbox_wasm2c_unregister_shared_buffer(void* buffer)
+{
+  auto& registry = wasm2c_grant_detail::get_shared_buffer_registry();
+  std::lock_guard<std::mutex> lock(registry.lock);
+  registry.buffers.erase(reinterpret_cast<uintptr_t>(buffer));
+}
+
+/**
+ * @brief allocates a host buffer backed by a new memfd, which can be granted to
+ * wasm2c sandboxes without a copy.
+ *
+ * @return the buffer, or nullptr on failure or on platforms other than Linux
+ */
+inline void* rlbox_wasm2c_alloc_shared_buffer(size_t size)
+{
+#if defined(__linux__)
+  const size_t mapped_size = wasm2c_grant_detail::round_up_to_page(size);
+  if (mapped_size == 0) {
+    return nullptr;
+  }
+  int fd = memfd_create("rlbox_wasm2c_shared_buffer", MFD_CLOEXEC);
+  if (fd == -1) {
+    return nullptr;
+  }
+  if (ftruncate(fd, static_cast<off_t>(mapped_size)) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  void* buffer =
+    mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buffer == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto& registry = wasm2c_grant_detail::get_shared_buffer_registry();
+  std::lock_guard<std::mutex> lock(registry.lock);
+  registry.buffers[reinterpret_cast<uintptr_t>(buffer)] = { mapped_size,
+                                                            fd,
+                                                            0,
+                                                            true };
+  return buffer;
+#else
+  RLBOX_WASM2C_UNUSED(size);
+  return nullptr;
+#endif
+}
+
+/**
+ * @brief frees a buffer from rlbox_wasm2c_alloc_shared_buffer. Grants of the
+ * buffer must be denied first.
+ */
+inline void rlbox_wasm2c_free_shared_buffer(void* buffer)
+{
+#if defined(__linux__)
+  auto& registry = wasm2c_grant_detail::get_shared_buffer_registry();
+  std::lock_guard<std::mutex> lock(registry.lock);
+  auto found = registry.buffers.find(reinterpret_cast<uintptr_t>(buffer));
+  if (found == registry.buffers.end() || !found->second.owned) {
+    return;
+  }
+  munmap(buffer, found->second.size);
+  close(found->second.fd);
+  registry.buffers.erase(found);
+#else
+  RLBOX_WASM2C_UNUSED(buffer);
+#endif
+}
+
+/**
+ * @brief gives the sandbox access to num objects at src, without a copy when
+ * src is page aligned and inside a buffer from
+ * rlbox_wasm2c_alloc_shared_buffer or rlbox_wasm2c_register_shared_buffer.
+ *
+ * Granted memory is shared until impl_deny_access, and is dropped from the
+ * sandbox when its memory is restored from a snapshot or it is destroyed.
+ * Snapshots must not be taken while memory is granted.
+ *
+ * @param success set to false if the memory could not be granted, in which
+ * case it has to be copied
+ * @return the location of the memory in the sandbox
+ */
+template<typename T>
+inline T* rlbox_wasm2c_sandbox::impl_grant_access(T* src,
+                                                  size_t num,
+                                                  bool& success)
+{
+  success = false;
+#if defined(__linux__)
+  if (num > std::numeric_limits<size_t>::max() / sizeof(T)) {
+    return nullptr;
+  }
+  const size_t page_size = wasm2c_snapshot_detail::get_os_page_size();
+  const uintptr_t src_addr = reinterpret_cast<uintptr_t>(src);
+  const size_t length =
+    wasm2c_grant_detail::round_up_to_page(num * sizeof(T));
+  if (src_addr % page_size != 0 || length == 0 ||
+      length > impl_get_total_memory()) {
+    return nullptr;
+  }
+
+  int fd = -1;
+  uint64_t fd_offset = 0;
+  {
+    auto& registry = wasm2c_grant_detail::get_shared_buffer_registry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    auto found = registry.buffers.upper_bound(src_addr);
+    if (found == registry.buffers.begin()) {
+      return nullptr;
+    }
+    found = std::prev(found);
+    const uintptr_t buffer_offset = src_addr - found->first;
+    if (buffer_offset + length > found->second.size) {
+      return nullptr;
+    }
+    fd = found->second.fd;
+    fd_offset = found->second.offset + buffer_offset;
+  }
+
+  // Reserve a window in the sandbox's heap with room to page align it
+  T_PointerType window = impl_malloc_in_sandbox(length + page_size);
+  if (!window) {
+    return nullptr;
+  }
+  const T_PointerType aligned_window = static_cast<T_PointerType>(
+    (static_cast<size_t>(window) + page_size - 1) & ~(page_size - 1));
+  auto target = reinterpret_cast<char*>(impl_get_memory_location()) +
+                static_cast<size_t>(aligned_window);
+
+  void* mapped = mmap(target,
+                      length,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED,
+                      fd,
+                      static_cast<off_t>(fd_offset));
+  if (mapped != target) {
+    impl_free_in_sandbox(window);
+    return nullptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    grants[aligned_window] = { window, length, src };
+  }
+  success = true;
+  return reinterpret_cast<T*>(target);
+#else
+  RLBOX_WASM2C_UNUSED(src);
+  RLBOX_WASM2C_UNUSED(num);
+  return nullptr;
+#endif
+}
+
+/**
+ * @brief revokes the sandbox's access to memory granted by impl_grant_access.
+ *
+ * @param src the location of the granted memory in the sandbox
+ * @param success set to false if src was not granted, in which case it has to
+ * be copied out
+ * @return the host memory that was granted
+ */
+template<typename T>
+inline T* rlbox_wasm2c_sandbox::impl_deny_access(T* src,
+                                                 size_t num,
+                                                 bool& success)
+{
+  RLBOX_WASM2C_UNUSED(num);
+  success = false;
+  if (!impl_is_pointer_in_sandbox_memory(src)) {
+    return nullptr;
+  }
+  const T_PointerType sandboxed_src = impl_get_sandboxed_pointer<T*>(src);
+
+  wasm2c_grant_detail::grant granted;
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    auto found = grants.find(sandboxed_src);
+    // File mappings are removed with impl_unmap_file instead
+    if (found == grants.end() || found->second.host_memory == nullptr) {
+      return nullptr;
+    }
+    granted = found->second;
+    grants.erase(found);
+  }
+
+  revoke_grant(sandboxed_src, granted);
+  impl_free_in_sandbox(granted.window);
+  success = true;
+  return reinterpret_cast<T*>(granted.host_memory);
+}
+
+inline void rlbox_wasm2c_sandbox::revoke_grant(
+  T_PointerType location,
+  const wasm2c_grant_detail::grant& granted)
+{
+#if !defined(_WIN32)
+  // Replace the shared pages with fresh private ones, so the sandbox heap
+  // looks as if the window had never been granted
+  auto target = reinterpret_cast<char*>(impl_get_memory_location()) +
+                static_cast<size_t>(location);
+  void* mapped = mmap(target,
+                      granted.length,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                      -1,
+                      0);
+  detail::dynamic_check(mapped == target, "Could not revoke granted memory");
+#else
+  RLBOX_WASM2C_UNUSED(location);
+  RLBOX_WASM2C_UNUSED(granted);
+#endif
+}
+
+/**
+ * @brief maps length bytes of a file, starting at offset, over the sandbox
+ * memory at location, so that the sandbox reads the file without a copy. Both
+ * location and offset must be page aligned, and location must be memory the
+ * caller has allocated in the sandbox, e.g. with malloc_in_sandbox.
+ *
+ * The mapping is read only, so writes by the sandbox trap, unless
+ * copy_on_write is set, in which case the sandbox gets a private copy of the
+ * pages it writes. Mappings are removed like grants when the sandbox memory is
+ * restored from a snapshot or the sandbox is destroyed.
+ *
+ * @return false if the file could not be mapped
+ */
+inline bool rlbox_wasm2c_sandbox::impl_map_file(T_PointerType location,
+                                                size_t length,
+                                                int fd,
+                                                uint64_t offset,
+                                                bool copy_on_write)
+{
+#if !defined(_WIN32)
+  const size_t page_size = wasm2c_snapshot_detail::get_os_page_size();
+  const size_t total = impl_get_total_memory();
+  if (location % page_size != 0 || offset % page_size != 0 || length == 0 ||
+      length > total || location > total - length) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(grant_mutex);
+  if (grants.count(location) != 0) {
+    return false;
+  }
+  auto target = reinterpret_cast<char*>(impl_get_memory_location()) +
+                static_cast<size_t>(location);
+  void* mapped =
+    mmap(target,
+         length,
+         copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ,
+         MAP_PRIVATE | MAP_FIXED,
+         fd,
+         static_cast<off_t>(offset));
+  if (mapped != target) {
+    return false;
+  }
+  // Files are usually consumed front to back
+  madvise(target, length, MADV_SEQUENTIAL);
+  grants[location] = { 0, length, nullptr };
+  return true;
+#else
+  RLBOX_WASM2C_UNUSED(location);
+  RLBOX_WASM2C_UNUSED(length);
+  RLBOX_WASM2C_UNUSED(fd);
+  RLBOX_WASM2C_UNUSED(offset);
+  RLBOX_WASM2C_UNUSED(copy_on_write);
+  return false;
+#endif
+}
+
+/**
+ * @brief removes a mapping made by impl_map_file, leaving zeroed memory
+ */
+inline void rlbox_wasm2c_sandbox::impl_unmap_file(T_PointerType location)
+{
+  wasm2c_grant_detail::grant mapping;
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    auto found = grants.find(location);
+    if (found == grants.end() || found->second.host_memory != nullptr) {
+      return;
+    }
+    mapping = found->second;
+    grants.erase(found);
+  }
+  revoke_grant(location, mapping);
+}
+
+/**
+ * @brief revokes all grants and file mappings, before the sandbox memory is
+ * reset or destroyed. The windows are not freed, as the heap they were
+ * allocated in is about to be replaced.
+ */
+inline void rlbox_wasm2c_sandbox::revoke_all_grants()
+{
+  std::map<T_PointerType, wasm2c_grant_detail::grant> revoked;
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    revoked.swap(grants);
+  }
+  for (auto& entry : revoked) {
+    revoke_grant(entry.first, entry.second);
+  }
+}
+
+} // namespace rlbox
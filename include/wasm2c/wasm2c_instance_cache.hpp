@@ -0,0 +1,199 @@
+#pragma once
+
+#include "wasm-rt.h"
+
+// Pull the helper header from the main repo for dynamic_check and scope_exit
+#include "rlbox_helpers.hpp"
+#include "rlbox_wasm2c_sandbox.hpp"
+#include "wasm2c_details.hpp"
+#include "wasm2c_snapshot.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rlbox {
+
+// The wasm2c runtime reserves the heap of each instance itself, which for a 4GB
+// aligned heap is a large mmap on creation and a munmap with TLB shootdowns on
+// destruction. Instead of destroying instances, destroyed sandboxes park them
+// here with their heap pages released but their reservation intact, and new
+// sandboxes of the same module and heap size reuse them. A parked instance is
+// returned to the module's initial memory and globals before it is reused.
+namespace wasm2c_instance_cache_detail {
+  struct cached_instance
+  {
+    void* sandbox;
+    wasm_rt_memory_t* memory_info;
+  };
+
+  struct module_cache
+  {
+    // Linear memory and RLBOX_WASM2C_RESET_GLOBALS of a freshly created
+    // instance of the module
+    rlbox_wasm2c_snapshot initial_state;
+    std::vector<cached_instance> instances;
+  };
+
+  struct cache_state
+  {
+    std::mutex lock;
+    std::map<const void*, module_cache> modules;
+  };
+
+  // Function local static to keep this header only
+  inline cache_state& get_cache_state()
+  {
+    static cache_state state;
+    return state;
+  }
+} // namespace wasm2c_instance_cache_detail
+
+inline const void* rlbox_wasm2c_sandbox::get_instance_cache_key() const
+{
+#ifndef RLBOX_USE_STATIC_CALLS
+  return loaded_module;
+#else
+  // There is only one statically linked module
+  return nullptr;
+#endif
+}
+
+/**
+ * @brief take a parked instance with the given max heap size from the cache
+ * and reset its memory and globals to the initial state of the module.
+ *
+ * @return false if no such instance is cached
+ */
+inline bool rlbox_wasm2c_sandbox::take_cached_instance(uint32_t max_wasm_pages)
+{
+#if RLBOX_WASM2C_MAX_CACHED_INSTANCES == 0
+  RLBOX_WASM2C_UNUSED(max_wasm_pages);
+  return false;
+#else
+  auto& state = wasm2c_instance_cache_detail::get_cache_state();
+  const rlbox_wasm2c_snapshot* initial_state = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(state.lock);
+    auto found = state.modules.find(get_instance_cache_key());
+    if (found == state.modules.end()) {
+      return false;
+    }
+    auto& instances = found->second.instances;
+    for (auto it = instances.begin(); it != instances.end(); it++) {
+      if (it->memory_info->max_pages == max_wasm_pages) {
+        sandbox = it->sandbox;
+        sandbox_memory_info = it->memory_info;
+        instances.erase(it);
+        initial_state = &found->second.initial_state;
+        break;
+      }
+    }
+  }
+
+  if (initial_state == nullptr) {
+    return false;
+  }
+  // The initial state is only cleared when the module is unloaded, which
+  // cannot happen while this sandbox holds the module. Restoring it also resets
+  // the globals the previous sandbox may have left anywhere, e.g. the stack
+  // pointer if it trapped during an invocation.
+  impl_restore_snapshot(*initial_state);
+  return true;
+#endif
+}
+
+/**
+ * @brief record the memory and globals of a freshly created instance as the
+ * initial state of its module, if this is the first instance of the module.
+ * Nothing is recorded if the module does not export the globals to reset, so
+ * its instances are never reused.
+ */
+inline void rlbox_wasm2c_sandbox::save_initial_state()
+{
+#if RLBOX_WASM2C_MAX_CACHED_INSTANCES != 0
+  auto& state = wasm2c_instance_cache_detail::get_cache_state();
+  std::lock_guard<std::mutex> lock(state.lock);
+  auto& cache = state.modules[get_instance_cache_key()];
+  if (cache.initial_state.empty()) {
+    std::vector<uint32_t*> globals;
+    if (!wasm2c_snapshot_detail::find_reset_globals(
+          sandbox_info, sandbox, globals)) {
+      return;
+    }
+    impl_take_snapshot(cache.initial_state);
+  }
+#endif
+}
+
+/**
+ * @brief park the instance of this sandbox in the cache instead of destroying
+ * it. Callbacks are removed from its function table and its heap pages are
+ * released, while its reservation is kept.
+ *
+ * Only the mutable wasm globals named in RLBOX_WASM2C_RESET_GLOBALS are reset
+ * when the instance is reused. Modules with other mutable globals should not
+ * enable the cache.
+ *
+ * @return false if the instance could not be cached and should be destroyed
+ */
+inline bool rlbox_wasm2c_sandbox::retire_instance()
+{
+#if RLBOX_WASM2C_MAX_CACHED_INSTANCES == 0
+  return false;
+#else
+  auto& state = wasm2c_instance_cache_detail::get_cache_state();
+  std::lock_guard<std::mutex> lock(state.lock);
+  auto found = state.modules.find(get_instance_cache_key());
+  if (found == state.modules.end() || found->second.initial_state.empty() ||
+      found->second.instances.size() >= RLBOX_WASM2C_MAX_CACHED_INSTANCES) {
+    return false;
+  }
+
+  {
+    RLBOX_ACQUIRE_UNIQUE_GUARD(callback_lock, callback_mutex);
+    callback_slots.for_each([&](void*, uint32_t i) {
+      sandbox_info.remove_wasm2c_callback(sandbox, callback_slot_assignment[i]);
+      callbacks.clear(i);
+      callback_slot_assignment[i] = 0;
+    });
+    callback_slots.clear();
+    internal_callbacks.for_each([&](const void*, uint32_t slot) {
+      sandbox_info.remove_wasm2c_callback(sandbox, slot);
+    });
+    internal_callbacks.clear();
+    slot_assignments.clear();
+  }
+
+  // Release all heap pages but keep the reservation
+  set_memory_accessible_size(impl_get_total_memory(), 0);
+  sandbox_memory_info->pages = 0;
+  sandbox_memory_info->size = 0;
+
+  found->second.instances.push_back({ sandbox, sandbox_memory_info });
+  return true;
+#endif
+}
+
+/**
+ * @brief destroy all instances cached for a module. Called when the module is
+ * unloaded, at which point no sandboxes of the module exist anymore.
+ */
+inline void rlbox_wasm2c_sandbox::drain_instance_cache(
+  const void* cache_key,
+  const wasm2c_sandbox_funcs_t& info)
+{
+  auto& state = wasm2c_instance_cache_detail::get_cache_state();
+  std::lock_guard<std::mutex> lock(state.lock);
+  auto found = state.modules.find(cache_key);
+  if (found == state.modules.end()) {
+    return;
+  }
+  for (auto& instance : found->second.instances) {
+    info.destroy_wasm2c_sandbox(instance.sandbox);
+  }
+  state.modules.erase(found);
+}
+
+} // namespace rlbox
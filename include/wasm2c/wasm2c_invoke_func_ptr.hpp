@@ -7,31 +7,24 @@
 
 namespace rlbox {
 
-void rlbox_wasm2c_sandbox::ensure_return_slot_size(size_t size)
-{
-  if (size > return_slot_size) {
-    if (return_slot_size) {
-      impl_free_in_sandbox(return_slot);
-    }
-    return_slot = impl_malloc_in_sandbox(size);
-    detail::dynamic_check(
-      return_slot != 0,
-      "Error initializing return slot. Sandbox may be out of memory!");
-    return_slot_size = size;
-  }
-}
-
 template<typename T, typename T_Converted, typename... T_Args>
 auto rlbox_wasm2c_sandbox::impl_invoke_with_func_ptr(T_Converted* func_ptr,
                                                      T_Args&&... params)
 {
-#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
-  auto& thread_data = *get_rlbox_wasm2c_sandbox_thread_data();
-#endif
-  auto old_sandbox = thread_data.sandbox;
-  thread_data.sandbox = this;
-  auto on_exit =
-    detail::make_scope_exit([&] { thread_data.sandbox = old_sandbox; });
+  // Within a session, the sandbox is already bound to this thread
+  rlbox_wasm2c_sandbox_thread_data* bound_thread_data = nullptr;
+  rlbox_wasm2c_sandbox* old_sandbox = nullptr;
+  if (!rlbox_sandbox_session<rlbox_wasm2c_sandbox>::is_bound_to_thread(
+        this)) {
+    bound_thread_data = get_session_thread_data();
+    old_sandbox = bound_thread_data->sandbox;
+    bound_thread_data->sandbox = this;
+  }
+  auto on_exit = detail::make_scope_exit([&] {
+    if (bound_thread_data != nullptr) {
+      bound_thread_data->sandbox = old_sandbox;
+    }
+  });
 
   // WASM functions are mangled in the following manner
   // 1. All primitive types are left as is and follow an LP32 machine model
@@ -52,9 +45,39 @@ auto rlbox_wasm2c_sandbox::impl_invoke_with_func_ptr(T_Converted* func_ptr,
     using T_Conv2 = wasm2c_detail::prepend_arg_type<T_Conv1, T_PointerType>;
     auto func_ptr_conv =
       reinterpret_cast<T_Conv2*>(reinterpret_cast<uintptr_t>(func_ptr));
-    ensure_return_slot_size(sizeof(T_Ret));
+    // The return slot is taken from the scratch arena, so concurrent calls
+    // from different threads never share it. Threads do not get a slot of
+    // their own: it has to be in this sandbox's memory, so each call would
+    // need a lookup keyed on thread and sandbox, and the slots of every thread
+    // that ever called in could only be freed with the sandbox. Instead, a
+    // call made while another thread holds the arena, or with a struct larger
+    // than RLBOX_SCRATCH_ARENA_SIZE, mallocs a slot and frees it on return.
+    // The arena has a fixed size, so it is never reallocated for larger
+    // structs.
+    typename rlbox_scratch_arena<T_PointerType>::scope scratch(
+      scratch_arena, true, [&](size_t size) {
+        return impl_malloc_in_sandbox(size);
+      });
+    T_PointerType return_slot = scratch.allocate(sizeof(T_Ret));
+    const bool return_slot_malloced = !return_slot;
+    if (return_slot_malloced) {
+      return_slot = impl_malloc_in_sandbox(sizeof(T_Ret));
+      detail::dynamic_check(
+        return_slot != 0,
+        "Error initializing return slot. Sandbox may be out of memory!");
+    }
+    auto free_return_slot = detail::make_scope_exit([&] {
+      if (return_slot_malloced) {
+        impl_free_in_sandbox(return_slot);
+      }
+    });
+
     impl_invoke_with_func_ptr<T>(func_ptr_conv, return_slot, params...);
 
+    // The result is copied out of the slot rather than written directly into
+    // the caller's storage. That storage is outside the sandbox, where the
+    // callee cannot write, so one copy is needed either way, and returning a
+    // named local lets the compiler build it in place for the caller.
     auto ptr = reinterpret_cast<T_Ret*>(
       impl_get_unsandboxed_pointer<T_Ret*>(return_slot));
     T_Ret ret = *ptr;
@@ -74,18 +97,28 @@ auto rlbox_wasm2c_sandbox::impl_invoke_with_func_ptr(T_Converted* func_ptr,
   T_PointerType allocations_buff[alloc_length == 0 ? 1 : alloc_length];
   T_PointerType* allocations = allocations_buff;
 
+  // Class arguments are placed in the scratch arena, which only falls back to
+  // malloc_in_sandbox if the arena is in use by another thread or full
+  typename rlbox_scratch_arena<T_PointerType>::scope scratch(
+    scratch_arena, alloc_length > 0, [&](size_t size) {
+      return impl_malloc_in_sandbox(size);
+    });
+
   auto serialize_class_arg =
     [&](auto arg) -> std::conditional_t<std::is_class_v<decltype(arg)>,
                                         T_PointerType,
                                         decltype(arg)> {
     using T_Arg = decltype(arg);
     if constexpr (std::is_class_v<T_Arg>) {
-      auto slot = impl_malloc_in_sandbox(sizeof(T_Arg));
+      auto slot = scratch.allocate(sizeof(T_Arg));
+      if (!slot) {
+        slot = impl_malloc_in_sandbox(sizeof(T_Arg));
+        allocations[0] = slot;
+        allocations++;
+      }
       auto ptr =
         reinterpret_cast<T_Arg*>(impl_get_unsandboxed_pointer<T_Arg*>(slot));
       *ptr = arg;
-      allocations[0] = slot;
-      allocations++;
       return slot;
     } else {
       return arg;
@@ -116,8 +149,9 @@ auto rlbox_wasm2c_sandbox::impl_invoke_with_func_ptr(T_Converted* func_ptr,
     ret = func_ptr_conv(exec_env, serialize_class_arg(params)...);
   }
 
-  for (size_t i = 0; i < alloc_length; i++) {
-    impl_free_in_sandbox(allocations_buff[i]);
+  // Only arguments that did not fit in the scratch arena were malloced
+  for (T_PointerType* p = allocations_buff; p != allocations; p++) {
+    impl_free_in_sandbox(*p);
   }
 
   if constexpr (!std::is_void_v<T_Ret>) {
@@ -10,27 +10,47 @@
 namespace rlbox {
 
 #ifndef RLBOX_USE_STATIC_CALLS
+void* rlbox_wasm2c_sandbox::function_export_lookup(const char* prefixed_name)
+{
+  return rlbox_module_registry<wasm2c_sandbox_funcs_t>::lookup_library_symbol(
+    library, prefixed_name);
+}
+
+void* rlbox_wasm2c_sandbox::global_export_lookup(const char* prefixed_name)
+{
+  // Some lookups such as globals are not exposed as shared library symbols
+  uint32_t* heap_index_pointer =
+    (uint32_t*)sandbox_info.lookup_wasm2c_nonfunc_export(sandbox,
+                                                         prefixed_name);
+  if (heap_index_pointer == nullptr) {
+    return nullptr;
+  }
+  uint32_t heap_index = *heap_index_pointer;
+  return &(reinterpret_cast<char*>(heap_base)[heap_index]);
+}
+
 void* rlbox_wasm2c_sandbox::symbol_lookup(std::string prefixed_name)
 {
-#  if defined(_WIN32)
-  void* ret = (void*)GetProcAddress((HMODULE)library, prefixed_name.c_str());
-#  else
-  void* ret = dlsym(library, prefixed_name.c_str());
-#  endif
+  void* ret = function_export_lookup(prefixed_name.c_str());
   if (ret == nullptr) {
-    // Some lookups such as globals are not exposed as shared library symbols
-    uint32_t* heap_index_pointer =
-      (uint32_t*)sandbox_info.lookup_wasm2c_nonfunc_export(
-        sandbox, prefixed_name.c_str());
-    if (heap_index_pointer != nullptr) {
-      uint32_t heap_index = *heap_index_pointer;
-      ret = &(reinterpret_cast<char*>(heap_base)[heap_index]);
-    }
+    ret = global_export_lookup(prefixed_name.c_str());
   }
   return ret;
 }
 #endif
 
+void* rlbox_wasm2c_sandbox::impl_lookup_data_export(const char* name)
+{
+  std::string prefixed_name = "w2c_";
+  prefixed_name += name;
+  auto global = static_cast<uint32_t*>(
+    sandbox_info.lookup_wasm2c_nonfunc_export(sandbox, prefixed_name.c_str()));
+  if (global == nullptr) {
+    return nullptr;
+  }
+  return impl_get_unsandboxed_pointer<void*>(*global);
+}
+
 // function takes a 32-bit value and returns the next power of 2
 // return is a 64-bit value as large 32-bit values will return 2^32
 uint64_t rlbox_wasm2c_sandbox::next_power_of_two(uint32_t value)
@@ -74,9 +94,34 @@ uint64_t rlbox_wasm2c_sandbox::rlbox_wasm2c_get_heap_page_count(
 #ifndef RLBOX_USE_STATIC_CALLS
 void* rlbox_wasm2c_sandbox::impl_lookup_symbol(const char* func_name)
 {
+  return impl_lookup_symbol(rlbox_export_name_hash(func_name), func_name);
+}
+
+void* rlbox_wasm2c_sandbox::impl_lookup_symbol(uint64_t hash,
+                                               const char* func_name)
+{
+  // Functions are shared by all sandboxes of the module, so they are cached
+  // in the module. Globals are read from this sandbox's instance and point
+  // into its heap, so they are cached in the sandbox.
+  void* ret = loaded_module->export_cache.find(hash, func_name);
+  if (ret == nullptr) {
+    ret = global_exports.find(hash, func_name);
+  }
+  if (ret != nullptr) {
+    return ret;
+  }
+
   std::string prefixed_name = "w2c_";
   prefixed_name += func_name;
-  void* ret = symbol_lookup(prefixed_name);
+  ret = function_export_lookup(prefixed_name.c_str());
+  if (ret != nullptr) {
+    loaded_module->export_cache.insert(hash, func_name, ret);
+    return ret;
+  }
+  ret = global_export_lookup(prefixed_name.c_str());
+  if (ret != nullptr) {
+    global_exports.insert(hash, func_name, ret);
+  }
   return ret;
 }
 #else
@@ -99,8 +144,30 @@ void* rlbox_wasm2c_sandbox::impl_lookup_symbol(const char* func_name)
 }
 #endif
 
+/**
+ * @brief get the wasm2c plugin of an rlbox_sandbox. The rlbox frontend does not
+ * expose its plugin, so plugin specific APIs such as the sandbox pool use this
+ * to reach the plugin of a sandbox.
+ */
+template<typename T_Frontend>
+inline rlbox_wasm2c_sandbox* rlbox_wasm2c_sandbox::get_plugin(
+  T_Frontend& sandbox)
+{
+  return rlbox_get_plugin<rlbox_wasm2c_sandbox>(sandbox);
+}
+
+inline rlbox_wasm2c_sandbox_thread_data*
+rlbox_wasm2c_sandbox::get_session_thread_data()
+{
+#ifdef RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+  return get_rlbox_wasm2c_sandbox_thread_data();
+#else
+  return &thread_data;
+#endif
+}
+
 inline rlbox_wasm2c_sandbox::T_PointerType
-rlbox_wasm2c_sandbox::impl_malloc_in_sandbox(size_t size)
+rlbox_wasm2c_sandbox::malloc_in_guest(size_t size)
 {
   if constexpr (sizeof(size) > sizeof(uint32_t)) {
     detail::dynamic_check(size <= std::numeric_limits<uint32_t>::max(),
@@ -113,7 +180,7 @@ rlbox_wasm2c_sandbox::impl_malloc_in_sandbox(size_t size)
   return ret;
 }
 
-inline void rlbox_wasm2c_sandbox::impl_free_in_sandbox(T_PointerType p)
+inline void rlbox_wasm2c_sandbox::free_in_guest(T_PointerType p)
 {
   using T_Func = void(void*);
   using T_Converted = void(T_PointerType);
@@ -121,11 +188,211 @@ inline void rlbox_wasm2c_sandbox::impl_free_in_sandbox(T_PointerType p)
     reinterpret_cast<T_Converted*>(free_index), p);
 }
 
+inline rlbox_wasm2c_sandbox::T_PointerType
+rlbox_wasm2c_sandbox::impl_malloc_in_sandbox(size_t size)
+{
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+  T_PointerType ret = host_allocator.allocate(
+    size, [&](size_t region_size) { return malloc_in_guest(region_size); });
+  if (ret) {
+    return ret;
+  }
+#endif
+  return malloc_in_guest(size);
+}
+
+inline void rlbox_wasm2c_sandbox::impl_free_in_sandbox(T_PointerType p)
+{
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+  if (host_allocator.deallocate(p)) {
+    return;
+  }
+#endif
+  free_in_guest(p);
+}
+
+/**
+ * @brief allocate count objects of the given sizes in the sandbox, with a
+ * single invocation of the rlbox_malloc_bulk export of the module. Modules
+ * without the export, and statically linked modules, allocate the objects one
+ * at a time instead.
+ *
+ * @param ptrs receives the allocations, with a null pointer for each
+ * allocation that failed. Allocations made by the sandboxed malloc are checked
+ * to lie within the sandbox memory.
+ */
+inline void rlbox_wasm2c_sandbox::impl_malloc_in_sandbox_bulk(
+  const size_t* sizes,
+  size_t count,
+  T_PointerType* ptrs)
+{
+  // Allocations that are not served by the host allocator are left to the
+  // sandbox and marked with a null pointer
+  size_t guest_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if constexpr (sizeof(size_t) > sizeof(uint32_t)) {
+      detail::dynamic_check(sizes[i] <= std::numeric_limits<uint32_t>::max(),
+                            "Attempting to malloc more than the heap size");
+    }
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+    ptrs[i] = host_allocator.allocate(sizes[i], [&](size_t region_size) {
+      return malloc_in_guest(region_size);
+    });
+#else
+    ptrs[i] = 0;
+#endif
+    if (!ptrs[i]) {
+      guest_count++;
+    }
+  }
+  if (guest_count == 0) {
+    return;
+  }
+
+  // The sandboxed malloc could return any offset, so make sure the whole
+  // allocation is in the sandbox memory before handing it out
+  auto check_guest_allocation = [&](T_PointerType p, size_t size) {
+    const size_t total = impl_get_total_memory();
+    detail::dynamic_check(p == 0 || (p <= total && size <= total - p),
+                          "Malloc returned pointer outside the sandbox memory");
+    return p;
+  };
+
+  if (malloc_bulk_index == nullptr) {
+    for (size_t i = 0; i < count; i++) {
+      if (!ptrs[i]) {
+        ptrs[i] = check_guest_allocation(malloc_in_guest(sizes[i]), sizes[i]);
+      }
+    }
+    return;
+  }
+
+  // The sizes and results are passed in sandbox memory, taken from the scratch
+  // arena when possible to avoid another two invocations
+  const size_t buffer_size = guest_count * 2 * sizeof(uint32_t);
+  typename rlbox_scratch_arena<T_PointerType>::scope scratch(
+    scratch_arena, true, [&](size_t size) { return malloc_in_guest(size); });
+  T_PointerType buffer = scratch.allocate(buffer_size);
+  const bool buffer_malloced = !buffer;
+  if (buffer_malloced) {
+    buffer = malloc_in_guest(buffer_size);
+    detail::dynamic_check(
+      buffer != 0,
+      "Could not allocate bulk malloc buffer. Sandbox may be out of memory!");
+  }
+  auto on_exit = detail::make_scope_exit([&] {
+    if (buffer_malloced) {
+      free_in_guest(buffer);
+    }
+  });
+
+  auto guest_sizes =
+    reinterpret_cast<uint32_t*>(impl_get_unsandboxed_pointer<char*>(buffer));
+  for (size_t i = 0, j = 0; i < count; i++) {
+    if (!ptrs[i]) {
+      guest_sizes[j++] = static_cast<uint32_t>(sizes[i]);
+    }
+  }
+
+  const T_PointerType results_buffer =
+    buffer + static_cast<T_PointerType>(guest_count * sizeof(uint32_t));
+  using T_MallocBulk = void(T_PointerType, T_PointerType, uint32_t);
+  impl_invoke_with_func_ptr<T_MallocBulk, T_MallocBulk>(
+    reinterpret_cast<T_MallocBulk*>(malloc_bulk_index),
+    buffer,
+    results_buffer,
+    static_cast<uint32_t>(guest_count));
+
+  // The heap may have moved if malloc grew it, so get the pointer again
+  auto results = reinterpret_cast<uint32_t*>(
+    impl_get_unsandboxed_pointer<char*>(results_buffer));
+  for (size_t i = 0, j = 0; i < count; i++) {
+    if (!ptrs[i]) {
+      ptrs[i] = check_guest_allocation(results[j++], sizes[i]);
+    }
+  }
+}
+
+/**
+ * @brief free count objects in the sandbox, with a single invocation of the
+ * rlbox_free_bulk export of the module when available.
+ */
+inline void rlbox_wasm2c_sandbox::impl_free_in_sandbox_bulk(
+  const T_PointerType* ptrs,
+  size_t count)
+{
+  if (count == 0) {
+    return;
+  }
+
+  if (free_bulk_index == nullptr) {
+    for (size_t i = 0; i < count; i++) {
+      if (ptrs[i]) {
+        impl_free_in_sandbox(ptrs[i]);
+      }
+    }
+    return;
+  }
+
+  // Sized for all pointers, as we only know how many are freed by the sandbox
+  // after the host allocator has taken its own
+  const size_t buffer_size = count * sizeof(uint32_t);
+  typename rlbox_scratch_arena<T_PointerType>::scope scratch(
+    scratch_arena, true, [&](size_t size) { return malloc_in_guest(size); });
+  T_PointerType buffer = scratch.allocate(buffer_size);
+  const bool buffer_malloced = !buffer;
+  if (buffer_malloced) {
+    buffer = malloc_in_guest(buffer_size);
+    detail::dynamic_check(
+      buffer != 0,
+      "Could not allocate bulk free buffer. Sandbox may be out of memory!");
+  }
+  auto on_exit = detail::make_scope_exit([&] {
+    if (buffer_malloced) {
+      free_in_guest(buffer);
+    }
+  });
+
+  auto guest_ptrs =
+    reinterpret_cast<uint32_t*>(impl_get_unsandboxed_pointer<char*>(buffer));
+  size_t guest_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!ptrs[i]) {
+      continue;
+    }
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+    if (host_allocator.deallocate(ptrs[i])) {
+      continue;
+    }
+#endif
+    guest_ptrs[guest_count++] = ptrs[i];
+  }
+  if (guest_count == 0) {
+    return;
+  }
+
+  using T_FreeBulk = void(T_PointerType, uint32_t);
+  impl_invoke_with_func_ptr<T_FreeBulk, T_FreeBulk>(
+    reinterpret_cast<T_FreeBulk*>(free_bulk_index),
+    buffer,
+    static_cast<uint32_t>(guest_count));
+}
+
 template<typename T_Ret, typename... T_Args>
 uint32_t rlbox_wasm2c_sandbox::get_wasm2c_func_index(
   // dummy for template inference
   T_Ret (*)(T_Args...)) const
 {
+  // Looking the index up in the module takes a lock in the wasm2c runtime, so
+  // it is done once per signature. Callers hold callback_mutex, which
+  // serializes the writes.
+  const void* signature =
+    &wasm2c_detail::signature_tag<T_Ret, T_Args...>::value;
+  auto found = func_type_indices.find(signature);
+  if (found) {
+    return *found;
+  }
+
   // Class return types as promoted to args
   constexpr bool promoted = std::is_class_v<T_Ret>;
 
@@ -151,7 +418,22 @@ uint32_t rlbox_wasm2c_sandbox::get_wasm2c_func_index(
 
   auto ret = sandbox_info.lookup_wasm2c_func_index(
     sandbox, param_count, ret_count, ret_param_types);
+  func_type_indices.insert(signature, ret);
   return ret;
 }
 
+/**
+ * @brief looks up the function type index of the signature T, e.g.
+ * int(int, int), so that the first callback or function pointer with this
+ * signature does not have to. List it in rlbox_wasm2c_eager_bind::signatures.
+ */
+template<typename T>
+inline void rlbox_wasm2c_sandbox::prepare_signature(
+  rlbox_wasm2c_sandbox& sandbox)
+{
+  static_assert(std::is_function_v<T>, "Expected a function type");
+  RLBOX_ACQUIRE_UNIQUE_GUARD(lock, sandbox.callback_mutex);
+  sandbox.get_wasm2c_func_index(static_cast<T*>(nullptr));
+}
+
 } // namespace rlbox
\ No newline at end of file
@@ -27,6 +27,16 @@ namespace rlbox {
  * wasm heap allowed for this sandbox instance. When the value is zero, platform
  * defaults are used. Non-zero values are rounded to max(64k, next power of 2).
  * @param wasm_module_name optional module name used when compiling with wasm2c
+ * @param preinit_image_path optional path of an image written by
+ * impl_write_preinit_image, typically by the rlbox_wasm2c_preinit tool at build
+ * time. The sandbox starts from the memory in the image instead of the
+ * module's initial memory.
+ * @param eager_bind optional options to resolve exports, look up callback
+ * signatures and fault in the module's code while creating the sandbox,
+ * instead of on first use. The module is also loaded with RTLD_NOW, so that
+ * its symbols are bound before any call, unless an earlier sandbox of the
+ * module, which is still alive, loaded it lazily. Creation then only fails if
+ * eager_bind->require_eager_binding is set.
  * @return true when sandbox is successfully created
  * @return false when infallible if set to false and sandbox was not
  * successfully created. If infallible is set to true, this function will never
@@ -38,51 +48,68 @@ bool rlbox_wasm2c_sandbox::impl_create_sandbox(
 #endif
   bool infallible = true,
   uint64_t override_max_heap_size = 0,
-  const char* wasm_module_name = "")
+  const char* wasm_module_name = "",
+  const char* preinit_image_path = nullptr,
+  const rlbox_wasm2c_eager_bind* eager_bind = nullptr)
 {
   FALLIBLE_DYNAMIC_CHECK(
     infallible, sandbox == nullptr, "Sandbox already initialized");
 
 #ifndef RLBOX_USE_STATIC_CALLS
-#  if defined(_WIN32)
-  library = (void*)LoadLibraryW(wasm2c_module_path);
-#  else
-  library = dlopen(wasm2c_module_path, RTLD_LAZY);
-#  endif
-
-  if (!library) {
-    std::string error_msg = "Could not load wasm2c dynamic library: ";
-#  if defined(_WIN32)
-    DWORD errorMessageID = GetLastError();
-    if (errorMessageID != 0) {
-      LPSTR messageBuffer = nullptr;
-      // The api creates the buffer that holds the message
-      size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                                     FORMAT_MESSAGE_FROM_SYSTEM |
-                                     FORMAT_MESSAGE_IGNORE_INSERTS,
-                                   NULL,
-                                   errorMessageID,
-                                   MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-                                   (LPSTR)&messageBuffer,
-                                   0,
-                                   NULL);
-      // Copy the error message into a std::string.
-      std::string message(messageBuffer, size);
-      error_msg += message;
-      LocalFree(messageBuffer);
-    }
-#  else
-    error_msg += dlerror();
-#  endif
-    FALLIBLE_DYNAMIC_CHECK(infallible, false, error_msg.c_str());
+  // Sandboxes of the same module share the loaded library, so the library is
+  // only loaded and its exports resolved for the first sandbox
+  std::string error_msg;
+  int dl_flags = RLBOX_WASM2C_DLOPEN_FLAGS;
+#  if !defined(_WIN32)
+  // Windows always binds eagerly
+  if (eager_bind != nullptr) {
+    dl_flags = (dl_flags & ~RTLD_LAZY) | RTLD_NOW;
   }
-#endif
+#  endif
+  loaded_module = rlbox_module_registry<wasm2c_sandbox_funcs_t>::acquire(
+    wasm2c_module_path,
+    wasm_module_name,
+    dl_flags,
+    [&](auto& module, std::string& init_error_msg) {
+      std::string info_func_name = wasm_module_name;
+      info_func_name += "get_wasm2c_sandbox_info";
+      auto get_info_func = reinterpret_cast<wasm2c_sandbox_funcs_t (*)()>(
+        rlbox_module_registry<wasm2c_sandbox_funcs_t>::lookup_library_symbol(
+          module.library, info_func_name.c_str()));
+      if (get_info_func == nullptr) {
+        init_error_msg =
+          "wasm2c could not find <MODULE_NAME>get_wasm2c_sandbox_info";
+        return false;
+      }
+      module.info = get_info_func();
 
-#ifndef RLBOX_USE_STATIC_CALLS
-  std::string info_func_name = wasm_module_name;
-  info_func_name += "get_wasm2c_sandbox_info";
-  auto get_info_func = reinterpret_cast<wasm2c_sandbox_funcs_t (*)()>(
-    symbol_lookup(info_func_name));
+      for (const char* name : { "w2c_malloc",
+                                "w2c_free",
+                                "w2c_rlbox_malloc_bulk",
+                                "w2c_rlbox_free_bulk",
+                                "w2c_rlbox_batch_dispatch" }) {
+        module.exports[name] =
+          rlbox_module_registry<wasm2c_sandbox_funcs_t>::lookup_library_symbol(
+            module.library, name);
+      }
+      // Instances cached for reuse must be destroyed before the library goes
+      module.on_unload =
+        [](rlbox_loaded_module<wasm2c_sandbox_funcs_t>* unloaded) {
+          drain_instance_cache(unloaded, unloaded->info);
+        };
+      return true;
+    },
+    error_msg);
+  FALLIBLE_DYNAMIC_CHECK(
+    infallible, loaded_module != nullptr, error_msg.c_str());
+  library = loaded_module->library;
+  sandbox_info = loaded_module->info;
+  FALLIBLE_DYNAMIC_CHECK(
+    infallible,
+    eager_bind == nullptr || !eager_bind->require_eager_binding ||
+      loaded_module->is_bound_eagerly(),
+    "Could not bind the wasm2c module eagerly, as it is already loaded with "
+    "lazy binding");
 #else
   // only permitted if there is no custom module name
   std::string wasm_module_name_str = wasm_module_name;
@@ -92,12 +119,12 @@ bool rlbox_wasm2c_sandbox::impl_create_sandbox(
     "Static calls not supported with non empty module names");
   auto get_info_func =
     reinterpret_cast<wasm2c_sandbox_funcs_t (*)()>(get_wasm2c_sandbox_info);
-#endif
   FALLIBLE_DYNAMIC_CHECK(
     infallible,
     get_info_func != nullptr,
     "wasm2c could not find <MODULE_NAME>get_wasm2c_sandbox_info");
   sandbox_info = get_info_func();
+#endif
 
   std::call_once(wasm2c_runtime_initialized,
                  [&]() { sandbox_info.wasm_rt_sys_init(); });
@@ -110,17 +137,22 @@ bool rlbox_wasm2c_sandbox::impl_create_sandbox(
                          override_max_wasm_pages <= 65536,
                          "Wasm allows a max heap size of 4GB");
 
-  sandbox = sandbox_info.create_wasm2c_sandbox(
-    static_cast<uint32_t>(override_max_wasm_pages));
-  FALLIBLE_DYNAMIC_CHECK(
-    infallible, sandbox != nullptr, "Sandbox could not be created");
+  // Reuse the instance and heap reservation of a destroyed sandbox if possible
+  const bool fresh_instance =
+    !take_cached_instance(static_cast<uint32_t>(override_max_wasm_pages));
+  if (fresh_instance) {
+    sandbox = sandbox_info.create_wasm2c_sandbox(
+      static_cast<uint32_t>(override_max_wasm_pages));
+    FALLIBLE_DYNAMIC_CHECK(
+      infallible, sandbox != nullptr, "Sandbox could not be created");
 
-  sandbox_memory_info =
-    (wasm_rt_memory_t*)sandbox_info.lookup_wasm2c_nonfunc_export(sandbox,
-                                                                 "w2c_memory");
-  FALLIBLE_DYNAMIC_CHECK(infallible,
-                         sandbox_memory_info != nullptr,
-                         "Could not get wasm2c sandbox memory info");
+    sandbox_memory_info =
+      (wasm_rt_memory_t*)sandbox_info.lookup_wasm2c_nonfunc_export(
+        sandbox, "w2c_memory");
+    FALLIBLE_DYNAMIC_CHECK(infallible,
+                           sandbox_memory_info != nullptr,
+                           "Could not get wasm2c sandbox memory info");
+  }
 
   heap_base = reinterpret_cast<uintptr_t>(impl_get_memory_location());
 
@@ -138,37 +170,149 @@ bool rlbox_wasm2c_sandbox::impl_create_sandbox(
   // cache these for performance
   exec_env = sandbox;
 #ifndef RLBOX_USE_STATIC_CALLS
-  malloc_index = impl_lookup_symbol("malloc");
-  free_index = impl_lookup_symbol("free");
+  malloc_index = loaded_module->get_export("w2c_malloc");
+  free_index = loaded_module->get_export("w2c_free");
+  malloc_bulk_index = loaded_module->get_export("w2c_rlbox_malloc_bulk");
+  free_bulk_index = loaded_module->get_export("w2c_rlbox_free_bulk");
+  batch_dispatch_index =
+    loaded_module->get_export("w2c_rlbox_batch_dispatch");
 #else
   malloc_index = rlbox_wasm2c_sandbox_lookup_symbol(malloc);
   free_index = rlbox_wasm2c_sandbox_lookup_symbol(free);
 #endif
+
+  if (fresh_instance) {
+    save_initial_state();
+  }
+  // While the memory is still the module's initial memory
+  record_module_identity();
+
+  if (preinit_image_path != nullptr) {
+    std::string image_error_msg;
+    bool loaded = impl_load_preinit_image(preinit_image_path, image_error_msg);
+    FALLIBLE_DYNAMIC_CHECK(infallible, loaded, image_error_msg.c_str());
+  }
+
+  // After the image is loaded, as it may change the globals looked up here
+  if (eager_bind != nullptr) {
+    std::string bind_error_msg;
+    bool bound = apply_eager_bind(*eager_bind, bind_error_msg);
+    FALLIBLE_DYNAMIC_CHECK(infallible, bound, bind_error_msg.c_str());
+  }
   return true;
 }
 
 #undef FALLIBLE_DYNAMIC_CHECK
 
-inline void rlbox_wasm2c_sandbox::impl_destroy_sandbox()
+inline bool rlbox_wasm2c_sandbox::apply_eager_bind(
+  const rlbox_wasm2c_eager_bind& options,
+  std::string& error_msg)
 {
-  if (return_slot_size) {
-    impl_free_in_sandbox(return_slot);
+#ifndef RLBOX_USE_STATIC_CALLS
+  // Statically linked exports are bound by the linker
+  for (size_t i = 0; i < options.export_count; i++) {
+    if (impl_lookup_symbol(options.exports[i]) == nullptr) {
+      error_msg = "wasm2c could not find export ";
+      error_msg += options.exports[i];
+      return false;
+    }
+  }
+#endif
+
+  for (size_t i = 0; i < options.signature_count; i++) {
+    options.signatures[i](*this);
   }
 
+  if (options.touch_code) {
+    auto touch = [&] {
+      rlbox_touch_code_pages(
+        reinterpret_cast<const void*>(sandbox_info.create_wasm2c_sandbox));
+    };
+#ifndef RLBOX_USE_STATIC_CALLS
+    // The code is shared by the sandboxes of the module, so only the first
+    // eagerly bound sandbox touches it
+    std::call_once(loaded_module->code_touched, touch);
+#else
+    static std::once_flag code_touched;
+    std::call_once(code_touched, touch);
+#endif
+  }
+  return true;
+}
+
+/**
+ * @brief whether the module's symbols were bound when it was loaded. This is
+ * false for a sandbox created with eager_bind while another sandbox of the
+ * module, which loaded it lazily, was still alive.
+ */
+inline bool rlbox_wasm2c_sandbox::impl_is_bound_eagerly() const
+{
+#ifndef RLBOX_USE_STATIC_CALLS
+  return loaded_module != nullptr && loaded_module->is_bound_eagerly();
+#else
+  // Statically linked, so the linker binds the symbols
+  return true;
+#endif
+}
+
+inline void rlbox_wasm2c_sandbox::impl_destroy_sandbox()
+{
+  // The instance may be reused, which must not see granted memory
+  revoke_all_grants();
+  scratch_arena.release([&](T_PointerType p) { impl_free_in_sandbox(p); });
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+  host_allocator.release([&](T_PointerType p) { free_in_guest(p); });
+#endif
+
   if (sandbox != nullptr) {
-    sandbox_info.destroy_wasm2c_sandbox(sandbox);
+    if (!retire_instance()) {
+      sandbox_info.destroy_wasm2c_sandbox(sandbox);
+    }
     sandbox = nullptr;
   }
 
 #ifndef RLBOX_USE_STATIC_CALLS
-  if (library != nullptr) {
-#  if defined(_WIN32)
-    FreeLibrary((HMODULE)library);
-#  else
-    dlclose(library);
-#  endif
+  // The globals were in the destroyed instance's heap
+  global_exports.clear();
+  if (loaded_module != nullptr) {
+    rlbox_module_registry<wasm2c_sandbox_funcs_t>::release(loaded_module);
+    loaded_module = nullptr;
     library = nullptr;
   }
 #endif
+
+  reset_snapshot.clear();
+  {
+    RLBOX_ACQUIRE_UNIQUE_GUARD(callback_lock, callback_mutex);
+    // The next sandbox created with this object may load another module
+    func_type_indices.clear();
+    // No thread uses the sandbox while it is destroyed, so none can hold the
+    // tables the swizzling maps retired
+    func_type_indices.reclaim();
+    internal_callbacks.reclaim();
+    slot_assignments.reclaim();
+  }
 }
+
+/**
+ * @brief records the current state of the sandbox so that impl_reset_sandbox
+ * can later return the sandbox to this state. This is typically called right
+ * after the sandbox is created.
+ */
+inline void rlbox_wasm2c_sandbox::impl_save_reset_state()
+{
+  impl_take_snapshot(reset_snapshot);
+}
+
+/**
+ * @brief returns the sandbox to the state recorded by the last call to
+ * impl_save_reset_state. See impl_restore_snapshot for restrictions.
+ */
+inline void rlbox_wasm2c_sandbox::impl_reset_sandbox()
+{
+  detail::dynamic_check(!reset_snapshot.empty(),
+                        "Sandbox reset state was not saved");
+  impl_restore_snapshot(reset_snapshot);
+}
+
 } // namespace rlbox
\ No newline at end of file
@@ -0,0 +1,559 @@
+#pragma once
+
+#include "wasm-rt.h"
+
+// Pull the helper header from the main repo for dynamic_check and scope_exit
+#include "rlbox_helpers.hpp"
+#include "rlbox_wasm2c_sandbox.hpp"
+#include "wasm2c_details.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace rlbox {
+
+namespace wasm2c_snapshot_detail {
+  // Header of a pre-initialized memory image. The values of the globals named
+  // in RLBOX_WASM2C_RESET_GLOBALS follow the header. The memory contents follow
+  // at preinit_image_data_offset, which is a multiple of the page size on all
+  // platforms so that the contents can be mapped directly from the file.
+  struct preinit_image_header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t pages;
+    uint64_t size;
+    // Identity of the module the image was written from, see
+    // record_module_identity
+    uint64_t module_identity;
+    uint32_t global_count;
+    uint32_t reserved;
+  };
+
+  static constexpr char preinit_image_magic[8] = "RLBXW2C";
+  static constexpr uint32_t preinit_image_version = 3;
+  static constexpr uint64_t preinit_image_data_offset = 65536;
+  static constexpr uint32_t preinit_image_max_globals =
+    (preinit_image_data_offset - sizeof(preinit_image_header)) /
+    sizeof(uint32_t);
+
+  // FNV-1a over 8 byte words, which is enough to tell builds of a module apart
+  inline uint64_t hash_memory(const uint8_t* data, size_t size)
+  {
+    const uint64_t prime = 1099511628211ULL;
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ size) * prime;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      hash = (hash ^ word) * prime;
+    }
+    for (; i < size; i++) {
+      hash = (hash ^ data[i]) * prime;
+    }
+    return hash;
+  }
+
+  // Find the globals named in RLBOX_WASM2C_RESET_GLOBALS in an instance.
+  // Returns false if the instance does not export one of them.
+  inline bool find_reset_globals(const wasm2c_sandbox_funcs_t& info,
+                                 void* sandbox,
+                                 std::vector<uint32_t*>& globals)
+  {
+    static const std::vector<std::string> names = {
+      RLBOX_WASM2C_RESET_GLOBALS
+    };
+    globals.clear();
+    for (const auto& name : names) {
+      std::string prefixed_name = "w2c_" + name;
+      auto global = static_cast<uint32_t*>(
+        info.lookup_wasm2c_nonfunc_export(sandbox, prefixed_name.c_str()));
+      if (global == nullptr) {
+        return false;
+      }
+      globals.push_back(global);
+    }
+    return true;
+  }
+
+#if !defined(_WIN32)
+  inline size_t get_os_page_size()
+  {
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+  }
+
+  // Create an anonymous file that holds a snapshot. Returns -1 on failure.
+  inline int create_backing_file()
+  {
+#  if defined(__linux__)
+    return memfd_create("rlbox_wasm2c_snapshot", MFD_CLOEXEC);
+#  else
+    const char* tmp_dir = getenv("TMPDIR");
+    std::string path = tmp_dir ? tmp_dir : "/tmp";
+    path += "/rlbox_wasm2c_snapshot_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd != -1) {
+      unlink(path.c_str());
+    }
+    return fd;
+#  endif
+  }
+
+  inline bool write_backing_file(int fd, const uint8_t* data, size_t size)
+  {
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      return false;
+    }
+    size_t written = 0;
+    while (written < size) {
+      ssize_t ret = pwrite(
+        fd, data + written, size - written, static_cast<off_t>(written));
+      if (ret <= 0) {
+        return false;
+      }
+      written += static_cast<size_t>(ret);
+    }
+    return true;
+  }
+#endif
+} // namespace wasm2c_snapshot_detail
+
+rlbox_wasm2c_snapshot::rlbox_wasm2c_snapshot(
+  rlbox_wasm2c_snapshot&& other) noexcept
+{
+  *this = std::move(other);
+}
+
+rlbox_wasm2c_snapshot& rlbox_wasm2c_snapshot::operator=(
+  rlbox_wasm2c_snapshot&& other) noexcept
+{
+  if (this != &other) {
+    clear();
+#if !defined(_WIN32)
+    backing_fd = std::exchange(other.backing_fd, -1);
+    backing_offset = std::exchange(other.backing_offset, 0);
+#endif
+    image = std::move(other.image);
+    size = std::exchange(other.size, 0);
+    pages = std::exchange(other.pages, 0);
+    globals = std::move(other.globals);
+  }
+  return *this;
+}
+
+rlbox_wasm2c_snapshot::~rlbox_wasm2c_snapshot()
+{
+  clear();
+}
+
+void rlbox_wasm2c_snapshot::clear()
+{
+#if !defined(_WIN32)
+  if (backing_fd != -1) {
+    close(backing_fd);
+    backing_fd = -1;
+  }
+  backing_offset = 0;
+#endif
+  image.clear();
+  image.shrink_to_fit();
+  size = 0;
+  pages = 0;
+  globals.clear();
+}
+
+// Grow or shrink the accessible part of the heap in the same way the wasm2c
+// runtime grows memory. Pages that are no longer accessible are released.
+inline void rlbox_wasm2c_sandbox::set_memory_accessible_size(size_t old_size,
+                                                             size_t new_size)
+{
+  auto data = reinterpret_cast<uint8_t*>(impl_get_memory_location());
+  if (new_size < old_size) {
+#if defined(_WIN32)
+    VirtualFree(data + new_size, old_size - new_size, MEM_DECOMMIT);
+#else
+    madvise(data + new_size, old_size - new_size, MADV_DONTNEED);
+    mprotect(data + new_size, old_size - new_size, PROT_NONE);
+#endif
+  } else if (new_size > old_size) {
+#if defined(_WIN32)
+    void* ret = VirtualAlloc(
+      data + old_size, new_size - old_size, MEM_COMMIT, PAGE_READWRITE);
+    detail::dynamic_check(ret != nullptr, "Could not grow sandbox memory");
+#else
+    int ret =
+      mprotect(data + old_size, new_size - old_size, PROT_READ | PROT_WRITE);
+    detail::dynamic_check(ret == 0, "Could not grow sandbox memory");
+#endif
+  }
+}
+
+/**
+ * @brief records an identity of the module's build in the sandbox, which
+ * pre-initialized images are checked against. The identity is a hash of the
+ * module's initial linear memory, including its size, so it changes with the
+ * module's data segments and memory layout. It is computed once per module and
+ * must be called while the sandbox memory is still the initial memory.
+ */
+inline void rlbox_wasm2c_sandbox::record_module_identity()
+{
+  auto compute = [&] {
+    return wasm2c_snapshot_detail::hash_memory(
+      reinterpret_cast<const uint8_t*>(impl_get_memory_location()),
+      impl_get_total_memory());
+  };
+#ifndef RLBOX_USE_STATIC_CALLS
+  std::call_once(loaded_module->identity_computed,
+                 [&] { loaded_module->identity = compute(); });
+  module_identity = loaded_module->identity;
+#else
+  // There is only one statically linked module
+  static const uint64_t identity = compute();
+  module_identity = identity;
+#endif
+}
+
+/**
+ * @brief captures the linear memory of the sandbox and the globals named in
+ * RLBOX_WASM2C_RESET_GLOBALS in the given snapshot. The globals are left out if
+ * the module does not export all of them.
+ *
+ * Where possible, the sandbox memory is then mapped copy-on-write from the
+ * snapshot, so that a later impl_restore_snapshot only discards the pages the
+ * sandbox wrote in between instead of copying the whole heap. The sandbox must
+ * not have any granted host memory or mapped files, which remapping the memory
+ * would cut off from the host.
+ */
+inline void rlbox_wasm2c_sandbox::impl_take_snapshot(
+  rlbox_wasm2c_snapshot& snapshot)
+{
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    detail::dynamic_check(
+      grants.empty(),
+      "Cannot snapshot a sandbox with granted memory or mapped files");
+  }
+
+  snapshot.clear();
+
+  auto data = reinterpret_cast<uint8_t*>(impl_get_memory_location());
+  snapshot.size = impl_get_total_memory();
+  snapshot.pages = sandbox_memory_info->pages;
+
+  std::vector<uint32_t*> globals;
+  if (wasm2c_snapshot_detail::find_reset_globals(
+        sandbox_info, sandbox, globals)) {
+    for (uint32_t* global : globals) {
+      snapshot.globals.push_back(*global);
+    }
+  }
+
+#if !defined(_WIN32)
+  if (reinterpret_cast<uintptr_t>(data) %
+        wasm2c_snapshot_detail::get_os_page_size() ==
+      0) {
+    int fd = wasm2c_snapshot_detail::create_backing_file();
+    if (fd != -1 &&
+        wasm2c_snapshot_detail::write_backing_file(fd, data, snapshot.size)) {
+      void* mapped = mmap(data,
+                          snapshot.size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_FIXED,
+                          fd,
+                          0);
+      detail::dynamic_check(mapped == data,
+                            "Could not map sandbox memory from snapshot");
+      snapshot.backing_fd = fd;
+      return;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+#endif
+
+  snapshot.image.assign(data, data + snapshot.size);
+}
+
+/**
+ * @brief returns the linear memory of the sandbox to the state captured in the
+ * given snapshot, including its size, along with the globals named in
+ * RLBOX_WASM2C_RESET_GLOBALS. This also recovers a sandbox that trapped during
+ * an invocation, which leaves the stack pointer where the trap happened.
+ *
+ * This must not be called while an invocation into the sandbox is in progress.
+ * Other mutable globals and the function table are not restored, so callbacks
+ * registered after the snapshot was taken should be unregistered first.
+ * Restoring is not supported for sandboxes built with WASM_CHECK_SHADOW_MEMORY.
+ */
+inline void rlbox_wasm2c_sandbox::impl_restore_snapshot(
+  const rlbox_wasm2c_snapshot& snapshot)
+{
+  detail::dynamic_check(!snapshot.empty(), "Restoring an empty snapshot");
+  detail::dynamic_check(snapshot.pages <= sandbox_memory_info->max_pages,
+                        "Snapshot exceeds the max heap size of the sandbox");
+
+  // Restoring must not write to granted host memory
+  revoke_all_grants();
+
+  auto data = reinterpret_cast<uint8_t*>(impl_get_memory_location());
+  const size_t curr_size = impl_get_total_memory();
+
+#if !defined(_WIN32)
+  if (snapshot.backing_fd != -1) {
+    if (curr_size > snapshot.size) {
+      set_memory_accessible_size(curr_size, snapshot.size);
+    }
+    // Replacing the mapping drops all pages written since the snapshot, while
+    // untouched pages stay shared with the snapshot file
+    void* mapped = mmap(data,
+                        snapshot.size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED,
+                        snapshot.backing_fd,
+                        static_cast<off_t>(snapshot.backing_offset));
+    detail::dynamic_check(mapped == data, "Could not restore sandbox snapshot");
+  } else
+#endif
+  {
+    set_memory_accessible_size(curr_size, snapshot.size);
+    std::memcpy(data, snapshot.image.data(), snapshot.size);
+  }
+
+  sandbox_memory_info->pages = snapshot.pages;
+  sandbox_memory_info->size = snapshot.size;
+
+  if (!snapshot.globals.empty()) {
+    std::vector<uint32_t*> globals;
+    const bool found_globals = wasm2c_snapshot_detail::find_reset_globals(
+      sandbox_info, sandbox, globals);
+    detail::dynamic_check(
+      found_globals && globals.size() == snapshot.globals.size(),
+      "Snapshot globals are missing from the sandbox");
+    for (size_t i = 0; i < globals.size(); i++) {
+      *globals[i] = snapshot.globals[i];
+    }
+  }
+
+  // The scratch arena and host allocator region were allocated from the memory
+  // we just restored
+  scratch_arena.forget();
+#ifdef RLBOX_WASM2C_USE_HOST_ALLOCATOR
+  host_allocator.forget();
+#endif
+}
+
+/**
+ * @brief writes the current linear memory of the sandbox and the globals named
+ * in RLBOX_WASM2C_RESET_GLOBALS to a pre-initialized image, which
+ * impl_create_sandbox can later start new sandboxes from. This is meant to be
+ * called once the module's initialization code has run, so that sandboxes
+ * created from the image skip it. The image must be written while no
+ * invocation into the sandbox is in progress.
+ *
+ * The indirect function table is not saved. A new instance fills its table
+ * from the module's element segments, which the module identity check ties to
+ * the build the image was written from, and code compiled from C does not
+ * change the table afterwards. The only entries the host adds are callbacks,
+ * which point into the writing process, so the image must be written before
+ * any callbacks are registered.
+ *
+ * @return true when the image was written
+ */
+inline bool rlbox_wasm2c_sandbox::impl_write_preinit_image(
+  const char* image_path)
+{
+  wasm2c_snapshot_detail::preinit_image_header header{};
+  std::memcpy(header.magic,
+              wasm2c_snapshot_detail::preinit_image_magic,
+              sizeof(header.magic));
+  header.version = wasm2c_snapshot_detail::preinit_image_version;
+  header.pages = sandbox_memory_info->pages;
+  header.size = impl_get_total_memory();
+  header.module_identity = module_identity;
+
+  std::vector<uint32_t> global_values;
+  std::vector<uint32_t*> globals;
+  if (wasm2c_snapshot_detail::find_reset_globals(
+        sandbox_info, sandbox, globals)) {
+    for (uint32_t* global : globals) {
+      global_values.push_back(*global);
+    }
+  }
+  if (global_values.size() >
+      wasm2c_snapshot_detail::preinit_image_max_globals) {
+    return false;
+  }
+  header.global_count = static_cast<uint32_t>(global_values.size());
+
+  std::ofstream image(image_path, std::ios::binary | std::ios::trunc);
+  if (!image) {
+    return false;
+  }
+  image.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  const size_t globals_size = global_values.size() * sizeof(uint32_t);
+  image.write(reinterpret_cast<const char*>(global_values.data()),
+              globals_size);
+  std::vector<char> padding(wasm2c_snapshot_detail::preinit_image_data_offset -
+                              sizeof(header) - globals_size,
+                            0);
+  image.write(padding.data(), padding.size());
+  image.write(reinterpret_cast<const char*>(impl_get_memory_location()),
+              header.size);
+  image.close();
+  return image.good();
+}
+
+/**
+ * @brief replaces the linear memory and the RLBOX_WASM2C_RESET_GLOBALS of the
+ * sandbox with the contents of an image written by impl_write_preinit_image.
+ * Where possible the image is mapped copy-on-write, so pages the sandbox never
+ * writes stay shared between all sandboxes started from the image. Images
+ * written from another build of the module, and images shorter than their
+ * header claims, are rejected.
+ *
+ * @return true when the image was loaded, false with error_msg set otherwise
+ */
+inline bool rlbox_wasm2c_sandbox::impl_load_preinit_image(
+  const char* image_path,
+  std::string& error_msg)
+{
+  wasm2c_snapshot_detail::preinit_image_header header{};
+  rlbox_wasm2c_snapshot snapshot;
+
+#if !defined(_WIN32)
+  int fd = open(image_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    error_msg = "Could not open wasm2c pre-initialized image";
+    return false;
+  }
+  // The snapshot closes the file once the image is restored
+  snapshot.backing_fd = fd;
+  snapshot.backing_offset = wasm2c_snapshot_detail::preinit_image_data_offset;
+  bool header_read =
+    pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+  struct stat image_stat;
+  const uint64_t image_size =
+    fstat(fd, &image_stat) == 0 ? static_cast<uint64_t>(image_stat.st_size) : 0;
+#else
+  std::ifstream image(image_path, std::ios::binary);
+  if (!image) {
+    error_msg = "Could not open wasm2c pre-initialized image";
+    return false;
+  }
+  image.read(reinterpret_cast<char*>(&header), sizeof(header));
+  bool header_read = image.good();
+  image.seekg(0, std::ios::end);
+  const uint64_t image_size =
+    image.good() ? static_cast<uint64_t>(image.tellg()) : 0;
+#endif
+
+  if (!header_read ||
+      std::memcmp(header.magic,
+                  wasm2c_snapshot_detail::preinit_image_magic,
+                  sizeof(header.magic)) != 0 ||
+      header.version != wasm2c_snapshot_detail::preinit_image_version ||
+      header.size != static_cast<uint64_t>(header.pages) * 65536 ||
+      header.global_count > wasm2c_snapshot_detail::preinit_image_max_globals) {
+    error_msg = "Invalid wasm2c pre-initialized image";
+    return false;
+  }
+  // A truncated image would otherwise be mapped past the end of the file, and
+  // the sandbox would fault on the missing pages
+  if (image_size <
+      wasm2c_snapshot_detail::preinit_image_data_offset + header.size) {
+    error_msg = "wasm2c pre-initialized image is truncated";
+    return false;
+  }
+  if (header.module_identity != module_identity) {
+    error_msg =
+      "wasm2c pre-initialized image was written from a different module build";
+    return false;
+  }
+  if (header.pages == 0 || header.pages > sandbox_memory_info->max_pages) {
+    error_msg = "wasm2c pre-initialized image exceeds the max heap size";
+    return false;
+  }
+  snapshot.pages = header.pages;
+  snapshot.size = static_cast<size_t>(header.size);
+
+  if (header.global_count != 0) {
+    std::vector<uint32_t*> globals;
+    if (!wasm2c_snapshot_detail::find_reset_globals(
+          sandbox_info, sandbox, globals) ||
+        globals.size() != header.global_count) {
+      error_msg = "wasm2c pre-initialized image globals do not match the "
+                  "sandbox's RLBOX_WASM2C_RESET_GLOBALS";
+      return false;
+    }
+    snapshot.globals.resize(header.global_count);
+    const size_t globals_size = snapshot.globals.size() * sizeof(uint32_t);
+#if !defined(_WIN32)
+    bool globals_read = pread(fd,
+                              snapshot.globals.data(),
+                              globals_size,
+                              sizeof(header)) == (ssize_t)globals_size;
+#else
+    image.clear();
+    image.seekg(sizeof(header));
+    image.read(reinterpret_cast<char*>(snapshot.globals.data()), globals_size);
+    bool globals_read = image.good();
+#endif
+    if (!globals_read) {
+      error_msg = "Could not read wasm2c pre-initialized image";
+      return false;
+    }
+  }
+
+#if !defined(_WIN32)
+  if (reinterpret_cast<uintptr_t>(impl_get_memory_location()) %
+        wasm2c_snapshot_detail::get_os_page_size() !=
+      0) {
+    // The heap cannot be mapped from the file, so read the image instead
+    snapshot.image.resize(snapshot.size);
+    size_t read_size = 0;
+    while (read_size < snapshot.size) {
+      ssize_t ret = pread(
+        fd,
+        snapshot.image.data() + read_size,
+        snapshot.size - read_size,
+        static_cast<off_t>(snapshot.backing_offset + read_size));
+      if (ret <= 0) {
+        error_msg = "Could not read wasm2c pre-initialized image";
+        return false;
+      }
+      read_size += static_cast<size_t>(ret);
+    }
+    snapshot.backing_offset = 0;
+    close(std::exchange(snapshot.backing_fd, -1));
+  }
+#else
+  image.seekg(wasm2c_snapshot_detail::preinit_image_data_offset);
+  snapshot.image.resize(snapshot.size);
+  image.read(reinterpret_cast<char*>(snapshot.image.data()), snapshot.size);
+  if (!image.good()) {
+    error_msg = "Could not read wasm2c pre-initialized image";
+    return false;
+  }
+#endif
+
+  impl_restore_snapshot(snapshot);
+  return true;
+}
+
+} // namespace rlbox
@@ -57,19 +57,44 @@ inline void* rlbox_wasm2c_sandbox::impl_get_memory_location() const
   return sandbox_memory_info->data;
 }
 
+/**
+ * @brief copies len bytes from the host buffer src to dst in sandbox memory.
+ * The whole destination range is checked against the sandbox memory once, so
+ * callers need not convert the pointer of each element.
+ */
+inline void rlbox_wasm2c_sandbox::impl_copy_to_sandbox(T_PointerType dst,
+                                                       const void* src,
+                                                       size_t len)
+{
+  const size_t total = impl_get_total_memory();
+  detail::dynamic_check(len <= total && dst <= total - len,
+                        "Copy to sandbox out of sandbox memory bounds");
+  rlbox_bulk_copy(
+    static_cast<char*>(impl_get_memory_location()) + dst, src, len);
+}
+
+/**
+ * @brief copies len bytes from src in sandbox memory to the host buffer dst,
+ * checking the whole source range once.
+ */
+inline void rlbox_wasm2c_sandbox::impl_copy_from_sandbox(void* dst,
+                                                         T_PointerType src,
+                                                         size_t len)
+{
+  const size_t total = impl_get_total_memory();
+  detail::dynamic_check(len <= total && src <= total - len,
+                        "Copy from sandbox out of sandbox memory bounds");
+  rlbox_bulk_copy(
+    dst, static_cast<const char*>(impl_get_memory_location()) + src, len);
+}
+
 template<typename T>
 inline void* rlbox_wasm2c_sandbox::impl_get_unsandboxed_pointer(
   T_PointerType p) const
 {
   if constexpr (std::is_function_v<std::remove_pointer_t<T>>) {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
     auto found = slot_assignments.find(p);
-    if (found != slot_assignments.end()) {
-      auto ret = found->second;
-      return const_cast<void*>(ret);
-    } else {
-      return nullptr;
-    }
+    return found ? const_cast<void*>(*found) : nullptr;
   } else {
     return reinterpret_cast<void*>(heap_base + p);
   }
@@ -80,22 +105,25 @@ inline rlbox_wasm2c_sandbox::T_PointerType
 rlbox_wasm2c_sandbox::impl_get_sandboxed_pointer(const void* p) const
 {
   if constexpr (std::is_function_v<std::remove_pointer_t<T>>) {
-    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
-
-    uint32_t slot_number = 0;
     auto found = internal_callbacks.find(p);
-    if (found != internal_callbacks.end()) {
-      slot_number = found->second;
-    } else {
+    if (found) {
+      return static_cast<T_PointerType>(*found);
+    }
 
-      auto func_type_idx = get_wasm2c_func_index(static_cast<T>(nullptr));
-      slot_number = sandbox_info.add_wasm2c_callback(sandbox,
-                                                     func_type_idx,
-                                                     const_cast<void*>(p),
-                                                     WASM_RT_INTERNAL_FUNCTION);
-      internal_callbacks[p] = slot_number;
-      slot_assignments[slot_number] = p;
+    RLBOX_ACQUIRE_UNIQUE_GUARD(lock, callback_mutex);
+    // Another thread may have added the function since the lookup
+    found = internal_callbacks.find(p);
+    if (found) {
+      return static_cast<T_PointerType>(*found);
     }
+    auto func_type_idx = get_wasm2c_func_index(static_cast<T>(nullptr));
+    uint32_t slot_number =
+      sandbox_info.add_wasm2c_callback(sandbox,
+                                       func_type_idx,
+                                       const_cast<void*>(p),
+                                       WASM_RT_INTERNAL_FUNCTION);
+    internal_callbacks.insert(p, slot_number);
+    slot_assignments.insert(slot_number, p);
     return static_cast<T_PointerType>(slot_number);
   } else {
     if constexpr (sizeof(uintptr_t) == sizeof(uint32_t)) {
@@ -0,0 +1,233 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#define RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "libtest.h"
+#include "rlbox.hpp"
+#include "rlbox_concurrent_map.hpp"
+#include "rlbox_export_cache.hpp"
+#include "rlbox_sandbox_session.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+// NOLINTNEXTLINE
+#if defined(_WIN32)
+#  define CreateSandbox(sandbox) sandbox.create_sandbox(L"" GLUE_LIB_WASM2C_PATH)
+#else
+#  define CreateSandbox(sandbox) sandbox.create_sandbox(GLUE_LIB_WASM2C_PATH)
+#endif
+
+using T_Sandbox = rlbox::rlbox_sandbox<rlbox::rlbox_wasm2c_sandbox>;
+
+static const unsigned long invocations = 1000;
+
+static unsigned long invoke_add(T_Sandbox& sandbox)
+{
+  unsigned long sum = 0;
+  for (unsigned long i = 0; i < invocations; i++) {
+    sum += sandbox.invoke_sandbox_function(simpleAddNoPrintTest, sum, i)
+             .UNSAFE_unverified();
+  }
+  return sum;
+}
+
+TEST_CASE("wasm2c invocation with and without a session", "[!benchmark]")
+{
+  T_Sandbox sandbox;
+  CreateSandbox(sandbox);
+
+  BENCHMARK("1000 invocations") { return invoke_add(sandbox); };
+
+  BENCHMARK("1000 invocations in a session")
+  {
+    rlbox::rlbox_sandbox_session<rlbox::rlbox_wasm2c_sandbox> session(sandbox);
+    return invoke_add(sandbox);
+  };
+
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm2c symbol lookup by name", "[!benchmark]")
+{
+  T_Sandbox sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  // After the first lookup, each name is served from the export cache
+  // instead of dlsym
+  BENCHMARK("1000 function lookups")
+  {
+    uintptr_t sum = 0;
+    for (unsigned long i = 0; i < invocations; i++) {
+      sum += reinterpret_cast<uintptr_t>(
+        plugin->impl_lookup_symbol("simpleAddNoPrintTest"));
+    }
+    return sum;
+  };
+
+  BENCHMARK("1000 function lookups with a compile time hash")
+  {
+    constexpr uint64_t hash =
+      rlbox::rlbox_export_name_hash("simpleAddNoPrintTest");
+    uintptr_t sum = 0;
+    for (unsigned long i = 0; i < invocations; i++) {
+      sum += reinterpret_cast<uintptr_t>(
+        plugin->impl_lookup_symbol(hash, "simpleAddNoPrintTest"));
+    }
+    return sum;
+  };
+
+  BENCHMARK("1000 global lookups")
+  {
+    uintptr_t sum = 0;
+    for (unsigned long i = 0; i < invocations; i++) {
+      sum += reinterpret_cast<uintptr_t>(plugin->impl_lookup_symbol("errno"));
+    }
+    return sum;
+  };
+
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm2c bulk copy into and out of the sandbox", "[!benchmark]")
+{
+  T_Sandbox sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  for (size_t len = 64; len <= 64 * 1024 * 1024; len *= 16) {
+    std::vector<char> host(len, 1);
+    auto buf = sandbox.malloc_in_sandbox<char>(static_cast<uint32_t>(len));
+    REQUIRE(buf != nullptr);
+    auto buf_ptr = plugin->impl_get_sandboxed_pointer<char*>(
+      buf.unverified_safe_pointer_because(len, "benchmarking"));
+    const std::string size = std::to_string(len) + " bytes";
+
+    BENCHMARK("memcpy to sandbox " + size)
+    {
+      std::memcpy(plugin->impl_get_unsandboxed_pointer<char*>(buf_ptr),
+                  host.data(),
+                  len);
+      return host[0];
+    };
+    BENCHMARK("copy_to_sandbox " + size)
+    {
+      plugin->impl_copy_to_sandbox(buf_ptr, host.data(), len);
+      return host[0];
+    };
+    BENCHMARK("copy_from_sandbox " + size)
+    {
+      plugin->impl_copy_from_sandbox(host.data(), buf_ptr, len);
+      return host[0];
+    };
+
+    sandbox.free_in_sandbox(buf);
+  }
+
+  sandbox.destroy_sandbox();
+}
+
+// Runs lookup on the given number of threads, each doing 100000 lookups
+template<typename T_Lookup>
+static uintptr_t contended_lookups(unsigned threads, T_Lookup&& lookup)
+{
+  std::atomic<uintptr_t> total{ 0 };
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      uintptr_t sum = 0;
+      for (uint32_t i = 0; i < 100000; i++) {
+        sum += lookup((i + t) % 128);
+      }
+      total += sum;
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return total.load();
+}
+
+TEST_CASE("function pointer swizzling table under contention", "[!benchmark]")
+{
+  // The tables used before: a node based map under a lock
+  std::mutex lock;
+  std::map<uint32_t, const void*> locked_map;
+  rlbox::rlbox_concurrent_map<uint32_t, const void*> concurrent_map;
+  static char functions[128];
+  for (uint32_t i = 0; i < 128; i++) {
+    locked_map[i] = &functions[i];
+    concurrent_map.insert(i, &functions[i]);
+  }
+
+  for (unsigned threads = 1; threads <= 8; threads *= 2) {
+    const std::string name = std::to_string(threads) + " threads";
+    BENCHMARK("locked std::map " + name)
+    {
+      return contended_lookups(threads, [&](uint32_t slot) {
+        std::lock_guard<std::mutex> guard(lock);
+        return reinterpret_cast<uintptr_t>(locked_map.find(slot)->second);
+      });
+    };
+    BENCHMARK("rlbox_concurrent_map " + name)
+    {
+      return contended_lookups(threads, [&](uint32_t slot) {
+        return reinterpret_cast<uintptr_t>(*concurrent_map.find(slot));
+      });
+    };
+  }
+}
+
+static rlbox::tainted<int, rlbox::rlbox_wasm2c_sandbox> bench_callback(
+  T_Sandbox&,
+  rlbox::tainted<unsigned, rlbox::rlbox_wasm2c_sandbox> a,
+  rlbox::tainted<const char*, rlbox::rlbox_wasm2c_sandbox>,
+  rlbox::tainted<unsigned*, rlbox::rlbox_wasm2c_sandbox>)
+{
+  return static_cast<int>(a.UNSAFE_unverified() & 1);
+}
+
+TEST_CASE("wasm2c callback latency", "[!benchmark]")
+{
+  T_Sandbox sandbox;
+  CreateSandbox(sandbox);
+  auto callback = sandbox.register_callback(bench_callback);
+  auto str = sandbox.malloc_in_sandbox<char>(1);
+  *str = 0;
+
+  // The difference between the two is the cost of the callbacks
+  BENCHMARK("1000 invocations without a callback")
+  {
+    return invoke_add(sandbox);
+  };
+
+  BENCHMARK("1000 invocations with a callback")
+  {
+    unsigned long sum = 0;
+    for (unsigned i = 0; i < invocations; i++) {
+      sum += sandbox
+               .invoke_sandbox_function(simpleCallbackTest, i, str, callback)
+               .UNSAFE_unverified();
+    }
+    return sum;
+  };
+
+  sandbox.free_in_sandbox(str);
+  callback.unregister();
+  sandbox.destroy_sandbox();
+}
@@ -0,0 +1,122 @@
+// This translation unit must not define RLBOX_SINGLE_THREADED_INVOCATIONS, as
+// it measures callbacks dispatched by several threads running in one sandbox
+
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "rlbox_callback_slots.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// As many slots as a wasm2c sandbox has by default
+static const uint32_t callback_slot_count = 128;
+static const uint32_t dispatches = 100000;
+
+static uintptr_t dispatch_target(uint32_t a)
+{
+  return a & 1;
+}
+
+// The callback slots as they were before rlbox_callback_registrations: two
+// arrays read under a shared lock on the sandbox's callback mutex
+class locked_callback_registrations
+{
+private:
+  mutable std::shared_timed_mutex callback_mutex;
+  void* callbacks[callback_slot_count]{};
+  void* keys[callback_slot_count]{};
+
+public:
+  inline void publish(uint32_t slot, void* key, void* callback)
+  {
+    std::unique_lock<std::shared_timed_mutex> lock(callback_mutex);
+    keys[slot] = key;
+    callbacks[slot] = callback;
+  }
+
+  inline std::pair<void*, void*> read(uint32_t slot) const
+  {
+    std::shared_lock<std::shared_timed_mutex> lock(callback_mutex);
+    return std::make_pair(callbacks[slot], keys[slot]);
+  }
+};
+
+// Every thread dispatches through the same registrations, as the interceptors
+// of one sandbox do when several threads invoke it at once. Optionally, another
+// thread registers and unregisters a callback in its own slot meanwhile.
+template<typename T_Registrations>
+static uintptr_t contended_dispatch(T_Registrations& registrations,
+                                    unsigned threads,
+                                    bool churn)
+{
+  std::atomic<bool> done{ false };
+  std::thread writer;
+  if (churn) {
+    writer = std::thread([&] {
+      const uint32_t slot = callback_slot_count - 1;
+      while (!done.load(std::memory_order_relaxed)) {
+        registrations.publish(
+          slot, &registrations, reinterpret_cast<void*>(&dispatch_target));
+        registrations.publish(slot, nullptr, nullptr);
+      }
+    });
+  }
+
+  std::atomic<uintptr_t> total{ 0 };
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      uintptr_t sum = 0;
+      for (uint32_t i = 0; i < dispatches; i++) {
+        auto registration =
+          registrations.read((i + t) % (callback_slot_count - 1));
+        auto func = reinterpret_cast<uintptr_t (*)(uint32_t)>(
+          registration.first);
+        sum += func(i) + reinterpret_cast<uintptr_t>(registration.second);
+      }
+      total += sum;
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  done = true;
+  if (writer.joinable()) {
+    writer.join();
+  }
+  return total.load();
+}
+
+TEST_CASE("callback dispatch under contention", "[!benchmark]")
+{
+  locked_callback_registrations locked;
+  rlbox::rlbox_callback_registrations<callback_slot_count> versioned;
+  for (uint32_t i = 0; i < callback_slot_count - 1; i++) {
+    void* callback = reinterpret_cast<void*>(&dispatch_target);
+    locked.publish(i, nullptr, callback);
+    versioned.publish(i, nullptr, callback);
+  }
+
+  for (unsigned threads = 1; threads <= 8; threads *= 2) {
+    for (bool churn : { false, true }) {
+      const std::string name = std::to_string(threads) + " threads" +
+                               (churn ? " while registering" : "");
+      BENCHMARK("shared lock " + name)
+      {
+        return contended_dispatch(locked, threads, churn);
+      };
+      BENCHMARK("rlbox_callback_registrations " + name)
+      {
+        return contended_dispatch(versioned, threads, churn);
+      };
+    }
+  }
+}
@@ -0,0 +1,9 @@
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include "catch2/catch.hpp"
+
+// Provide the thread locals from a separate translation unit, as embedders do,
+// so that the benchmarks pay for the out of line getter
+#define RLBOX_EMBEDDER_PROVIDES_TLS_STATIC_VARIABLES
+#include "rlbox_wasm2c_sandbox.hpp"
+RLBOX_WASM2C_SANDBOX_STATIC_VARIABLES();
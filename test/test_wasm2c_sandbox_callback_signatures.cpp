@@ -0,0 +1,83 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_ENABLE_DEBUG_ASSERTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "rlbox.hpp"
+
+// Registers callbacks of 40 distinct signatures, about as many as a large
+// embedder uses. Each signature instantiates the callback interceptors of all
+// slots, so the size of this binary, as printed by the
+// size_callback_signatures target, tracks the code generated per signature.
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+#if defined(_WIN32)
+#  define CreateSandbox(sandbox) sandbox.create_sandbox(L"" GLUE_LIB_WASM2C_PATH)
+#else
+#  define CreateSandbox(sandbox) sandbox.create_sandbox(GLUE_LIB_WASM2C_PATH)
+#endif
+
+using TestType = rlbox::rlbox_wasm2c_sandbox;
+using T_Sandbox = rlbox::rlbox_sandbox<TestType>;
+
+using arg_types = std::tuple<int32_t, int64_t, float, double>;
+
+// Argument K of signature I, taking two bits of I per argument
+template<std::size_t I, std::size_t K>
+using arg_t = std::tuple_element_t<(I >> (2 * K)) & 3, arg_types>;
+
+template<std::size_t I, typename... T_Args>
+static rlbox::tainted<int32_t, TestType> signature_callback(
+  T_Sandbox&,
+  rlbox::tainted<T_Args, TestType>...)
+{
+  return static_cast<int32_t>(I);
+}
+
+// All 16 signatures with two arguments
+template<std::size_t I>
+static void register_two_args(T_Sandbox& sandbox)
+{
+  auto callback = sandbox.register_callback(
+    signature_callback<I, arg_t<I, 0>, arg_t<I, 1>>);
+  callback.unregister();
+}
+
+// 24 of the signatures with three arguments
+template<std::size_t I>
+static void register_three_args(T_Sandbox& sandbox)
+{
+  auto callback = sandbox.register_callback(
+    signature_callback<I, arg_t<I, 0>, arg_t<I, 1>, arg_t<I, 2>>);
+  callback.unregister();
+}
+
+template<std::size_t... Is, std::size_t... Js>
+static void register_all(T_Sandbox& sandbox,
+                         std::index_sequence<Is...>,
+                         std::index_sequence<Js...>)
+{
+  (register_two_args<Is>(sandbox), ...);
+  (register_three_args<Js>(sandbox), ...);
+}
+
+TEST_CASE("wasm sandbox 40 callback signatures", "[wasm_sandbox_tests]")
+{
+  T_Sandbox sandbox;
+  CreateSandbox(sandbox);
+
+  register_all(
+    sandbox, std::make_index_sequence<16>(), std::make_index_sequence<24>());
+
+  sandbox.destroy_sandbox();
+}
@@ -0,0 +1,93 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_ENABLE_DEBUG_ASSERTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <stdexcept>
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "libtest.h"
+#include "rlbox.hpp"
+#include "rlbox_sandbox_worker.hpp"
+
+// Built as C++20, to test the coroutine support of rlbox_sandbox_worker
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+#if defined(_WIN32)
+#  define TestSandboxPath L"" GLUE_LIB_WASM2C_PATH
+#else
+#  define TestSandboxPath GLUE_LIB_WASM2C_PATH
+#endif
+
+#ifndef RLBOX_SANDBOX_WORKER_COROUTINES
+#  error "Expected coroutine support in rlbox_sandbox_worker"
+#endif
+
+using T_Worker = rlbox::rlbox_sandbox_worker<rlbox::rlbox_wasm2c_sandbox>;
+
+// A coroutine that starts right away and is not awaited itself
+struct test_task
+{
+  struct promise_type
+  {
+    test_task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static test_task add_on_worker(
+  T_Worker& worker,
+  rlbox::rlbox_sandbox<rlbox::rlbox_wasm2c_sandbox>& sandbox,
+  std::promise<int>& result)
+{
+  const int sum = co_await worker.async([&] {
+    return sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+      .copy_and_verify([](int val) { return val; });
+  });
+  co_await worker.async([] {});
+  result.set_value(sum);
+}
+
+static test_task throw_on_worker(T_Worker& worker, std::promise<bool>& result)
+{
+  try {
+    co_await worker.async([]() -> int { throw std::runtime_error("failed"); });
+    result.set_value(false);
+  } catch (const std::runtime_error&) {
+    result.set_value(true);
+  }
+}
+
+TEST_CASE("wasm sandbox worker coroutines", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<rlbox::rlbox_wasm2c_sandbox> sandbox;
+  sandbox.create_sandbox(TestSandboxPath);
+
+  {
+    // Without an owner executor, coroutines resume on the worker thread
+    T_Worker worker(sandbox);
+
+    std::promise<int> sum;
+    auto sum_future = sum.get_future();
+    add_on_worker(worker, sandbox, sum);
+    REQUIRE(sum_future.get() == 5);
+
+    // Exceptions thrown on the worker are rethrown in the coroutine
+    std::promise<bool> caught;
+    auto caught_future = caught.get_future();
+    throw_on_worker(worker, caught);
+    REQUIRE(caught_future.get());
+  }
+
+  sandbox.destroy_sandbox();
+}
@@ -0,0 +1,305 @@
+#define RLBOX_USE_EXCEPTIONS
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+
+// Runs once in the next concurrent map lookup, between probing for the entry
+// and reading it
+static std::function<void()> concurrent_map_find_hook;
+#define RLBOX_CONCURRENT_MAP_FIND_HOOK()                                       \
+  if (concurrent_map_find_hook) {                                              \
+    auto hook = std::move(concurrent_map_find_hook);                           \
+    concurrent_map_find_hook = nullptr;                                        \
+    hook();                                                                    \
+  }
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "rlbox_callback_slots.hpp"
+#include "rlbox_concurrent_map.hpp"
+#include "rlbox_export_cache.hpp"
+#include "rlbox_host_allocator.hpp"
+#include "rlbox_scratch_arena.hpp"
+
+// Tests of the sandbox independent data structures, which need no sandbox and
+// so are only built once rather than for each sandbox configuration
+
+TEST_CASE("scratch arena", "[data_structures]")
+{
+  rlbox::rlbox_scratch_arena<uint32_t> arena;
+  int backing_allocations = 0;
+  auto allocate_backing = [&](size_t) {
+    backing_allocations++;
+    return uint32_t(0x1000);
+  };
+
+  {
+    rlbox::rlbox_scratch_arena<uint32_t>::scope outer(
+      arena, true, allocate_backing);
+    REQUIRE(outer.allocate(4) == 0x1000);
+    REQUIRE(outer.allocate(4) == 0x1010);
+    {
+      // Nested invocations on the same thread allocate above the outer ones
+      rlbox::rlbox_scratch_arena<uint32_t>::scope inner(
+        arena, true, allocate_backing);
+      REQUIRE(inner.allocate(8) == 0x1020);
+    }
+    REQUIRE(outer.allocate(RLBOX_SCRATCH_ARENA_SIZE) == 0);
+
+    // Other threads do not get the arena while it is in use
+    uint32_t other_alloc = 1;
+    std::thread([&] {
+      rlbox::rlbox_scratch_arena<uint32_t>::scope other(
+        arena, true, allocate_backing);
+      other_alloc = other.allocate(4);
+    }).join();
+    REQUIRE(other_alloc == 0);
+  }
+
+  {
+    rlbox::rlbox_scratch_arena<uint32_t>::scope again(
+      arena, true, allocate_backing);
+    REQUIRE(again.allocate(4) == 0x1000);
+  }
+  REQUIRE(backing_allocations == 1);
+}
+
+TEST_CASE("host allocator", "[data_structures]")
+{
+  using T_Allocator = rlbox::rlbox_host_allocator<uint32_t>;
+  T_Allocator allocator;
+  int region_allocations = 0;
+  auto allocate_region = [&](size_t) {
+    region_allocations++;
+    return uint32_t(0x10000);
+  };
+
+  uint32_t a = allocator.allocate(10, allocate_region);
+  uint32_t b = allocator.allocate(16, allocate_region);
+  uint32_t c = allocator.allocate(100, allocate_region);
+  REQUIRE(a == 0x10000);
+  REQUIRE(b == 0x10010);
+  // Different size classes come from different spans
+  REQUIRE(c == 0x11000);
+  REQUIRE(region_allocations == 1);
+
+  // Large allocations and pointers outside the region use the sandbox malloc
+  REQUIRE(allocator.allocate(T_Allocator::max_block_size + 1,
+                             allocate_region) == 0);
+  REQUIRE(!allocator.deallocate(0x8000));
+
+  // Freed blocks are reused
+  REQUIRE(allocator.deallocate(b));
+  REQUIRE_THROWS(allocator.deallocate(b));
+  REQUIRE(allocator.allocate(12, allocate_region) == b);
+
+  int region_frees = 0;
+  allocator.release([&](uint32_t p) {
+    REQUIRE(p == 0x10000);
+    region_frees++;
+  });
+  REQUIRE(region_frees == 1);
+  REQUIRE(!allocator.deallocate(a));
+}
+
+TEST_CASE("concurrent map", "[data_structures]")
+{
+  rlbox::rlbox_concurrent_map<uint32_t, uint32_t> map;
+  REQUIRE(!map.find(1));
+
+  // Enough entries to grow the table while readers use it
+  const uint32_t count = 1000;
+  std::atomic<bool> done{ false };
+  bool readers_ok = true;
+  std::thread reader([&] {
+    while (!done.load()) {
+      for (uint32_t i = 0; i < count; i++) {
+        auto found = map.find(i);
+        if (found && *found != i * 2) {
+          readers_ok = false;
+        }
+      }
+    }
+  });
+  for (uint32_t i = 0; i < count; i++) {
+    map.insert(i, i * 2);
+  }
+  done = true;
+  reader.join();
+  REQUIRE(readers_ok);
+  REQUIRE(map.size() == count);
+  REQUIRE(*map.find(count - 1) == (count - 1) * 2);
+
+  REQUIRE(map.erase(5));
+  REQUIRE(!map.erase(5));
+  REQUIRE(!map.find(5));
+  map.insert(5, 1);
+  REQUIRE(*map.find(5) == 1);
+
+  map.clear();
+  REQUIRE(map.size() == 0);
+  REQUIRE(!map.find(5));
+  size_t visited = 0;
+  map.for_each([&](uint32_t, uint32_t) { visited++; });
+  REQUIRE(visited == 0);
+
+  // Churn leaves tombstones, which copies of the table drop
+  bool erased = true;
+  for (uint32_t i = 0; i < 100000; i++) {
+    map.insert(i, i);
+    erased = map.erase(i) && erased;
+  }
+  REQUIRE(erased);
+  map.insert(7, 8);
+  map.reclaim();
+  REQUIRE(map.size() == 1);
+  REQUIRE(*map.find(7) == 8);
+}
+
+TEST_CASE("concurrent map lookup racing with writes", "[data_structures]")
+{
+  using T_Map = rlbox::rlbox_concurrent_map<uint32_t, uint32_t>;
+  T_Map map;
+  // Creates a table of the minimum capacity, 64 entries
+  map.insert(0, 1);
+  const size_t mask = 63;
+
+  // Two keys whose probes start at the same empty entry
+  uint32_t key = 1;
+  while ((T_Map::hash(key) & mask) == (T_Map::hash(0) & mask)) {
+    key++;
+  }
+  uint32_t other = key + 1;
+  while ((T_Map::hash(other) & mask) != (T_Map::hash(key) & mask)) {
+    other++;
+  }
+
+  // The entry seen empty gets another key before it is read
+  concurrent_map_find_hook = [&] { map.insert(other, 2); };
+  REQUIRE(!map.find(key));
+  REQUIRE(*map.find(other) == 2);
+
+  // The entry found is erased before it is read
+  concurrent_map_find_hook = [&] { map.erase(other); };
+  REQUIRE(!map.find(other));
+  REQUIRE(!concurrent_map_find_hook);
+}
+
+TEST_CASE("callback slots", "[data_structures]")
+{
+  rlbox::rlbox_callback_slots<2> slots;
+  int keys[3];
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint32_t c = 0;
+  REQUIRE(slots.allocate(&keys[0], a));
+  REQUIRE(slots.allocate(&keys[1], b));
+  REQUIRE(a == 0);
+  REQUIRE(b == 1);
+  REQUIRE(!slots.allocate(&keys[2], c));
+
+  // Freed slots are reused
+  uint32_t released = 2;
+  REQUIRE(slots.release(&keys[0], released));
+  REQUIRE(released == a);
+  REQUIRE(!slots.release(&keys[0], released));
+  REQUIRE(slots.allocate(&keys[2], c));
+  REQUIRE(c == a);
+  REQUIRE(slots.size() == 2);
+
+  // A key registered twice holds two slots until both are released
+  slots.clear();
+  REQUIRE(slots.allocate(&keys[0], a));
+  REQUIRE(slots.allocate(&keys[0], b));
+  REQUIRE(a != b);
+  REQUIRE(slots.size() == 2);
+  REQUIRE(slots.release(&keys[0], released));
+  REQUIRE(slots.release(&keys[0], released));
+  REQUIRE(!slots.release(&keys[0], released));
+  REQUIRE(slots.size() == 0);
+  REQUIRE(slots.allocate(&keys[1], c));
+  REQUIRE(slots.allocate(&keys[2], c));
+
+  constexpr auto table =
+    rlbox::make_callback_table<3>([](auto I) { return I.value * 2; });
+  static_assert(table[2] == 4, "Table entries are computed per index");
+}
+
+TEST_CASE("callback registrations", "[data_structures]")
+{
+  rlbox::rlbox_callback_registrations<2> registrations;
+  REQUIRE(registrations.read(0).first == nullptr);
+
+  // Readers of a slot that is reused concurrently never see the callback of
+  // one registration with the key of another
+  static char callbacks[64];
+  static char keys[64];
+  std::atomic<bool> done{ false };
+  bool readers_ok = true;
+  std::thread reader([&] {
+    while (!done.load()) {
+      auto registration = registrations.read(0);
+      auto callback = static_cast<char*>(registration.first);
+      auto key = static_cast<char*>(registration.second);
+      if ((callback == nullptr) != (key == nullptr) ||
+          (callback != nullptr && callback - callbacks != key - keys)) {
+        readers_ok = false;
+      }
+    }
+  });
+  for (int round = 0; round < 10000; round++) {
+    const int i = round % 64;
+    registrations.publish(0, &keys[i], &callbacks[i]);
+    registrations.clear(0);
+  }
+  done = true;
+  reader.join();
+  REQUIRE(readers_ok);
+
+  registrations.publish(1, &keys[1], &callbacks[1]);
+  REQUIRE(registrations.read(1).first == &callbacks[1]);
+  REQUIRE(registrations.read(1).second == &keys[1]);
+  REQUIRE(registrations.read(0).second == nullptr);
+}
+
+TEST_CASE("export cache", "[data_structures]")
+{
+  static_assert(rlbox::rlbox_export_name_hash("malloc") !=
+                  rlbox::rlbox_export_name_hash("free"),
+                "Export names are hashed at compile time");
+
+  rlbox::rlbox_export_cache cache;
+  int a = 0;
+  int b = 0;
+  int resolves = 0;
+  auto resolve_a = [&] {
+    resolves++;
+    return (void*)&a;
+  };
+  REQUIRE(cache.find("a") == nullptr);
+  REQUIRE(cache.lookup("a", resolve_a) == &a);
+  REQUIRE(cache.lookup("a", resolve_a) == &a);
+  REQUIRE(resolves == 1);
+  constexpr uint64_t hash_a = rlbox::rlbox_export_name_hash("a");
+  REQUIRE(cache.lookup(hash_a, "a", resolve_a) == &a);
+  REQUIRE(resolves == 1);
+
+  // Missing exports are not cached
+  auto resolve_missing = [&] {
+    resolves++;
+    return (void*)nullptr;
+  };
+  REQUIRE(cache.lookup("missing", resolve_missing) == nullptr);
+  REQUIRE(cache.lookup("missing", resolve_missing) == nullptr);
+  REQUIRE(resolves == 3);
+
+  // A name that collides with a cached one is never mistaken for it
+  cache.insert(rlbox::rlbox_export_name_hash("b"), "not_b", &b);
+  REQUIRE(cache.find(rlbox::rlbox_export_name_hash("b"), "b") == nullptr);
+
+  cache.clear();
+  REQUIRE(cache.find("a") == nullptr);
+}
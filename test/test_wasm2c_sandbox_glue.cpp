@@ -1,6 +1,8 @@
 #define RLBOX_USE_EXCEPTIONS
 #define RLBOX_ENABLE_DEBUG_ASSERTIONS
 #define RLBOX_SINGLE_THREADED_INVOCATIONS
+// Reuse the instances of destroyed sandboxes
+#define RLBOX_WASM2C_MAX_CACHED_INSTANCES 16
 #include "rlbox_wasm2c_sandbox.hpp"
 
 // NOLINTNEXTLINE
@@ -0,0 +1,364 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_ENABLE_DEBUG_ASSERTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <stdexcept>
+#include <string>
+
+#if !defined(_WIN32)
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "libtest.h"
+#include "rlbox.hpp"
+#include "rlbox_module_registry.hpp"
+#include "rlbox_wasm2c_sandbox_async.hpp"
+#include "rlbox_wasm2c_sandbox_pool.hpp"
+
+// Tests of creating, reusing and restoring sandbox instances
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+#if defined(_WIN32)
+#  define TestSandboxPath L"" GLUE_LIB_WASM2C_PATH
+#else
+#  define TestSandboxPath GLUE_LIB_WASM2C_PATH
+#endif
+#define CreateSandbox(sandbox) sandbox.create_sandbox(TestSandboxPath)
+
+using TestType = rlbox::rlbox_wasm2c_sandbox;
+
+// Throwing from a callback unwinds out of the sandbox in the middle of an
+// invocation, like a trap, and leaves the wasm stack pointer below the frame of
+// the sandbox function that called the callback
+static rlbox::tainted<int, TestType> throwing_callback(
+  rlbox::rlbox_sandbox<TestType>&,
+  rlbox::tainted<unsigned, TestType>,
+  rlbox::tainted<const char*, TestType>,
+  rlbox::tainted<unsigned*, TestType>)
+{
+  throw std::runtime_error("callback failed");
+}
+
+static void abort_invocation(rlbox::rlbox_sandbox<TestType>& sandbox)
+{
+  auto callback = sandbox.register_callback(throwing_callback);
+  auto str = sandbox.malloc_in_sandbox<char>(1);
+  *str = 0;
+  REQUIRE_THROWS(
+    sandbox.invoke_sandbox_function(simpleCallbackTest, 0u, str, callback));
+  sandbox.free_in_sandbox(str);
+  callback.unregister();
+}
+
+TEST_CASE("wasm sandbox pool", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_wasm2c_sandbox_pool pool;
+  REQUIRE(pool.create_pool(1, TestSandboxPath));
+
+  uintptr_t first_alloc = 0;
+  {
+    auto lease = pool.acquire();
+    REQUIRE(lease);
+    // Leak the allocation, releasing the lease should reclaim it
+    auto p = lease->malloc_in_sandbox<uint32_t>();
+    first_alloc = reinterpret_cast<uintptr_t>(p.UNSAFE_unverified());
+    REQUIRE(!pool.try_acquire());
+  }
+
+  {
+    auto lease = pool.acquire();
+    auto p = lease->malloc_in_sandbox<uint32_t>();
+    REQUIRE(reinterpret_cast<uintptr_t>(p.UNSAFE_unverified()) == first_alloc);
+    lease->free_in_sandbox(p);
+  }
+
+  void* stack_pointer = nullptr;
+  {
+    auto lease = pool.acquire();
+    auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(*lease);
+    stack_pointer = plugin->impl_lookup_data_export("__stack_pointer");
+    abort_invocation(*lease);
+    REQUIRE(plugin->impl_lookup_data_export("__stack_pointer") < stack_pointer);
+  }
+
+  {
+    // Releasing the lease reset the stack pointer of the aborted invocation
+    auto lease = pool.acquire();
+    void* reset_stack_pointer = rlbox::rlbox_wasm2c_sandbox::get_plugin(*lease)
+                                  ->impl_lookup_data_export("__stack_pointer");
+    REQUIRE(reset_stack_pointer == stack_pointer);
+    auto result = lease->invoke_sandbox_function(simpleAddNoPrintTest, 2, 3);
+    REQUIRE(result.UNSAFE_unverified() == 5);
+  }
+
+  pool.destroy_pool();
+}
+
+TEST_CASE("wasm sandbox async create", "[wasm_sandbox_tests]")
+{
+  const size_t count = 4;
+  auto futures =
+    rlbox::rlbox_wasm2c_create_sandboxes_async(count, TestSandboxPath);
+  REQUIRE(futures.size() == count);
+
+  for (auto& future : futures) {
+    auto sandbox = future.get();
+    REQUIRE(sandbox != nullptr);
+    auto p = sandbox->malloc_in_sandbox<uint32_t>();
+    REQUIRE(p != nullptr);
+    sandbox->free_in_sandbox(p);
+    sandbox->destroy_sandbox();
+  }
+
+  // Failures are reported through the fallible path
+#if defined(_WIN32)
+  auto failed = rlbox::rlbox_wasm2c_create_sandbox_async(L"does_not_exist");
+#else
+  auto failed = rlbox::rlbox_wasm2c_create_sandbox_async("does_not_exist");
+#endif
+  REQUIRE(failed.get() == nullptr);
+
+  // The eager binding options are copied, so their arrays may go away before
+  // the sandbox is created
+  std::future<rlbox::rlbox_wasm2c_sandbox_ptr> bound;
+  std::future<rlbox::rlbox_wasm2c_sandbox_ptr> missing;
+  {
+    std::string name = "simpleAddNoPrintTest";
+    const char* exports[] = { name.c_str() };
+    const char* missing_exports[] = { "does_not_exist" };
+    rlbox::rlbox_wasm2c_eager_bind eager_bind;
+    eager_bind.exports = exports;
+    eager_bind.export_count = 1;
+    bound = rlbox::rlbox_wasm2c_create_sandbox_async(
+      TestSandboxPath, 0, "", nullptr, &eager_bind);
+    eager_bind.exports = missing_exports;
+    missing = rlbox::rlbox_wasm2c_create_sandbox_async(
+      TestSandboxPath, 0, "", nullptr, &eager_bind);
+  }
+  auto sandbox = bound.get();
+  REQUIRE(sandbox != nullptr);
+  auto ret = sandbox->invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+               .UNSAFE_unverified();
+  REQUIRE(ret == 5);
+  sandbox->destroy_sandbox();
+  REQUIRE(missing.get() == nullptr);
+}
+
+#ifdef GLUE_LIB_WASM2C_IMAGE_PATH
+TEST_CASE("wasm sandbox preinit image", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  sandbox.create_sandbox(
+    TestSandboxPath, true, 0, "", GLUE_LIB_WASM2C_IMAGE_PATH);
+
+  // The image was written after rlbox_preinit ran
+  auto value = reinterpret_cast<int32_t*>(
+    sandbox.lookup_symbol("rlbox_preinit_value"));
+  REQUIRE(value != nullptr);
+  REQUIRE(*value == 42);
+
+  auto p = sandbox.malloc_in_sandbox<uint32_t>();
+  REQUIRE(p != nullptr);
+  sandbox.free_in_sandbox(p);
+  sandbox.destroy_sandbox();
+
+  rlbox::rlbox_sandbox<TestType> sandbox2;
+  REQUIRE(!sandbox2.create_sandbox(
+    TestSandboxPath, false /* infallible */, 0, "", "does_not_exist"));
+}
+#endif
+
+#if !defined(_WIN32)
+TEST_CASE("wasm sandbox preinit image identity", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  char image_path[] = "/tmp/rlbox_wasm2c_image_XXXXXX";
+  int fd = mkstemp(image_path);
+  REQUIRE(fd != -1);
+  close(fd);
+  void* stack_pointer = plugin->impl_lookup_data_export("__stack_pointer");
+  REQUIRE(plugin->impl_write_preinit_image(image_path));
+
+  // The image carries the stack pointer along with memory
+  abort_invocation(sandbox);
+  REQUIRE(plugin->impl_lookup_data_export("__stack_pointer") < stack_pointer);
+  std::string error_msg;
+  REQUIRE(plugin->impl_load_preinit_image(image_path, error_msg));
+  REQUIRE(plugin->impl_lookup_data_export("__stack_pointer") == stack_pointer);
+
+  // An image cut short must not be mapped
+  struct stat image_stat;
+  REQUIRE(stat(image_path, &image_stat) == 0);
+  REQUIRE(truncate(image_path, image_stat.st_size - 1) == 0);
+  REQUIRE(!plugin->impl_load_preinit_image(image_path, error_msg));
+  REQUIRE(truncate(image_path, image_stat.st_size) == 0);
+
+  // Pretend the image was written from another build of the module
+  using T_Header = rlbox::wasm2c_snapshot_detail::preinit_image_header;
+  FILE* image = std::fopen(image_path, "r+b");
+  REQUIRE(image != nullptr);
+  const uint64_t other_identity = 1;
+  REQUIRE(std::fseek(image, offsetof(T_Header, module_identity), SEEK_SET) ==
+          0);
+  REQUIRE(std::fwrite(&other_identity, sizeof(other_identity), 1, image) == 1);
+  std::fclose(image);
+  REQUIRE(!plugin->impl_load_preinit_image(image_path, error_msg));
+
+  unlink(image_path);
+  sandbox.destroy_sandbox();
+}
+#endif
+
+TEST_CASE("wasm sandbox eager bind", "[wasm_sandbox_tests]")
+{
+  const char* exports[] = { "simpleAddNoPrintTest", "errno" };
+  const rlbox::rlbox_wasm2c_signature signatures[] = {
+    &rlbox::rlbox_wasm2c_sandbox::prepare_signature<int(int, int)>
+  };
+  rlbox::rlbox_wasm2c_eager_bind eager_bind;
+  eager_bind.exports = exports;
+  eager_bind.export_count = 2;
+  eager_bind.signatures = signatures;
+  eager_bind.signature_count = 1;
+
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  REQUIRE(sandbox.create_sandbox(
+    TestSandboxPath, true, 0, "", nullptr, &eager_bind));
+  auto ret = sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+               .UNSAFE_unverified();
+  REQUIRE(ret == 5);
+  REQUIRE(
+    rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox)->impl_is_bound_eagerly());
+  sandbox.destroy_sandbox();
+
+  const char* missing[] = { "does_not_exist" };
+  eager_bind.exports = missing;
+  eager_bind.export_count = 1;
+  rlbox::rlbox_sandbox<TestType> sandbox2;
+  REQUIRE(!sandbox2.create_sandbox(
+    TestSandboxPath, false /* infallible */, 0, "", nullptr, &eager_bind));
+
+#if !defined(_WIN32)
+  // dlopen does not bind a module that is already loaded lazily again, so the
+  // sandbox gets the rest of the eager binding only
+  eager_bind.exports = exports;
+  eager_bind.export_count = 2;
+  rlbox::rlbox_sandbox<TestType> lazy;
+  CreateSandbox(lazy);
+  rlbox::rlbox_sandbox<TestType> sandbox3;
+  REQUIRE(sandbox3.create_sandbox(
+    TestSandboxPath, false /* infallible */, 0, "", nullptr, &eager_bind));
+  auto plugin3 = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox3);
+  REQUIRE(!plugin3->impl_is_bound_eagerly());
+  ret = sandbox3.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+          .UNSAFE_unverified();
+  REQUIRE(ret == 5);
+  sandbox3.destroy_sandbox();
+
+  // Unless eager binding is required
+  eager_bind.require_eager_binding = true;
+  rlbox::rlbox_sandbox<TestType> sandbox4;
+  REQUIRE(!sandbox4.create_sandbox(
+    TestSandboxPath, false /* infallible */, 0, "", nullptr, &eager_bind));
+  lazy.destroy_sandbox();
+#endif
+}
+
+TEST_CASE("wasm sandbox snapshot", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  auto p = sandbox.malloc_in_sandbox<uint32_t>();
+  *p = 1;
+
+  rlbox::rlbox_wasm2c_snapshot snapshot;
+  plugin->impl_take_snapshot(snapshot);
+  REQUIRE(!snapshot.empty());
+
+  *p = 2;
+  auto q = sandbox.malloc_in_sandbox<uint32_t>();
+
+  // The stack pointer is saved with the snapshot, so an invocation aborted
+  // after the snapshot was taken is undone too
+  void* stack_pointer = plugin->impl_lookup_data_export("__stack_pointer");
+  REQUIRE(stack_pointer != nullptr);
+  abort_invocation(sandbox);
+  REQUIRE(plugin->impl_lookup_data_export("__stack_pointer") < stack_pointer);
+
+  plugin->impl_restore_snapshot(snapshot);
+  REQUIRE(*(p.UNSAFE_unverified()) == 1);
+  REQUIRE(plugin->impl_lookup_data_export("__stack_pointer") == stack_pointer);
+
+  // q was allocated after the snapshot, so it is free again
+  auto r = sandbox.malloc_in_sandbox<uint32_t>();
+  REQUIRE(r.UNSAFE_unverified() == q.UNSAFE_unverified());
+  REQUIRE(sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+            .UNSAFE_unverified() == 5);
+
+  sandbox.free_in_sandbox(r);
+  sandbox.free_in_sandbox(p);
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox shared module", "[wasm_sandbox_tests]")
+{
+  using T_Registry = rlbox::rlbox_module_registry<wasm2c_sandbox_funcs_t>;
+  rlbox::rlbox_sandbox<TestType> sandbox1;
+  rlbox::rlbox_sandbox<TestType> sandbox2;
+  CreateSandbox(sandbox1);
+  auto module = T_Registry::find(TestSandboxPath, "");
+  REQUIRE(module != nullptr);
+  REQUIRE(T_Registry::use_count(module) == 1);
+
+  // The second sandbox uses the module loaded by the first
+  CreateSandbox(sandbox2);
+  REQUIRE(T_Registry::find(TestSandboxPath, "") == module);
+  REQUIRE(T_Registry::use_count(module) == 2);
+
+  // Acquiring a loaded module does not load or initialize it again
+  bool initialized = false;
+  std::string error_msg;
+  auto acquired = T_Registry::acquire(
+    TestSandboxPath,
+    "",
+    RLBOX_WASM2C_DLOPEN_FLAGS,
+    [&](auto&, std::string&) {
+      initialized = true;
+      return true;
+    },
+    error_msg);
+  REQUIRE(acquired == module);
+  REQUIRE(!initialized);
+  REQUIRE(T_Registry::use_count(module) == 3);
+  T_Registry::release(acquired);
+  REQUIRE(T_Registry::use_count(module) == 2);
+
+  // The library stays loaded while any sandbox still uses it
+  sandbox1.destroy_sandbox();
+  REQUIRE(T_Registry::find(TestSandboxPath, "") == module);
+  REQUIRE(T_Registry::use_count(module) == 1);
+  auto p = sandbox2.malloc_in_sandbox<uint32_t>();
+  REQUIRE(p != nullptr);
+  sandbox2.free_in_sandbox(p);
+
+  // and is unloaded with the last one
+  sandbox2.destroy_sandbox();
+  REQUIRE(T_Registry::find(TestSandboxPath, "") == nullptr);
+}
@@ -0,0 +1,294 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_ENABLE_DEBUG_ASSERTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "libtest.h"
+#include "rlbox.hpp"
+#include "rlbox_batch.hpp"
+#include "rlbox_export_cache.hpp"
+#include "rlbox_sandbox_arena.hpp"
+#include "rlbox_wasm2c_bulk_malloc.hpp"
+#include "rlbox_wasm2c_file_window.hpp"
+#include "rlbox_wasm2c_global.hpp"
+
+// Tests of passing data between the host and sandbox memory, and of batched
+// calls
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+#if defined(_WIN32)
+#  define TestSandboxPath L"" GLUE_LIB_WASM2C_PATH
+#else
+#  define TestSandboxPath GLUE_LIB_WASM2C_PATH
+#endif
+#define CreateSandbox(sandbox) sandbox.create_sandbox(TestSandboxPath)
+
+using TestType = rlbox::rlbox_wasm2c_sandbox;
+
+TEST_CASE("wasm sandbox batch", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+
+  rlbox::rlbox_batch<TestType> batch(sandbox);
+  const int32_t count = 16;
+  for (int32_t i = 0; i < count; i++) {
+    REQUIRE(rlbox_batch_add(batch, simpleAddNoPrintTest, i, 2 * i) ==
+            static_cast<size_t>(i));
+  }
+  REQUIRE(batch.size() == count);
+
+  auto results = batch.run();
+  REQUIRE(results.size() == count);
+  for (int32_t i = 0; i < count; i++) {
+    REQUIRE(results[i].UNSAFE_unverified() == 3 * i);
+  }
+  REQUIRE(batch.size() == 0);
+
+  // Pointers are passed as tainted pointers, and size_t is 32-bit in wasm2c
+  auto str = sandbox.malloc_in_sandbox<char>(6);
+  std::strcpy(str.unverified_safe_pointer_because(6, "writing a string"),
+              "Hello");
+  rlbox_batch_add(batch, simpleStrLenTest, str);
+  auto lengths = batch.run();
+  REQUIRE(lengths[0].UNSAFE_unverified() == 5);
+  sandbox.free_in_sandbox(str);
+
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox bulk malloc", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+
+  const uint32_t sizes[] = { 4, 64, 1, 4096, 100000, 32 };
+  const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+  auto ptrs =
+    rlbox::rlbox_wasm2c_malloc_in_sandbox_bulk<char>(sandbox, sizes, count);
+  REQUIRE(ptrs.size() == count);
+
+  for (size_t i = 0; i < count; i++) {
+    REQUIRE(ptrs[i] != nullptr);
+    char* p = ptrs[i].unverified_safe_pointer_because(sizes[i], "writing");
+    std::memset(p, static_cast<int>(i), sizes[i]);
+  }
+  for (size_t i = 0; i < count; i++) {
+    char* p = ptrs[i].unverified_safe_pointer_because(sizes[i], "reading");
+    REQUIRE(p[0] == static_cast<char>(i));
+    REQUIRE(p[sizes[i] - 1] == static_cast<char>(i));
+  }
+
+  rlbox::rlbox_wasm2c_free_in_sandbox_bulk(sandbox, ptrs);
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox arena", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+
+  {
+    rlbox::rlbox_sandbox_arena<TestType> arena(sandbox, 256);
+    auto a = arena.allocate<char>(6);
+    auto b = arena.allocate<uint32_t>(4);
+    REQUIRE(a != nullptr);
+    REQUIRE(b != nullptr);
+    // Allocations are consecutive pieces of one sandbox allocation
+    auto a_raw = a.unverified_safe_pointer_because(6, "testing");
+    auto b_raw = b.unverified_safe_pointer_because(4, "testing");
+    REQUIRE(reinterpret_cast<uintptr_t>(b_raw) -
+              reinterpret_cast<uintptr_t>(a_raw) ==
+            16);
+
+    // Allocations larger than the arena fall back to malloc_in_sandbox
+    auto big = arena.allocate<char>(1024);
+    REQUIRE(big != nullptr);
+
+    std::strcpy(a_raw, "hello");
+    auto len = sandbox.invoke_sandbox_function(simpleStrLenTest, a)
+                 .copy_and_verify([](size_t val) { return val; });
+    REQUIRE(len == 5);
+  }
+
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox bulk copy", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = TestType::get_plugin(sandbox);
+
+  // Large enough to take the non-temporal path
+  const size_t len = RLBOX_NONTEMPORAL_COPY_THRESHOLD + 3;
+  std::vector<char> src(len);
+  for (size_t i = 0; i < len; i++) {
+    src[i] = static_cast<char>(i * 7);
+  }
+
+  auto buf = sandbox.malloc_in_sandbox<char>(static_cast<uint32_t>(len));
+  REQUIRE(buf != nullptr);
+  auto buf_ptr = plugin->impl_get_sandboxed_pointer<char*>(
+    buf.unverified_safe_pointer_because(len, "testing"));
+
+  plugin->impl_copy_to_sandbox(buf_ptr + 1, src.data(), len - 1);
+  std::vector<char> dst(len, 0);
+  plugin->impl_copy_from_sandbox(dst.data(), buf_ptr + 1, len - 1);
+  REQUIRE(std::memcmp(dst.data(), src.data(), len - 1) == 0);
+
+  // Ranges that leave sandbox memory are rejected
+  const size_t total = plugin->impl_get_total_memory();
+  REQUIRE_THROWS(plugin->impl_copy_from_sandbox(
+    dst.data(), static_cast<TestType::T_PointerType>(total - 2), 4));
+
+  sandbox.free_in_sandbox(buf);
+  sandbox.destroy_sandbox();
+}
+
+#if defined(__linux__)
+TEST_CASE("wasm sandbox grant access", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+  auto plugin = TestType::get_plugin(sandbox);
+
+  const size_t len = 3 * 4096 + 10;
+  auto host = static_cast<char*>(rlbox::rlbox_wasm2c_alloc_shared_buffer(len));
+  REQUIRE(host != nullptr);
+  std::memset(host, 'a', len);
+
+  bool success = false;
+  char* granted = plugin->impl_grant_access(host, len, success);
+  REQUIRE(success);
+  REQUIRE(granted != host);
+  REQUIRE(sandbox.is_pointer_in_sandbox_memory(granted));
+  // The host and the sandbox see the same memory
+  REQUIRE(granted[len - 1] == 'a');
+  granted[0] = 'b';
+  REQUIRE(host[0] == 'b');
+
+  // Granted memory must stay shared with the host, so it can't be snapshotted
+  rlbox::rlbox_wasm2c_snapshot snapshot;
+  REQUIRE_THROWS(plugin->impl_take_snapshot(snapshot));
+
+  char* denied = plugin->impl_deny_access(granted, len, success);
+  REQUIRE(success);
+  REQUIRE(denied == host);
+  // The sandbox no longer sees the host memory
+  REQUIRE(granted[len - 1] == 0);
+  REQUIRE(host[0] == 'b');
+
+  // Buffers that are not shared are not granted
+  std::vector<char> unshared(len);
+  plugin->impl_grant_access(unshared.data(), len, success);
+  REQUIRE(!success);
+
+  rlbox::rlbox_wasm2c_free_shared_buffer(host);
+  sandbox.destroy_sandbox();
+}
+#endif
+
+#if !defined(_WIN32)
+TEST_CASE("wasm sandbox file window", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+
+  // A file larger than the window
+  FILE* file = std::tmpfile();
+  REQUIRE(file != nullptr);
+  const size_t file_size = 5 * 4096 + 123;
+  std::vector<char> contents(file_size);
+  for (size_t i = 0; i < file_size; i++) {
+    contents[i] = static_cast<char>(i % 251);
+  }
+  REQUIRE(std::fwrite(contents.data(), 1, file_size, file) == file_size);
+  REQUIRE(std::fflush(file) == 0);
+
+  {
+    rlbox::rlbox_wasm2c_file_window window(sandbox, fileno(file), 2 * 4096);
+    REQUIRE(window.total_size() == file_size);
+
+    // Consume the file in uneven steps, as a decoder would
+    size_t read = 0;
+    while (window.size() != 0) {
+      auto data = window.data();
+      REQUIRE(data != nullptr);
+      REQUIRE(sandbox.is_pointer_in_sandbox_memory(
+        data.unverified_safe_pointer_because(1, "testing")));
+      const size_t step = window.size() < 1000 ? window.size() : 1000;
+      const char* chunk = data.unverified_safe_pointer_because(step, "testing");
+      REQUIRE(std::memcmp(chunk, contents.data() + read, step) == 0);
+      read += step;
+      REQUIRE(window.advance(step));
+      REQUIRE(window.offset() == read);
+    }
+    REQUIRE(read == file_size);
+  }
+
+  std::fclose(file);
+  sandbox.destroy_sandbox();
+}
+#endif
+
+TEST_CASE("wasm sandbox export cache", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox1;
+  rlbox::rlbox_sandbox<TestType> sandbox2;
+  CreateSandbox(sandbox1);
+  CreateSandbox(sandbox2);
+
+  // Functions are shared by the module, globals are in each sandbox's heap
+  void* func = sandbox1.lookup_symbol("malloc");
+  REQUIRE(func != nullptr);
+  REQUIRE(sandbox1.lookup_symbol("malloc") == func);
+  REQUIRE(sandbox2.lookup_symbol("malloc") == func);
+  void* errno1 = sandbox1.lookup_symbol("errno");
+  void* errno2 = sandbox2.lookup_symbol("errno");
+  REQUIRE(errno1 != errno2);
+  // Later lookups are served from the cache
+  REQUIRE(sandbox1.lookup_symbol("errno") == errno1);
+
+  // Lookups with a name hash computed at compile time
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox1);
+  constexpr uint64_t malloc_hash = rlbox::rlbox_export_name_hash("malloc");
+  REQUIRE(plugin->impl_lookup_symbol(malloc_hash, "malloc") == func);
+
+  // Typed handles reach the data the module itself uses
+  rlbox::rlbox_wasm2c_global<int32_t> errno_global(sandbox1, "errno");
+  REQUIRE(errno_global);
+  int32_t* errno_ptr = errno_global.get().UNSAFE_unverified();
+  REQUIRE(sandbox1.is_pointer_in_sandbox_memory(errno_ptr));
+  *errno_ptr = 0;
+  // A failed allocation in the sandbox sets its errno
+  REQUIRE(plugin->impl_malloc_in_sandbox(0xFFFFFFF0u) == 0);
+  REQUIRE(*errno_ptr != 0);
+  REQUIRE(sandbox1.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+            .UNSAFE_unverified() == 5);
+  rlbox::rlbox_wasm2c_global<int32_t> missing_global(sandbox1, "missing");
+  REQUIRE(!missing_global);
+
+  // A new sandbox, which may reuse the instance of a destroyed one, looks its
+  // globals up again
+  sandbox1.destroy_sandbox();
+  CreateSandbox(sandbox1);
+  void* errno3 = sandbox1.lookup_symbol("errno");
+  REQUIRE(errno3 != nullptr);
+  REQUIRE(errno3 != errno2);
+  REQUIRE(sandbox1.lookup_symbol("malloc") == func);
+
+  sandbox1.destroy_sandbox();
+  sandbox2.destroy_sandbox();
+}
@@ -0,0 +1,151 @@
+#define RLBOX_USE_EXCEPTIONS
+#define RLBOX_ENABLE_DEBUG_ASSERTIONS
+#define RLBOX_SINGLE_THREADED_INVOCATIONS
+#include "rlbox_wasm2c_sandbox.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <vector>
+
+// IWYU pragma: no_forward_declare mpl_::na
+#include "catch2/catch.hpp"
+#include "libtest.h"
+#include "rlbox.hpp"
+#include "rlbox_parallel_map.hpp"
+#include "rlbox_sandbox_executor.hpp"
+#include "rlbox_sandbox_worker.hpp"
+
+// Tests of using sandboxes from worker threads
+
+#ifndef GLUE_LIB_WASM2C_PATH
+#  error "Missing definition for GLUE_LIB_WASM2C_PATH"
+#endif
+
+#if defined(_WIN32)
+#  define TestSandboxPath L"" GLUE_LIB_WASM2C_PATH
+#else
+#  define TestSandboxPath GLUE_LIB_WASM2C_PATH
+#endif
+#define CreateSandbox(sandbox) sandbox.create_sandbox(TestSandboxPath)
+
+using TestType = rlbox::rlbox_wasm2c_sandbox;
+
+TEST_CASE("wasm sandbox worker", "[wasm_sandbox_tests]")
+{
+  rlbox::rlbox_sandbox<TestType> sandbox;
+  CreateSandbox(sandbox);
+
+  {
+    // Tasks for the owner thread are queued and run here
+    std::vector<std::function<void()>> owner_tasks;
+    std::mutex owner_lock;
+    rlbox::rlbox_sandbox_worker<TestType> worker(
+      sandbox, [&](std::function<void()> task) {
+        std::lock_guard<std::mutex> guard(owner_lock);
+        owner_tasks.push_back(std::move(task));
+      });
+
+    auto result = worker.submit([&] {
+      return sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3)
+        .copy_and_verify([](int val) { return val; });
+    });
+    REQUIRE(result.get() == 5);
+
+    auto on_worker = worker.submit([&] { return worker.is_worker_thread(); });
+    REQUIRE(on_worker.get());
+    REQUIRE(!worker.is_worker_thread());
+
+    // Functions marshaled by the worker run on the owner thread
+    auto marshaled = worker.submit([&] {
+      return worker.marshal([&] { return !worker.is_worker_thread(); });
+    });
+    bool ran = false;
+    while (!ran) {
+      std::lock_guard<std::mutex> guard(owner_lock);
+      for (auto& task : owner_tasks) {
+        task();
+        ran = true;
+      }
+      owner_tasks.clear();
+    }
+    REQUIRE(marshaled.get());
+  }
+
+  sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox executor", "[wasm_sandbox_tests]")
+{
+  using T_Sandbox = rlbox::rlbox_sandbox<TestType>;
+  rlbox::rlbox_sandbox_executor<TestType> executor;
+  REQUIRE(executor.start(4, TestSandboxPath));
+  REQUIRE(executor.size() == 4);
+
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < 100; i++) {
+    results.push_back(executor.submit([i](T_Sandbox& sandbox) {
+      return sandbox.invoke_sandbox_function(simpleAddNoPrintTest, i, i)
+        .copy_and_verify([](int val) { return val; });
+    }));
+  }
+  for (int i = 0; i < 100; i++) {
+    REQUIRE(results[i].get() == 2 * i);
+  }
+
+  executor.stop();
+  REQUIRE(executor.size() == 0);
+}
+
+TEST_CASE("wasm sandbox parallel map", "[wasm_sandbox_tests]")
+{
+  using T_Sandbox = rlbox::rlbox_sandbox<TestType>;
+  std::vector<int> input(1050);
+  for (size_t i = 0; i < input.size(); i++) {
+    input[i] = static_cast<int>(i);
+  }
+
+  auto sum_chunk = [](T_Sandbox& sandbox, auto chunk, size_t count) {
+    const int* values = chunk.unverified_safe_pointer_because(count, "testing");
+    int sum = 0;
+    for (size_t i = 0; i < count; i++) {
+      sum += values[i];
+    }
+    return sandbox.invoke_sandbox_function(simpleAddNoPrintTest, sum, 0)
+      .copy_and_verify([](int val) { return val; });
+  };
+
+  rlbox::rlbox_parallel_map_options options;
+  options.chunk_size = 100;
+  options.parallelism = 3;
+
+  rlbox::rlbox_sandbox_executor<TestType> executor;
+  REQUIRE(executor.start(4, TestSandboxPath));
+  auto sums = rlbox::rlbox_parallel_map(
+    executor, input.data(), input.size(), sum_chunk, options);
+
+  // Results that std::vector packs into bits are written by each task safely
+  auto has_odd_sum = [&](T_Sandbox& sandbox, auto chunk, size_t count) {
+    return sum_chunk(sandbox, chunk, count) % 2 != 0;
+  };
+  auto odd = rlbox::rlbox_parallel_map(
+    executor, input.data(), input.size(), has_odd_sum, options);
+  executor.stop();
+
+  REQUIRE(sums.size() == 11);
+  for (size_t chunk = 0; chunk < sums.size(); chunk++) {
+    int expected = 0;
+    for (size_t i = chunk * 100; i < std::min<size_t>((chunk + 1) * 100, 1050);
+         i++) {
+      expected += input[i];
+    }
+    REQUIRE(sums[chunk] == expected);
+    REQUIRE(odd[chunk] == (expected % 2 != 0));
+  }
+
+  auto new_replica_sums = rlbox::rlbox_parallel_map_new_replicas<TestType>(
+    input.data(), input.size(), sum_chunk, options, TestSandboxPath);
+  REQUIRE(new_replica_sums == sums);
+}
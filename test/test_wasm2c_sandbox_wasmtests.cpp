@@ -1,9 +1,13 @@
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
 
 // IWYU pragma: no_forward_declare mpl_::na
 #include "catch2/catch.hpp"
 #include "libtest.h"
 #include "rlbox.hpp"
+#include "rlbox_sandbox_session.hpp"
 
 #ifndef CreateSandbox
 #  error "Define CreateSandbox before including this file"
@@ -42,3 +46,183 @@ TEST_CASE("wasm sandbox fallible create " TestName, "[wasm_sandbox_tests]")
   bool ret = CreateSandboxFallible(sandbox);
   REQUIRE(ret == false);
 }
+
+#if RLBOX_WASM2C_MAX_CACHED_INSTANCES != 0
+TEST_CASE("wasm sandbox instance cache " TestName, "[wasm_sandbox_tests]")
+{
+    void* heap = nullptr;
+    uintptr_t first_alloc = 0;
+    {
+        rlbox::rlbox_sandbox<TestType> sandbox;
+        CreateSandbox(sandbox);
+        heap = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox)
+                   ->impl_get_memory_location();
+        // Leak the allocation, the instance should be reset before reuse
+        auto p = sandbox.malloc_in_sandbox<uint32_t>();
+        first_alloc = reinterpret_cast<uintptr_t>(p.UNSAFE_unverified());
+        sandbox.destroy_sandbox();
+    }
+
+    rlbox::rlbox_sandbox<TestType> sandbox;
+    CreateSandbox(sandbox);
+    // The heap reservation of the destroyed sandbox is reused
+    REQUIRE(rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox)
+                ->impl_get_memory_location() == heap);
+    auto p = sandbox.malloc_in_sandbox<uint32_t>();
+    REQUIRE(reinterpret_cast<uintptr_t>(p.UNSAFE_unverified()) == first_alloc);
+    sandbox.free_in_sandbox(p);
+    sandbox.destroy_sandbox();
+}
+#endif
+
+TEST_CASE("wasm sandbox session " TestName, "[wasm_sandbox_tests]")
+{
+    rlbox::rlbox_sandbox<TestType> sandbox;
+    CreateSandbox(sandbox);
+
+    {
+        rlbox::rlbox_sandbox_session<TestType> session(sandbox);
+        auto result =
+            sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 2, 3);
+        REQUIRE(result.UNSAFE_unverified() == 5);
+        {
+            // Nested sessions leave ownership with the outer session
+            rlbox::rlbox_sandbox_session<TestType> nested(sandbox);
+            result =
+                sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 4, 5);
+            REQUIRE(result.UNSAFE_unverified() == 9);
+        }
+        result = sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 6, 7);
+        REQUIRE(result.UNSAFE_unverified() == 13);
+    }
+
+    auto result = sandbox.invoke_sandbox_function(simpleAddNoPrintTest, 1, 1);
+    REQUIRE(result.UNSAFE_unverified() == 2);
+    sandbox.destroy_sandbox();
+}
+
+// Invokes the sandbox holding a session from a callback of another sandbox
+static std::function<int()> session_reentry;
+
+static rlbox::tainted<int, TestType> session_callback_a(
+  rlbox::rlbox_sandbox<TestType>&,
+  rlbox::tainted<unsigned, TestType>,
+  rlbox::tainted<const char*, TestType>,
+  rlbox::tainted<unsigned*, TestType>)
+{
+  return 1;
+}
+
+static rlbox::tainted<int, TestType> session_callback_b(
+  rlbox::rlbox_sandbox<TestType>&,
+  rlbox::tainted<unsigned, TestType>,
+  rlbox::tainted<const char*, TestType>,
+  rlbox::tainted<unsigned*, TestType>)
+{
+  return session_reentry();
+}
+
+TEST_CASE("wasm sandbox session callback from another sandbox " TestName,
+          "[wasm_sandbox_tests]")
+{
+    rlbox::rlbox_sandbox<TestType> sandbox_a;
+    rlbox::rlbox_sandbox<TestType> sandbox_b;
+    CreateSandbox(sandbox_a);
+    CreateSandbox(sandbox_b);
+
+    // Both callbacks are in the first callback slot of their sandbox
+    auto callback_a = sandbox_a.register_callback(session_callback_a);
+    auto callback_b = sandbox_b.register_callback(session_callback_b);
+    auto str_a = sandbox_a.malloc_in_sandbox<char>(1);
+    auto str_b = sandbox_b.malloc_in_sandbox<char>(1);
+    *str_a = 0;
+    *str_b = 0;
+    session_reentry = [&] {
+        return sandbox_a
+            .invoke_sandbox_function(simpleCallbackTest, 0u, str_a, callback_a)
+            .UNSAFE_unverified();
+    };
+
+    {
+        rlbox::rlbox_sandbox_session<TestType> session(sandbox_a);
+        REQUIRE(session_reentry() == 1);
+
+        // A callback of another sandbox that invokes the session's sandbox must
+        // still dispatch the session sandbox's own callbacks
+        auto result = sandbox_b.invoke_sandbox_function(
+            simpleCallbackTest, 0u, str_b, callback_b);
+        REQUIRE(result.UNSAFE_unverified() == 1);
+
+        // As must invocations while a session on another sandbox is open
+        {
+            rlbox::rlbox_sandbox_session<TestType> session_b(sandbox_b);
+            REQUIRE(session_reentry() == 1);
+        }
+        REQUIRE(session_reentry() == 1);
+    }
+    session_reentry = nullptr;
+
+    sandbox_a.free_in_sandbox(str_a);
+    sandbox_b.free_in_sandbox(str_b);
+    callback_a.unregister();
+    callback_b.unregister();
+    sandbox_a.destroy_sandbox();
+    sandbox_b.destroy_sandbox();
+}
+
+static rlbox::tainted<int, TestType> slot_reuse_callback(
+  rlbox::rlbox_sandbox<TestType>&,
+  rlbox::tainted<int, TestType> value)
+{
+  return value;
+}
+
+TEST_CASE("wasm sandbox callback slot reuse " TestName, "[wasm_sandbox_tests]")
+{
+    rlbox::rlbox_sandbox<TestType> sandbox;
+    CreateSandbox(sandbox);
+
+    // More registrations than there are slots, as unregistering frees them
+    for (int i = 0; i < 1000; i++) {
+        auto callback = sandbox.register_callback(slot_reuse_callback);
+        callback.unregister();
+    }
+
+    // The same callback registered twice gets a slot for each registration
+    auto first = sandbox.register_callback(slot_reuse_callback);
+    auto second = sandbox.register_callback(slot_reuse_callback);
+    first.unregister();
+    second.unregister();
+
+    sandbox.destroy_sandbox();
+}
+
+TEST_CASE("wasm sandbox host allocator " TestName, "[wasm_sandbox_tests]")
+{
+    rlbox::rlbox_sandbox<TestType> sandbox;
+    CreateSandbox(sandbox);
+
+    // Mix small allocations, which may be served on the host, with large ones
+    std::vector<rlbox::tainted<char*, TestType>> ptrs;
+    for (size_t size : { 1, 16, 17, 100, 2048, 2049, 10000 }) {
+        auto p = sandbox.malloc_in_sandbox<char>(static_cast<uint32_t>(size));
+        REQUIRE(p != nullptr);
+        std::memset(
+            p.unverified_safe_pointer_because(size, "writing"), 0xAB, size);
+        ptrs.push_back(p);
+    }
+    for (auto& p : ptrs) {
+        sandbox.free_in_sandbox(p);
+    }
+
+    // The sandboxed library's own malloc still works alongside
+    auto str = sandbox.malloc_in_sandbox<char>(6);
+    std::strcpy(str.unverified_safe_pointer_because(6, "writing"), "hello");
+    auto len =
+        sandbox.invoke_sandbox_function(simpleStrLenTest, str)
+            .copy_and_verify([](size_t val) { return val; });
+    REQUIRE(len == 5);
+    sandbox.free_in_sandbox(str);
+
+    sandbox.destroy_sandbox();
+}
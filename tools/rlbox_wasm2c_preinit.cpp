@@ -0,0 +1,72 @@
+// Build time tool that creates a pre-initialized memory image of a wasm2c
+// module. It instantiates the module once, runs the given initialization export
+// and writes the resulting linear memory to an image. Sandboxes created with
+// this image, see impl_create_sandbox, start with initialization already done.
+//
+// Usage: rlbox_wasm2c_preinit <module library> <output image>
+//            [init export] [module name]
+
+#include <cstdio>
+#include <cstdlib>
+
+// The wasm2c plugin, which must be included before the rlbox frontend
+#include "impl.hpp"
+// IWYU pragma: no_forward_declare mpl_::na
+#include "rlbox.hpp"
+
+#if defined(_WIN32)
+#  include <string>
+#endif
+
+int main(int argc, char* argv[])
+{
+  if (argc < 3 || argc > 5) {
+    std::fprintf(stderr,
+                 "Usage: %s <module library> <output image> [init export] "
+                 "[module name]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char* library_path = argv[1];
+  const char* image_path = argv[2];
+  const char* init_export = argc > 3 ? argv[3] : nullptr;
+  const char* module_name = argc > 4 ? argv[4] : "";
+
+#if defined(_WIN32)
+  // Library paths are only passed as ascii by the build
+  std::string library_path_str = library_path;
+  std::wstring library_path_wstr(library_path_str.begin(),
+                                 library_path_str.end());
+  path_buf module_path = library_path_wstr.c_str();
+#else
+  path_buf module_path = library_path;
+#endif
+
+  rlbox::rlbox_sandbox<rlbox::rlbox_wasm2c_sandbox> sandbox;
+  if (!sandbox.create_sandbox(
+        module_path, false /* infallible */, 0, module_name)) {
+    std::fprintf(stderr, "Could not create sandbox from %s\n", library_path);
+    return EXIT_FAILURE;
+  }
+  auto plugin = rlbox::rlbox_wasm2c_sandbox::get_plugin(sandbox);
+
+  if (init_export != nullptr) {
+    void* init_func = plugin->impl_lookup_symbol(init_export);
+    if (init_func == nullptr) {
+      std::fprintf(stderr, "Could not find export %s\n", init_export);
+      sandbox.destroy_sandbox();
+      return EXIT_FAILURE;
+    }
+    plugin->impl_invoke_with_func_ptr<void(), void()>(
+      reinterpret_cast<void (*)()>(init_func));
+  }
+
+  bool written = plugin->impl_write_preinit_image(image_path);
+  sandbox.destroy_sandbox();
+  if (!written) {
+    std::fprintf(stderr, "Could not write image %s\n", image_path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}